@@ -94,6 +94,9 @@ std::vector<std::vector<int>> RouteUsingSingleCenter(PointSet& points, PointSet&
     centers.d = points.d;
     centers.n = clusters.size();
     centers.Alloc();
+#ifdef MIPS_DISTANCE
+    points.ComputeNorms();
+#endif
     parlay::parallel_for(0, clusters.size(), [&](size_t c) {
         // avoid false sharing
         PointSet CC;
@@ -106,7 +109,7 @@ std::vector<std::vector<int>> RouteUsingSingleCenter(PointSet& points, PointSet&
         for (uint32_t v : clusters[c]) {
             float* V = points.GetPoint(v);
 #ifdef MIPS_DISTANCE
-            double norm = vec_norm(V, centers.d);
+            double norm = points.norms[v];
             norm_sum += norm;
             float multiplier = 1.0f / std::sqrt(norm);
             for (size_t j = 0; j < centers.d; ++j) {
@@ -163,7 +166,7 @@ int main(int argc, const char* argv[]) {
     Cover cover = ConvertClustersToCover(clusters);
     size_t num_shards = clusters.size();
 #else
-    auto partition = ReadMetisPartition(partition_file);
+    auto partition = ReadPartition(partition_file);
     auto clusters = ConvertPartitionToClusters(partition);
     size_t num_shards = clusters.size();
 #endif
@@ -19,7 +19,7 @@ int main(int argc, const char* argv[]) {
 #endif
 #if false
     std::string file = argv[1];
-    Partition partition = ReadMetisPartition(file);
+    Partition partition = ReadPartition(file);
     Clusters clusters = ConvertPartitionToClusters(partition);
     std::string out_file = argv[2];
     WriteClusters(clusters, out_file);
@@ -67,25 +67,28 @@ int main(int argc, const char* argv[]) {
     }
 
     std::string searches_file = argv[2];
-    auto searches = DeserializeShardSearches(searches_file);
-
-    std::cout << "Finished loading searches" << std::endl;
 
     std::string routes_file = argv[1];
     auto routes = DeserializeRoutes(routes_file);
 
-    std::cout << "num routes " << routes.size() << " num searches " << searches.size() << std::endl;
+    std::cout << "num routes " << routes.size() << std::endl;
 
     std::string output_file = argv[3];
     std::string part_method = argv[4];
     std::string query_file = argv[5];
 
-    int num_actual_shards = searches.front().neighbors.size();
+    // the searches are streamed from disk, so take the number of shards from the routes
+    int num_actual_shards = 0;
+    for (const auto& route : routes) {
+        for (const auto& probes : route.buckets_to_probe) {
+            for (int b : probes) num_actual_shards = std::max(num_actual_shards, b + 1);
+        }
+    }
     std::cout << "num actual shards = " << num_actual_shards << std::endl;
 
     auto queries = ReadPoints(query_file);
     int num_queries = queries.n;
 
-    PrintCombinationsOfRoutesAndSearches(routes, searches, output_file, 10, num_queries, num_actual_shards, 40, part_method);
+    PrintCombinationsOfRoutesAndSearches(routes, searches_file, output_file, 10, num_queries, num_actual_shards, 40, part_method);
 #endif
 }
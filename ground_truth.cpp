@@ -0,0 +1,33 @@
+#include <iostream>
+
+#include "distance_matrix.h"
+#include "points_io.h"
+
+int main(int argc, const char* argv[]) {
+    std::vector<std::string> args(argv, argv + argc);
+    std::string storage_name = TakeStorageFlag(args, "float32");
+    if (args.size() != 5) {
+        std::cerr << "Usage ./GroundTruth input-points queries output-file num-neighbors [--storage=float32|fp16|bf16|native|mmap|mmap-populate]"
+                  << std::endl;
+        std::abort();
+    }
+
+    std::string point_file = args[1];
+    std::string query_file = args[2];
+    std::string output_file = args[3];
+    int num_neighbors = std::stoi(args[4]);
+
+    PointSet points = ReadPointsWithStorage(point_file, storage_name);
+    std::cout << "Finished reading points. Stored as " << ElementTypeName(points.element_type) << (points.IsMapped() ? " (mapped)" : "") << std::endl;
+    PointSet queries = ReadPoints(query_file);
+    if (points.d != queries.d) {
+        std::cerr << "The points have dimension " << points.d << " but the queries have dimension " << queries.d << std::endl;
+        std::abort();
+    }
+
+    Timer timer;
+    timer.Start();
+    std::vector<NNVec> ground_truth = ExactNearestNeighbors(points, queries, num_neighbors);
+    std::cout << "Computing the ground truth took " << timer.Stop() << " s" << std::endl;
+    WriteGroundTruth(output_file, ground_truth);
+}
@@ -57,7 +57,7 @@ int main(int argc, const char* argv[]) {
     Cover cover = ConvertClustersToCover(clusters);
     size_t num_shards = clusters.size();
 #else
-    auto partition = ReadMetisPartition(partition_file);
+    auto partition = ReadPartition(partition_file);
     size_t num_shards = NumPartsInPartition(partition);
     Cover cover = ConvertPartitionToCover(partition);
 #endif
@@ -6,7 +6,9 @@
 #include "metis_io.h"
 #include "overlapping_partitioning.h"
 #include "partitioning.h"
+#include "point_stream.h"
 #include "points_io.h"
+#include "shard_export.h"
 
 #include <parlay/primitives.h>
 
@@ -29,37 +31,35 @@ void saveBalancedKMeansCentroids(PointSet& centroids, const std::string& filepat
     std::cout << "Centroids saved to " << filepath << " with n=" << n << ", d=" << d << std::endl;
 }
 
-void saveBalancedKMeansParitionResults(std::vector<int> partition_result, const std::string& filepath) {
-    std::ofstream out(filepath, std::ios::binary);
-    if (!out) {
-        throw std::runtime_error("Failed to open file for writing partition.");
-    }
-
-    // Write metadata: number of points (n)
-    uint32_t n = static_cast<uint32_t>(partition_result.size());
-    out.write(reinterpret_cast<const char*>(&n), sizeof(uint32_t));
-
-    // Write partition data
-    out.write(reinterpret_cast<const char*>(partition_result.data()), partition_result.size() * sizeof(int));
-
-    out.close();
-    std::cout << "Partition saved to " << filepath << " with n=" << n << std::endl;
-
-}
-
-std::vector<int> BalancedKMeansCall(PointSet& points, int k, double eps, PointSet& centroids) {
-    centroids = RandomSample(points, k, 555);
+std::vector<int> BalancedKMeansCall(PointSet& points, int k, double eps, PointSet& centroids, const KMeansConfig& config) {
+    centroids = InitialCentroids(points, k, 555, config);
     size_t max_cluster_size = points.n * (1.0 + eps) / k;
     Timer timer;
     timer.Start();
-    auto result = BalancedKMeans(points, centroids, max_cluster_size);
+    auto result = BalancedKMeans(points, centroids, max_cluster_size, config);
     std::cout << "Balanced Kmeans took " << timer.Stop() << " seconds" << std::endl;
     return result;
 }
 
-std::vector<int> FlatKMeansCall(PointSet& points, int k, double eps) {
+std::vector<int> FlatKMeansCall(PointSet& points, int k, double eps, const KMeansConfig& config) {
+    PointSet centroids = InitialCentroids(points, k, 555, config);
+    return KMeans(points, centroids, config);
+}
+
+std::vector<int> FlatKMeansCall(PointStream& points, int k, double eps, const KMeansConfig& config) {
+    PointSet centroids = RandomSample(points, k, 555);
+    return KMeans(points, centroids, config);
+}
+
+// Batches of 256 points per centroid, so that each centroid sees enough points per batch to move. config.max_rounds is the number of batches
+std::vector<int> MiniBatchKMeansCall(PointSet& points, int k, double eps, const KMeansConfig& config) {
+    PointSet centroids = InitialCentroids(points, k, 555, config);
+    return MiniBatchKMeans(points, centroids, 256 * k, 555, config);
+}
+
+std::vector<int> MiniBatchKMeansCall(PointStream& points, int k, double eps, const KMeansConfig& config) {
     PointSet centroids = RandomSample(points, k, 555);
-    return KMeans(points, centroids);
+    return MiniBatchKMeans(points, centroids, 256 * k, 555, config);
 }
 
 void PrintImbalance(std::vector<int>& partition, int k) {
@@ -71,20 +71,58 @@ void PrintImbalance(std::vector<int>& partition, int k) {
 }
 
 int main(int argc, const char* argv[]) {
-    if (argc != 6 && argc != 7) {
-        std::cerr << "Usage ./Partition input-points output-filename_prefix num-clusters partitioning-method (default|strong) [overlap]" << std::endl;
+    std::vector<std::string> args(argv, argv + argc);
+    std::string storage_name = TakeStorageFlag(args, "");
+    // --export-shards also writes the points of each shard to a file of its own (see ExportShards)
+    bool export_shards = false;
+    if (auto it = std::find(args.begin(), args.end(), "--export-shards"); it != args.end()) {
+        args.erase(it);
+        export_shards = true;
+    }
+    // --kmeans-rounds=<max rounds>, --kmeans-log=<csv file> and --kmeans-seeding=kmeans-parallel|random apply to every k-means run
+    // of the partitioning method. For MBKMeans, a round is one mini-batch, and without --kmeans-rounds it runs 100 of them.
+    // The streaming methods always seed with a random sample, and the routing trees of the overlapping methods keep the defaults
+    KMeansConfig kmeans_config;
+    bool kmeans_rounds_given = false;
+    for (auto it = args.begin(); it != args.end();) {
+        if (it->starts_with("--kmeans-seeding=")) {
+            const std::string seeding = it->substr(std::string("--kmeans-seeding=").size());
+            if (seeding != "kmeans-parallel" && seeding != "random") {
+                throw std::runtime_error("Unknown k-means seeding: " + seeding + ". Use kmeans-parallel or random");
+            }
+            kmeans_config.seeding = seeding == "random" ? KMeansSeeding::Random : KMeansSeeding::KMeansParallel;
+            it = args.erase(it);
+        } else if (it->starts_with("--kmeans-rounds=")) {
+            kmeans_config.max_rounds = std::stoul(it->substr(std::string("--kmeans-rounds=").size()));
+            kmeans_rounds_given = true;
+            it = args.erase(it);
+        } else if (it->starts_with("--kmeans-log=")) {
+            kmeans_config.on_round = KMeansCSVLog(it->substr(std::string("--kmeans-log=").size()));
+            it = args.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    KMeansConfig mini_batch_config = kmeans_config;
+    if (!kmeans_rounds_given) {
+        mini_batch_config.max_rounds = 100;
+    }
+    if (args.size() != 6 && args.size() != 7) {
+        std::cerr << "Usage ./Partition input-points output-filename_prefix num-clusters partitioning-method (default|strong) [overlap] "
+                     "[--storage=float32|fp16|bf16|native|mmap|mmap-populate|stream] [--export-shards] [--kmeans-rounds=20] [--kmeans-log=file.csv] [--kmeans-seeding=kmeans-parallel|random]"
+                  << std::endl;
         std::abort();
     }
 
-    std::string input_file = argv[1];
-    std::string output_file = argv[2];
-    std::string k_str = argv[3];
+    std::string input_file = args[1];
+    std::string output_file = args[2];
+    std::string k_str = args[3];
     int k = std::stoi(k_str);
-    std::string part_method = argv[4];
+    std::string part_method = args[4];
     std::string part_file = output_file + ".dat";// + ".k=" + k_str + "." + part_method;
     std::string centroids_file = output_file + "_centroids.dat";
 
-    std::string config = argv[5];
+    std::string config = args[5];
     bool strong = false;
     if (config == "strong") {
         strong = true;
@@ -93,8 +131,8 @@ int main(int argc, const char* argv[]) {
     }
 
     double overlap = 0.0;
-    if (argc == 7) {
-        std::string overlap_str = argv[6];
+    if (args.size() == 7) {
+        std::string overlap_str = args[6];
         overlap = std::stod(overlap_str);
         part_file += ".o=" + overlap_str;
     }
@@ -112,17 +150,59 @@ int main(int argc, const char* argv[]) {
         }
         std::mt19937 prng(555);
         std::shuffle(partition.begin(), partition.end(), prng);
-        WriteMetisPartition(partition, part_file);
+        WritePartition(partition, part_file);
+        if (export_shards) {
+            ExportShards(input_file, ConvertPartitionToClusters(partition), part_file);
+        }
         return 0;
     }
 
-    PointSet points = ReadPoints(input_file);
-    std::cout << "Finished reading points" << std::endl;
-
     if (part_method == "GP" && overlap != 0.0) {
         part_method = "OGP";
     }
 
+    // --storage=stream never loads the whole dataset, for inputs that don't fit into RAM
+    if (storage_name == "stream") {
+        if (part_method != "FlatKMeans" && part_method != "MBKMeans" && part_method != "Pyramid") {
+            throw std::runtime_error("Partitioning method " + part_method + " doesn't support streaming. Use FlatKMeans, MBKMeans or Pyramid");
+        }
+        PointStream points(input_file);
+        const double eps = 0.05;
+        std::vector<int> partition;
+        if (part_method == "Pyramid") {
+            partition = PyramidPartitioning(points, k, eps, kmeans_config, part_file + ".pyramid_routing_index");
+        } else if (part_method == "MBKMeans") {
+            partition = MiniBatchKMeansCall(points, k, eps, mini_batch_config);
+        } else {
+            partition = FlatKMeansCall(points, k, eps, kmeans_config);
+        }
+        std::cout << "Finished partitioning" << std::endl;
+        PointSet centroids;
+        saveBalancedKMeansCentroids(centroids, centroids_file);
+        WritePartition(partition, part_file);
+        if (export_shards) {
+            ExportShards(input_file, ConvertPartitionToClusters(partition), part_file);
+        }
+        return 0;
+    }
+
+    // These methods work on compact points directly, so .u8bin / .i8bin inputs don't have to be expanded to float, and
+    // float inputs can be stored as fp16 / bf16. Without --storage the points are expanded to float32, 8-bit inputs stay 8-bit
+    // only with --storage=native.
+    const std::vector<std::string> compact_storage_methods = { "GP", "KMeans", "BalancedKMeans", "FlatKMeans", "MBKMeans", "RKM" };
+    const bool supports_compact_storage =
+            std::find(compact_storage_methods.begin(), compact_storage_methods.end(), part_method) != compact_storage_methods.end();
+    if (storage_name.empty()) {
+        storage_name = "float32";
+    }
+    ElementType storage = ParseStorageType(storage_name, input_file);
+    if (storage != ElementType::Float32 && !supports_compact_storage) {
+        throw std::runtime_error("Partitioning method " + part_method + " only supports float32 storage");
+    }
+
+    PointSet points = ReadPointsWithStorage(input_file, storage_name);
+    std::cout << "Finished reading points. Stored as " << ElementTypeName(points.element_type) << (points.IsMapped() ? " (mapped)" : "") << std::endl;
+
     const double eps = 0.05;
     std::vector<int> partition;
     Clusters clusters;
@@ -130,23 +210,25 @@ int main(int argc, const char* argv[]) {
     if (part_method == "GP") {
         partition = GraphPartitioning(points, k, eps, strong);
     } else if (part_method == "Pyramid") {
-        partition = PyramidPartitioning(points, k, eps, part_file + ".pyramid_routing_index");
+        partition = PyramidPartitioning(points, k, eps, kmeans_config, part_file + ".pyramid_routing_index");
     } else if (part_method == "KMeans") {
-        partition = KMeansPartitioning(points, k, eps);
+        partition = KMeansPartitioning(points, k, eps, kmeans_config);
     } else if (part_method == "BalancedKMeans") {
-        partition = BalancedKMeansCall(points, k, eps, centroids);
+        partition = BalancedKMeansCall(points, k, eps, centroids, kmeans_config);
     } else if (part_method == "FlatKMeans") {
-        partition = FlatKMeansCall(points, k, eps);
+        partition = FlatKMeansCall(points, k, eps, kmeans_config);
+    } else if (part_method == "MBKMeans") {
+        partition = MiniBatchKMeansCall(points, k, eps, mini_batch_config);
     } else if (part_method == "RKM") {
         const size_t max_cluster_size = (1.0 + eps) * points.n / k;
-        partition = RebalancingKMeansPartitioning(points, max_cluster_size, k);
+        partition = RebalancingKMeansPartitioning(points, max_cluster_size, kmeans_config, k);
     } else if (part_method == "ORKM") {
         const size_t max_cluster_size = (1.0 + eps) * points.n / k;
         int adjusted_num_clusters = std::ceil(k * (1.0 + overlap));
-        auto rkm = RebalancingKMeansPartitioning(points, max_cluster_size, adjusted_num_clusters);
+        auto rkm = RebalancingKMeansPartitioning(points, max_cluster_size, kmeans_config, adjusted_num_clusters);
         clusters = OverlappingKMeansPartitioningSPANN(points, rkm, k, eps, overlap);
     } else if (part_method == "OurPyramid") {
-        partition = OurPyramidPartitioning(points, k, eps, part_file + ".our_pyramid_routing_index", 0.02);
+        partition = OurPyramidPartitioning(points, k, eps, kmeans_config, part_file + ".our_pyramid_routing_index", 0.02);
     } else if (part_method == "OGP") {
         clusters = OverlappingGraphPartitioning(points, k, eps, overlap, strong);
     } else if (part_method == "OGPS") {
@@ -160,13 +242,13 @@ int main(int argc, const char* argv[]) {
         // leave the same num clusters, since k-means will use more than requested anyways
         Timer timer;
         timer.Start();
-        auto kmp = KMeansPartitioning(points, k, eps);
+        auto kmp = KMeansPartitioning(points, k, eps, kmeans_config);
         std::cout << "KM took " << timer.Stop() << " seconds" << std::endl;
         clusters = OverlappingKMeansPartitioningSPANN(points, kmp, k, eps, overlap);
     } else if (part_method == "OBKM") {
         int adjusted_num_clusters = std::ceil(k * (1.0 + overlap));
         // use adjusted num clusters for BKM call
-        auto bkm = BalancedKMeansCall(points, adjusted_num_clusters, eps, centroids);
+        auto bkm = BalancedKMeansCall(points, adjusted_num_clusters, eps, centroids, kmeans_config);
         // but use the original number for the overlap call, so that it chooses the correct max cluster size. The code can handle the case
         // that NumPartsInPartition(bkm) != k
         clusters = OverlappingKMeansPartitioningSPANN(points, bkm, k, eps, overlap);
@@ -176,12 +258,20 @@ int main(int argc, const char* argv[]) {
     }
     std::cout << "Finished partitioning" << std::endl;
 
-    if (clusters.empty()) {
-        clusters = ConvertPartitionToClusters(partition);
-    }
-    // WriteClusters(clusters, part_file);
     saveBalancedKMeansCentroids(centroids, centroids_file);
-    saveBalancedKMeansParitionResults(partition, part_file);
+    // the overlapping methods produce clusters, all others a partition
+    if (!clusters.empty()) {
+        WriteClusters(clusters, part_file);
+    } else {
+        WritePartition(partition, part_file);
+    }
+    std::cout << "Partition saved to " << part_file << std::endl;
+
+    if (export_shards) {
+        // the points are read again from the file, in their original element type
+        points.Drop();
+        ExportShards(input_file, !clusters.empty() ? clusters : ConvertPartitionToClusters(partition), part_file);
+    }
 
     return 0;
 
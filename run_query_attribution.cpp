@@ -20,27 +20,43 @@ void SetAffinity() {
 }
 
 int main(int argc, const char* argv[]) {
-    if (argc != 9) {
+    std::vector<std::string> args(argv, argv + argc);
+    std::string storage_name = TakeStorageFlag(args, "float32");
+    // --sq8 adds brute-force scans of SQ8 encoded shards with exact re-ranking to the HNSW shard searches
+    std::vector<int> sq_rerank_factors;
+    if (auto it = std::find(args.begin(), args.end(), "--sq8"); it != args.end()) {
+        args.erase(it);
+        sq_rerank_factors = { 1, 2, 4, 8 };
+    }
+    // --text-results writes the routes and searches in the text format instead of the binary one
+    bool text_results = false;
+    if (auto it = std::find(args.begin(), args.end(), "--text-results"); it != args.end()) {
+        args.erase(it);
+        text_results = true;
+    }
+    if (args.size() != 9) {
         std::cerr << "Usage ./QueryAttribution input-points queries ground-truth-file num_neighbors partition-file output-file partition_method "
-                     "requested-num-shards"
+                     "requested-num-shards [--storage=float32|fp16|bf16|native|mmap|mmap-populate] [--sq8] [--text-results]"
                   << std::endl;
         std::abort();
     }
 
     SetAffinity();
 
-    std::string point_file = argv[1];
-    std::string query_file = argv[2];
-    std::string ground_truth_file = argv[3];
-    std::string k_string = argv[4];
+    std::string point_file = args[1];
+    std::string query_file = args[2];
+    std::string ground_truth_file = args[3];
+    std::string k_string = args[4];
     int num_neighbors = std::stoi(k_string);
-    std::string partition_file = argv[5];
-    std::string output_file = argv[6];
-    std::string part_method = argv[7];
-    std::string requested_num_shards_str = argv[8];
+    std::string partition_file = args[5];
+    std::string output_file = args[6];
+    std::string part_method = args[7];
+    std::string requested_num_shards_str = args[8];
     int requested_num_shards = std::stoi(requested_num_shards_str);
 
-    PointSet points = ReadPoints(point_file);
+    // the storage only applies to the points. The queries are always float
+    PointSet points = ReadPointsWithStorage(point_file, storage_name);
+    std::cout << "Finished reading points. Stored as " << ElementTypeName(points.element_type) << (points.IsMapped() ? " (mapped)" : "") << std::endl;
     PointSet queries = ReadPoints(query_file);
 
     std::vector<NNVec> ground_truth;
@@ -57,7 +73,7 @@ int main(int argc, const char* argv[]) {
     std::cout << "Finished computing distance to kth neighbor" << std::endl;
 
 #if false
-    std::vector<int> partition = ReadMetisPartition(partition_file);
+    std::vector<int> partition = ReadPartition(partition_file);
     int num_shards = NumPartsInPartition(partition);
     Clusters clusters = ConvertPartitionToClusters(partition);
 #else
@@ -78,13 +94,21 @@ int main(int argc, const char* argv[]) {
     std::vector<RoutingConfig> routes = IterateRoutingConfigs(points, queries, clusters, num_shards, router_options, ground_truth, num_neighbors,
                                                               partition_file + ".routing_index", pyramid_index_file, our_pyramid_index_file);
     std::cout << "Finished routing configs" << std::endl;
-    SerializeRoutes(routes, output_file + ".routes");
+    if (text_results) {
+        ExportRoutesAsText(routes, output_file + ".routes");
+    } else {
+        SerializeRoutes(routes, output_file + ".routes");
+    }
 
     std::cout << "Start shard searches" << std::endl;
-    std::vector<ShardSearch> shard_searches =
-            RunInShardSearches(points, queries, HNSWParameters(), num_neighbors, clusters, num_shards, distance_to_kth_neighbor);
+    const std::string searches_file = output_file + ".searches";
+    RunInShardSearches(points, queries, HNSWParameters(), num_neighbors, clusters, num_shards, distance_to_kth_neighbor, searches_file, sq_rerank_factors);
     std::cout << "Finished shard searches" << std::endl;
-    SerializeShardSearches(shard_searches, output_file + ".searches");
 
-    PrintCombinationsOfRoutesAndSearches(routes, shard_searches, output_file, num_neighbors, queries.n, num_shards, requested_num_shards, part_method);
+    PrintCombinationsOfRoutesAndSearches(routes, searches_file, output_file, num_neighbors, queries.n, num_shards, requested_num_shards, part_method);
+
+    if (text_results) {
+        // the log is only converted at the end, so that an interrupted run can still resume from it
+        ExportShardSearchesAsText(DeserializeShardSearches(searches_file), searches_file);
+    }
 }
@@ -5,6 +5,7 @@
 
 #include "hnsw_router.h"
 #include "inverted_index.h"
+#include "inverted_index_pq.h"
 #include "kmeans_tree_router.h"
 #include "metis_io.h"
 #include "points_io.h"
@@ -131,10 +132,32 @@ int main(int argc, const char* argv[]) {
     timer.Start();
     InvertedIndexHNSW ivf_hnsw(points);
     ivf_hnsw.hnsw_parameters = HNSWParameters{ .M = 16, .ef_construction = 200, .ef_search = 120 };
-    ivf_hnsw.Build(points, clusters);
-    std::cout << "Building IVF-HNSW took " << timer.Restart() << " seconds." << std::endl;
+    const std::string ivf_hnsw_manifest = partition_file + ".ivf_hnsw";
+    bool ivf_hnsw_loaded = false;
+    if (std::filesystem::exists(ivf_hnsw_manifest)) {
+        // not lazy: every shard gets probed below, and reading the shards shouldn't count towards the query latency
+        try {
+            ivf_hnsw.Load(ivf_hnsw_manifest, clusters, /*lazy=*/false);
+            ivf_hnsw_loaded = true;
+            std::cout << "Loading IVF-HNSW took " << timer.Restart() << " seconds." << std::endl;
+        } catch (const std::runtime_error& e) {
+            std::cout << "Can't reuse the saved IVF-HNSW, rebuilding it. " << e.what() << std::endl;
+            timer.Restart();
+        }
+    }
+    if (!ivf_hnsw_loaded) {
+        ivf_hnsw.Build(points, clusters);
+        std::cout << "Building IVF-HNSW took " << timer.Restart() << " seconds." << std::endl;
+        ivf_hnsw.Save(ivf_hnsw_manifest);
+        std::cout << "Saving IVF-HNSW took " << timer.Restart() << " seconds." << std::endl;
+    }
     InvertedIndex ivf(points, clusters);
-    std::cout << "Building IVF took " << timer.Stop() << " seconds." << std::endl;
+    std::cout << "Building IVF took " << timer.Restart() << " seconds." << std::endl;
+    ivf.BuildScalarQuantization();
+    std::cout << "Building SQ8 codes for IVF took " << timer.Restart() << " seconds." << std::endl;
+    InvertedIndexPQ ivf_pq(points, clusters, PQParameters());
+    std::cout << "Building IVF-PQ took " << timer.Stop() << " seconds. Codes take " << ivf_pq.MemoryUsage() << " bytes vs "
+              << points.n * points.d * sizeof(float) << " bytes for the points" << std::endl;
 
     std::cout << "Finished building IVFs" << std::endl;
 
@@ -185,5 +208,60 @@ int main(int argc, const char* argv[]) {
                 << "HNSW"
                 << "," << num_probes << "," << latency << "," << routing_time / queries.n << "," << time / queries.n << "," << recall << std::endl;
         }
+
+        for (int rerank_factor : { 1, 2, 4, 8 }) {
+            const std::string sq_desc = "SQ8-r" + std::to_string(rerank_factor);
+            for (auto& neighs : neighbors) {
+                neighs.clear();
+            }
+            time = 0;
+            for (int num_probes = 1; num_probes <= num_shards; ++num_probes) {
+                timer.Start();
+                for (size_t q = 0; q < queries.n; ++q) {
+                    auto neighs = ivf.QueryBucketSQ(queries.GetPoint(q), num_neighbors, probes[q][num_probes - 1], rerank_factor);
+                    neighbors[q].insert(neighbors[q].end(), neighs.begin(), neighs.end());
+                }
+                time += timer.Stop();
+                DedupNeighbors(neighbors, num_neighbors);
+                double recall = Recall(neighbors, distance_to_kth_neighbor, num_neighbors);
+                double latency = (routing_time + time) / queries.n;
+                std::cout << "router = " << desc << " query = IVF-" << sq_desc << " "
+                          << "nprobes = " << num_probes << " recall = " << recall << " time = " << time << " avg latency = " << 1000.0 * latency << " ms"
+                          << std::endl;
+                out << part_method << "," << desc << "," << sq_desc << "," << num_probes << "," << latency << "," << routing_time / queries.n << ","
+                    << time / queries.n << "," << recall << std::endl;
+            }
+        }
+
+        for (const auto& [pq_desc, num_rerank] : { std::pair<std::string, size_t>("PQ", 0), std::pair<std::string, size_t>("PQ-Rerank", 10 * num_neighbors) }) {
+            ivf_pq.parameters.num_rerank = num_rerank;
+            for (auto& neighs : neighbors) {
+                neighs.clear();
+            }
+            time = 0;
+            for (int num_probes = 1; num_probes <= num_shards; ++num_probes) {
+                timer.Start();
+                for (size_t q = 0; q < queries.n; ++q) {
+                    auto neighs = ivf_pq.QueryBucket(queries.GetPoint(q), num_neighbors, probes[q][num_probes - 1]);
+                    neighbors[q].insert(neighbors[q].end(), neighs.begin(), neighs.end());
+                }
+                time += timer.Stop();
+                DedupNeighbors(neighbors, num_neighbors);
+                // Recall compares the reported distances, and without re-ranking those are only the PQ approximations
+                std::vector<NNVec> exact_neighbors = neighbors;
+                parlay::parallel_for(0, queries.n, [&](size_t q) {
+                    for (auto& x : exact_neighbors[q]) {
+                        x.first = DistanceToPoint(queries.GetPoint(q), points, x.second);
+                    }
+                });
+                double recall = Recall(exact_neighbors, distance_to_kth_neighbor, num_neighbors);
+                double latency = (routing_time + time) / queries.n;
+                std::cout << "router = " << desc << " query = IVF-" << pq_desc << " "
+                          << "nprobes = " << num_probes << " recall = " << recall << " time = " << time << " avg latency = " << 1000.0 * latency << " ms"
+                          << std::endl;
+                out << part_method << "," << desc << "," << pq_desc << "," << num_probes << "," << latency << "," << routing_time / queries.n << ","
+                    << time / queries.n << "," << recall << std::endl;
+            }
+        }
     }
 }
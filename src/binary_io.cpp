@@ -0,0 +1,53 @@
+#include "binary_io.h"
+
+#include <cerrno>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+void BinaryWriter::WriteTo(const std::string& path) const {
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("Can't open " + path + " for writing");
+    }
+    out.write(buffer.data(), buffer.size());
+    if (!out) {
+        throw std::runtime_error("Writing " + path + " failed");
+    }
+}
+
+MappedFile MapFile(const std::string& path, bool copy_on_write) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Can't open " + path + ": " + std::strerror(errno));
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        close(fd);
+        throw std::runtime_error("Can't stat " + path + ": " + std::strerror(errno));
+    }
+    const size_t file_size = file_stat.st_size;
+    if (file_size == 0) {
+        close(fd);
+        return {};
+    }
+    void* base = copy_on_write ? mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, fd, 0)
+                               : mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);      // the mapping keeps the file open
+    if (base == MAP_FAILED) {
+        throw std::runtime_error("Can't map " + path + ": " + std::strerror(errno));
+    }
+    MappedFile file;
+    file.mapping = std::shared_ptr<void>(base, [file_size](void* p) { munmap(p, file_size); });
+    file.data = { static_cast<const uint8_t*>(base), file_size };
+    return file;
+}
+
+bool FileStartsWith(const std::string& path, std::string_view magic) {
+    std::ifstream in(path, std::ios::binary);
+    std::string start(magic.size(), '\0');
+    return in.read(start.data(), start.size()) && start == magic;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// Building blocks for the binary result files. The writer collects a whole file in memory, so that it is written with one write.
+class BinaryWriter {
+public:
+    template<typename T>
+    void Put(const T& value) {
+        PutArray(&value, 1);
+    }
+
+    template<typename T>
+    void PutArray(const T* values, size_t count) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        buffer.append(reinterpret_cast<const char*>(values), count * sizeof(T));
+    }
+
+    // LEB128: 7 bits per byte, small values take a single byte
+    void PutVarint(uint64_t x) {
+        while (x >= 0x80) {
+            buffer.push_back(static_cast<char>(x | 0x80));
+            x >>= 7;
+        }
+        buffer.push_back(static_cast<char>(x));
+    }
+
+    // Varint of a signed value with the sign in the lowest bit, so that small negative values stay small as well
+    void PutZigZag(int64_t x) { PutVarint((static_cast<uint64_t>(x) << 1) ^ static_cast<uint64_t>(x >> 63)); }
+
+    void PutString(const std::string& s) {
+        PutVarint(s.size());
+        buffer.append(s);
+    }
+
+    const std::string& Bytes() const { return buffer; }
+
+    void WriteTo(const std::string& path) const;
+
+private:
+    std::string buffer;
+};
+
+class BinaryReader {
+public:
+    explicit BinaryReader(std::span<const uint8_t> data) : data(data) { }
+
+    template<typename T>
+    T Get() {
+        T value;
+        GetArray(&value, 1);
+        return value;
+    }
+
+    // memcpy, since the sections of the files are not aligned
+    template<typename T>
+    void GetArray(T* out, size_t count) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        Require(count * sizeof(T));
+        std::memcpy(out, data.data() + pos, count * sizeof(T));
+        pos += count * sizeof(T);
+    }
+
+    uint64_t GetVarint() {
+        uint64_t x = 0;
+        for (int shift = 0;; shift += 7) {
+            Require(1);
+            const uint8_t byte = data[pos++];
+            x |= uint64_t(byte & 0x7F) << shift;
+            if (byte < 0x80) return x;
+        }
+    }
+
+    int64_t GetZigZag() {
+        const uint64_t x = GetVarint();
+        return static_cast<int64_t>(x >> 1) ^ -static_cast<int64_t>(x & 1);
+    }
+
+    size_t Position() const { return pos; }
+
+    std::string GetString() {
+        const size_t size = GetVarint();
+        Require(size);
+        std::string s(reinterpret_cast<const char*>(data.data() + pos), size);
+        pos += size;
+        return s;
+    }
+
+private:
+    void Require(size_t bytes) const {
+        if (pos + bytes > data.size()) {
+            throw std::runtime_error("Unexpected end of binary file");
+        }
+    }
+
+    std::span<const uint8_t> data;
+    size_t pos = 0;
+};
+
+// A whole file, mapped read-only. The mapping lives as long as a copy of mapping does
+struct MappedFile {
+    std::shared_ptr<void> mapping;
+    std::span<const uint8_t> data;
+};
+
+// With copy_on_write, the pages are writable but writes never reach the file, as CoordinateArray::Map expects
+MappedFile MapFile(const std::string& path, bool copy_on_write = false);
+
+// Whether the file at path starts with the bytes of magic. Tells the binary formats from the old text formats
+bool FileStartsWith(const std::string& path, std::string_view magic);
@@ -0,0 +1,306 @@
+#include "bulk_reader.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#define HAS_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#include <parlay/parallel.h>
+
+#include "defs.h"
+
+namespace {
+    constexpr size_t BLOCK_BYTES = 1UL << 20;
+    constexpr unsigned QUEUE_DEPTH = 8;     // per thread
+
+    size_t AlignUp(size_t x) { return (x + BULK_READ_ALIGNMENT - 1) / BULK_READ_ALIGNMENT * BULK_READ_ALIGNMENT; }
+
+    // QUEUE_DEPTH blocks per thread
+    using BlockBuffers = std::unique_ptr<uint8_t, decltype(&std::free)>;
+
+    // The file and the aligned range that is read, split into blocks of BLOCK_BYTES
+    struct BlockRange {
+        int fd;
+        size_t aligned_begin, begin, end;
+
+        size_t BlockOffset(size_t block) const { return aligned_begin + block * BLOCK_BYTES; }
+        size_t BlockEnd(size_t block) const { return std::min(BlockOffset(block) + BLOCK_BYTES, end); }
+        // O_DIRECT wants aligned lengths. Reading past the end of the file is fine, the read just comes back short
+        size_t RequestBytes(size_t block) const { return AlignUp(BlockEnd(block)) - BlockOffset(block); }
+    };
+
+    // Hands the part of block that lies in [begin, end) to consume, after got bytes of it were read into buffer.
+    // Short reads, and reads the kernel rejected (got = 0), are completed with pread
+    void DeliverBlock(const BlockRange& range, size_t block, uint8_t* buffer, size_t got,
+                      const std::function<void(size_t, const uint8_t*, size_t)>& consume) {
+        const size_t block_offset = range.BlockOffset(block);
+        const size_t lo = std::max(block_offset, range.begin);
+        const size_t hi = range.BlockEnd(block);
+        while (block_offset + got < hi) {
+            ssize_t bytes = pread(range.fd, buffer + got, range.RequestBytes(block) - got, block_offset + got);
+            if (bytes <= 0) {
+                if (bytes < 0 && errno == EINTR) continue;
+                throw std::runtime_error(std::string("Bulk read failed: ") + (bytes == 0 ? "unexpected end of file" : std::strerror(errno)));
+            }
+            got += bytes;
+        }
+        consume(lo, buffer + (lo - block_offset), hi - lo);
+    }
+
+#ifdef HAS_IO_URING
+    // A minimal io_uring for reads, set up with the raw system calls so we don't need liburing
+    class ReadRing {
+    public:
+        ReadRing() = default;
+        ReadRing(const ReadRing&) = delete;
+        ReadRing& operator=(const ReadRing&) = delete;
+
+        ~ReadRing() {
+            if (sqes != nullptr) munmap(sqes, sqes_bytes);
+            if (cq_ring != nullptr && cq_ring != sq_ring) munmap(cq_ring, cq_bytes);
+            if (sq_ring != nullptr) munmap(sq_ring, sq_bytes);
+            if (ring_fd >= 0) close(ring_fd);
+        }
+
+        // false if the kernel doesn't support io_uring or doesn't allow it, e.g., in containers
+        bool Init(unsigned entries) {
+            io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+            ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+            if (ring_fd < 0) {
+                return false;
+            }
+            sq_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cq_bytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single_mmap) {
+                sq_bytes = cq_bytes = std::max(sq_bytes, cq_bytes);
+            }
+            sq_ring = MapRing(sq_bytes, IORING_OFF_SQ_RING);
+            if (sq_ring == nullptr) return false;
+            cq_ring = single_mmap ? sq_ring : MapRing(cq_bytes, IORING_OFF_CQ_RING);
+            if (cq_ring == nullptr) return false;
+            sqes_bytes = params.sq_entries * sizeof(io_uring_sqe);
+            sqes = static_cast<io_uring_sqe*>(MapRing(sqes_bytes, IORING_OFF_SQES));
+            if (sqes == nullptr) return false;
+
+            sq_tail = Field(sq_ring, params.sq_off.tail);
+            sq_mask = *Field(sq_ring, params.sq_off.ring_mask);
+            sq_array = Field(sq_ring, params.sq_off.array);
+            cq_head = Field(cq_ring, params.cq_off.head);
+            cq_tail = Field(cq_ring, params.cq_off.tail);
+            cq_mask = *Field(cq_ring, params.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe*>(static_cast<uint8_t*>(cq_ring) + params.cq_off.cqes);
+            return true;
+        }
+
+        void PrepareRead(int fd, uint8_t* buffer, size_t bytes, size_t offset, uint64_t tag) {
+            const unsigned tail = *sq_tail;     // only we write the tail
+            const unsigned index = tail & sq_mask;
+            io_uring_sqe& sqe = sqes[index];
+            std::memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_READ;
+            sqe.fd = fd;
+            sqe.addr = reinterpret_cast<uint64_t>(buffer);
+            sqe.len = bytes;
+            sqe.off = offset;
+            sqe.user_data = tag;
+            sq_array[index] = index;
+            __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+            num_prepared++;
+        }
+
+        // Submits the prepared reads and waits until at least one read completed
+        void SubmitAndWait() {
+            int submitted;
+            do {
+                submitted = syscall(__NR_io_uring_enter, ring_fd, num_prepared, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            } while (submitted < 0 && errno == EINTR);
+            if (submitted < 0) {
+                throw std::runtime_error(std::string("io_uring_enter failed: ") + std::strerror(errno));
+            }
+            num_prepared -= submitted;
+        }
+
+        // Submits the prepared reads and waits until in_flight reads completed, discarding their results. For the error path: the kernel
+        // writes into the buffers of the reads until they complete, even after the ring is closed. false if the ring is broken,
+        // then the reads may still be running
+        bool Drain(unsigned in_flight) {
+            uint64_t tag;
+            int result;
+            while (in_flight > 0) {
+                if (Pop(tag, result)) {
+                    in_flight--;
+                    continue;
+                }
+                const int submitted = syscall(__NR_io_uring_enter, ring_fd, num_prepared, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+                if (submitted < 0) {
+                    if (errno == EINTR) continue;
+                    return false;
+                }
+                num_prepared -= submitted;
+            }
+            return true;
+        }
+
+        // Takes the next completed read, if there is one. result is the number of bytes read or -errno
+        bool Pop(uint64_t& tag, int& result) {
+            const unsigned head = *cq_head;
+            if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                return false;
+            }
+            const io_uring_cqe& cqe = cqes[head & cq_mask];
+            tag = cqe.user_data;
+            result = cqe.res;
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+
+    private:
+        void* MapRing(size_t bytes, off_t offset) {
+            void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+            return p == MAP_FAILED ? nullptr : p;
+        }
+
+        static unsigned* Field(void* ring, unsigned offset) { return reinterpret_cast<unsigned*>(static_cast<uint8_t*>(ring) + offset); }
+
+        int ring_fd = -1;
+        void* sq_ring = nullptr;
+        void* cq_ring = nullptr;
+        io_uring_sqe* sqes = nullptr;
+        size_t sq_bytes = 0, cq_bytes = 0, sqes_bytes = 0;
+        unsigned* sq_tail = nullptr;
+        unsigned* sq_array = nullptr;
+        unsigned sq_mask = 0;
+        unsigned* cq_head = nullptr;
+        unsigned* cq_tail = nullptr;
+        unsigned cq_mask = 0;
+        io_uring_cqe* cqes = nullptr;
+        unsigned num_prepared = 0;
+    };
+
+    // Keeps QUEUE_DEPTH reads in flight, one per buffer. false if io_uring is unavailable, then nothing was read.
+    // If consume or the ring fails, the reads in flight are waited for before the exception leaves, so that the buffers can be freed.
+    // If even that fails, the buffers are leaked instead
+    bool ReadBlocksWithRing(const BlockRange& range, size_t first_block, size_t last_block, BlockBuffers& buffers,
+                            const std::function<void(size_t, const uint8_t*, size_t)>& consume) {
+        ReadRing ring;
+        if (!ring.Init(QUEUE_DEPTH)) {
+            return false;
+        }
+        size_t next_block = first_block;
+        unsigned in_flight = 0;
+        auto issue = [&](unsigned slot) {
+            ring.PrepareRead(range.fd, buffers.get() + slot * BLOCK_BYTES, range.RequestBytes(next_block), range.BlockOffset(next_block),
+                             next_block * QUEUE_DEPTH + slot);
+            next_block++;
+            in_flight++;
+        };
+        try {
+            for (unsigned slot = 0; slot < QUEUE_DEPTH && next_block < last_block; ++slot) {
+                issue(slot);
+            }
+            while (in_flight > 0) {
+                ring.SubmitAndWait();
+                uint64_t tag;
+                int result;
+                while (ring.Pop(tag, result)) {
+                    in_flight--;
+                    const size_t block = tag / QUEUE_DEPTH;
+                    const unsigned slot = tag % QUEUE_DEPTH;
+                    DeliverBlock(range, block, buffers.get() + slot * BLOCK_BYTES, std::max(result, 0), consume);
+                    if (next_block < last_block) {
+                        issue(slot);
+                    }
+                }
+            }
+        } catch (...) {
+            if (!ring.Drain(in_flight)) {
+                buffers.release();
+            }
+            throw;
+        }
+        return true;
+    }
+#else
+    bool ReadBlocksWithRing(const BlockRange&, size_t, size_t, BlockBuffers&, const std::function<void(size_t, const uint8_t*, size_t)>&) {
+        return false;
+    }
+#endif
+} // namespace
+
+void BulkRead(const std::string& path, size_t begin, size_t end, const std::function<void(size_t, const uint8_t*, size_t)>& consume) {
+    if (begin >= end) {
+        return;
+    }
+    Timer timer;
+    timer.Start();
+
+    bool direct = true;
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECT);
+    if (fd < 0 && errno == EINVAL) {
+        // e.g. tmpfs
+        direct = false;
+        fd = open(path.c_str(), O_RDONLY);
+    }
+    if (fd < 0) {
+        throw std::runtime_error("Can't open " + path + ": " + std::strerror(errno));
+    }
+
+    const BlockRange range{ fd, begin / BULK_READ_ALIGNMENT * BULK_READ_ALIGNMENT, begin, end };
+    const size_t num_blocks = (end - range.aligned_begin + BLOCK_BYTES - 1) / BLOCK_BYTES;
+    const size_t num_threads = std::min<size_t>(parlay::num_workers(), num_blocks);
+    const size_t blocks_per_thread = (num_blocks + num_threads - 1) / num_threads;
+
+    std::atomic<size_t> num_ring_threads = 0;
+    std::mutex error_lock;
+    std::exception_ptr error;
+    parlay::parallel_for(
+            0, num_threads,
+            [&](size_t t) {
+                const size_t first_block = t * blocks_per_thread;
+                const size_t last_block = std::min(num_blocks, first_block + blocks_per_thread);
+                if (first_block >= last_block) {
+                    return;
+                }
+                BlockBuffers buffers(static_cast<uint8_t*>(std::aligned_alloc(BULK_READ_ALIGNMENT, QUEUE_DEPTH * BLOCK_BYTES)), &std::free);
+                try {
+                    if (ReadBlocksWithRing(range, first_block, last_block, buffers, consume)) {
+                        num_ring_threads++;
+                        return;
+                    }
+                    for (size_t block = first_block; block < last_block; ++block) {
+                        DeliverBlock(range, block, buffers.get(), 0, consume);
+                    }
+                } catch (...) {
+                    std::lock_guard<std::mutex> guard(error_lock);
+                    if (!error) error = std::current_exception();
+                }
+            },
+            1);
+    close(fd);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    const double seconds = timer.Stop();
+    const double gigabytes = double(end - begin) / (1UL << 30);
+    std::cout << "Read " << gigabytes << " GB in " << seconds << " s = " << gigabytes / seconds << " GB/s with "
+              << (num_ring_threads > 0 ? "io_uring" : "pread") << (direct ? " and O_DIRECT" : "") << std::endl;
+}
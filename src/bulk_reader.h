@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+constexpr size_t BULK_READ_ALIGNMENT = 4096;
+
+// Reads the bytes [begin, end) of the file at path as fast as the storage allows. Every thread reads its own part of the range
+// with O_DIRECT, i.e., without going through the page cache, in aligned blocks with many requests in flight (io_uring).
+// Falls back to pread where io_uring is unavailable, and to buffered reads on file systems without O_DIRECT support.
+// consume(offset, data, bytes) is called concurrently for disjoint pieces of the range as soon as they arrive, where offset
+// is the file offset of data. All pieces but the first start at multiples of BULK_READ_ALIGNMENT, so the 1 to 4 byte coordinates
+// behind the 8 byte header of a point file are never split between two pieces.
+void BulkRead(const std::string& path, size_t begin, size_t end, const std::function<void(size_t, const uint8_t*, size_t)>& consume);
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Storage for the coordinates of a PointSet. Behaves like a std::vector, but can alternatively point into a memory mapped
+// point file (see MapPoints in points_io.h), so that the points don't have to be read and copied at all.
+// The mapping is private: writes to a mapped array go to copy-on-write pages and never reach the file.
+// Copies and every operation that grows the array work on owned memory, i.e., they copy the mapped elements first.
+template<typename T>
+class CoordinateArray {
+public:
+    using value_type = T;
+    using iterator = T*;
+    using const_iterator = const T*;
+
+    CoordinateArray() = default;
+    CoordinateArray(const CoordinateArray& other) : owned(other.begin(), other.end()) { }
+    CoordinateArray(CoordinateArray&& other) noexcept = default;
+    CoordinateArray& operator=(const CoordinateArray& other) {
+        if (this != &other) {
+            owned.assign(other.begin(), other.end());
+            Unmap();
+        }
+        return *this;
+    }
+    CoordinateArray& operator=(CoordinateArray&& other) noexcept = default;
+
+    // Points the array to count elements at begin, which stay valid as long as mapping is alive
+    void Map(std::shared_ptr<void> mapping, T* begin, size_t count) {
+        owned.clear();
+        owned.shrink_to_fit();
+        region = std::move(mapping);
+        mapped = begin;
+        mapped_size = count;
+    }
+
+    bool IsMapped() const { return region != nullptr; }
+
+    T* data() { return IsMapped() ? mapped : owned.data(); }
+    const T* data() const { return IsMapped() ? mapped : owned.data(); }
+    size_t size() const { return IsMapped() ? mapped_size : owned.size(); }
+    bool empty() const { return size() == 0; }
+    T& operator[](size_t i) { return data()[i]; }
+    const T& operator[](size_t i) const { return data()[i]; }
+    iterator begin() { return data(); }
+    iterator end() { return data() + size(); }
+    const_iterator begin() const { return data(); }
+    const_iterator end() const { return data() + size(); }
+
+    // shrinking a mapped array only hides the tail of the mapping
+    void resize(size_t count) {
+        if (ShrinkMapped(count)) return;
+        Materialize();
+        owned.resize(count);
+    }
+    void resize(size_t count, const T& value) {
+        if (ShrinkMapped(count)) return;
+        Materialize();
+        owned.resize(count, value);
+    }
+    void reserve(size_t count) {
+        if (IsMapped() && count <= mapped_size) return;
+        Materialize();
+        owned.reserve(count);
+    }
+    void push_back(const T& value) { Materialize(); owned.push_back(value); }
+    void assign(size_t count, const T& value) { Unmap(); owned.assign(count, value); }
+    void clear() { Unmap(); owned.clear(); }
+    void shrink_to_fit() { owned.shrink_to_fit(); }
+
+    template<typename It>
+    iterator insert(const_iterator pos, It first, It last) {
+        const size_t offset = pos - data();
+        Materialize();
+        owned.insert(owned.begin() + offset, first, last);
+        return data() + offset;
+    }
+
+private:
+    bool ShrinkMapped(size_t count) {
+        if (!IsMapped() || count > mapped_size) return false;
+        mapped_size = count;
+        return true;
+    }
+
+    // copies the mapped elements to owned memory and releases the mapping
+    void Materialize() {
+        if (IsMapped()) {
+            owned.assign(mapped, mapped + mapped_size);
+            Unmap();
+        }
+    }
+
+    void Unmap() {
+        region.reset();
+        mapped = nullptr;
+        mapped_size = 0;
+    }
+
+    std::vector<T> owned;
+    std::shared_ptr<void> region;
+    T* mapped = nullptr;
+    size_t mapped_size = 0;
+};
@@ -5,13 +5,126 @@
 #include <chrono>
 #include <algorithm>
 
+#include <parlay/parallel.h>
+
 #include "topn.h"
 #include "dist.h"
+#include "half_float.h"
+
+std::string ElementTypeName(ElementType type) {
+    switch (type) {
+        case ElementType::Float32: return "float32";
+        case ElementType::UInt8: return "uint8";
+        case ElementType::Int8: return "int8";
+        case ElementType::Float16: return "fp16";
+        case ElementType::BFloat16: return "bf16";
+    }
+    return "unknown";
+}
+
+void PointSet::CopyPointAsFloat(size_t i, float* out) const {
+    switch (element_type) {
+        case ElementType::Float32: {
+            const float* p = &coordinates[i * d];
+            std::copy(p, p + d, out);
+            break;
+        }
+        case ElementType::UInt8: {
+            const uint8_t* p = GetCompactPoint(i);
+            for (size_t j = 0; j < d; ++j) out[j] = static_cast<float>(p[j]);
+            break;
+        }
+        case ElementType::Int8: {
+            const int8_t* p = reinterpret_cast<const int8_t*>(GetCompactPoint(i));
+            for (size_t j = 0; j < d; ++j) out[j] = static_cast<float>(p[j]);
+            break;
+        }
+        case ElementType::Float16: {
+            const Float16* p = reinterpret_cast<const Float16*>(GetCompactPoint(i));
+            for (size_t j = 0; j < d; ++j) out[j] = ToFloat(p[j]);
+            break;
+        }
+        case ElementType::BFloat16: {
+            const BFloat16* p = reinterpret_cast<const BFloat16*>(GetCompactPoint(i));
+            for (size_t j = 0; j < d; ++j) out[j] = ToFloat(p[j]);
+            break;
+        }
+    }
+}
+
+const float* PointSet::GetPointAsFloat(size_t i, std::vector<float>& buffer) {
+    if (!IsCompact()) {
+        return GetPoint(i);
+    }
+    buffer.resize(d);
+    CopyPointAsFloat(i, buffer.data());
+    return buffer.data();
+}
+
+void PointSet::ConvertToFloat() {
+    if (!IsCompact()) {
+        return;
+    }
+    coordinates.resize(n * d);
+    parlay::parallel_for(0, n, [&](size_t i) { CopyPointAsFloat(i, &coordinates[i * d]); });
+    compact_coordinates.clear();
+    compact_coordinates.shrink_to_fit();
+    element_type = ElementType::Float32;
+}
+
+void PointSet::ConvertFromFloat(ElementType type) {
+    if (type == element_type) {
+        return;
+    }
+    if (IsCompact() || (type != ElementType::Float16 && type != ElementType::BFloat16)) {
+        throw std::runtime_error("Can only convert float32 points to fp16 or bf16. Have " + ElementTypeName(element_type) + " want " +
+                                 ElementTypeName(type));
+    }
+    compact_coordinates.resize(n * d * ElementSize(type));
+    if (type == ElementType::Float16) {
+        Float16* out = reinterpret_cast<Float16*>(compact_coordinates.data());
+        parlay::parallel_for(0, n, [&](size_t i) {
+            for (size_t j = i * d; j < (i + 1) * d; ++j) out[j] = ToFloat16(coordinates[j]);
+        });
+    } else {
+        BFloat16* out = reinterpret_cast<BFloat16*>(compact_coordinates.data());
+        parlay::parallel_for(0, n, [&](size_t i) {
+            for (size_t j = i * d; j < (i + 1) * d; ++j) out[j] = ToBFloat16(coordinates[j]);
+        });
+    }
+    coordinates.clear();
+    coordinates.shrink_to_fit();
+    norms.clear(); // the rounded points have slightly different norms
+    element_type = type;
+}
+
+void PointSet::ComputeNorms() {
+    if (HasNorms()) {
+        return;
+    }
+    std::vector<float> new_norms(n);
+    parlay::parallel_for(0, n, [&](size_t i) { new_norms[i] = PointNorm(*this, i); }, 512);
+    norms = std::move(new_norms);
+}
 
 PointSet ExtractPointsInBucket(const std::vector<uint32_t>& bucket, PointSet& points) {
     PointSet ps;
     ps.n = bucket.size();
     ps.d = points.d;
+    ps.element_type = points.element_type;
+    if (points.HasNorms()) {
+        ps.norms.reserve(ps.n);
+        for (auto u : bucket) ps.norms.push_back(points.norms[u]);
+    }
+    if (points.IsCompact()) {
+        const size_t point_bytes = points.d * ElementSize(points.element_type);
+        ps.compact_coordinates.reserve(ps.n * point_bytes);
+        for (auto u : bucket) {
+            const uint8_t* p = points.GetCompactPoint(u);
+            ps.compact_coordinates.insert(ps.compact_coordinates.end(), p, p + point_bytes);
+        }
+        return ps;
+    }
     ps.coordinates.reserve(ps.n * ps.d);
     for (auto u : bucket) {
         float* p = points.GetPoint(u);
@@ -86,11 +199,10 @@ NNVec ConvertTopKToNNVec(TopN& top_k) {
 
 TopN ClosestLeaders(PointSet& points, PointSet& leader_points, uint32_t my_id, int k) {
     TopN top_k(k);
-    float* Q = points.GetPoint(my_id);
-    for (uint32_t j = 0; j < leader_points.n; ++j) {
-        float* P = leader_points.GetPoint(j);
-        float dist = distance(P, Q, points.d);
-        top_k.Add(std::make_pair(dist, j));
-    }
+    std::vector<float> buffer;
+    const float* Q = points.GetPointAsFloat(my_id, buffer);
+    ForEachDistanceToBlock(Q, leader_points.coordinates.data(), leader_points.n, points.d, [&](size_t j, float dist) {
+        top_k.Add(std::make_pair(dist, uint32_t(j)));
+    });
     return top_k;
 }
@@ -4,18 +4,68 @@
 #include <cstdint>
 #include <chrono>
 #include <algorithm>
+#include <string>
 
+#include "coordinate_array.h"
 #include "topn.h"
 
+// How the coordinates of a PointSet are stored. Float32 is the default that every algorithm supports.
+// The 8-bit types keep .u8bin / .i8bin datasets in their original (4x smaller) form.
+// The 16-bit float types (see half_float.h) halve the memory of float datasets at the cost of precision.
+enum class ElementType : uint8_t {
+    Float32,
+    UInt8,
+    Int8,
+    Float16,
+    BFloat16,
+};
+
+inline size_t ElementSize(ElementType type) {
+    switch (type) {
+        case ElementType::Float32: return sizeof(float);
+        case ElementType::Float16:
+        case ElementType::BFloat16: return sizeof(uint16_t);
+        default: return sizeof(uint8_t);
+    }
+}
+
+std::string ElementTypeName(ElementType type);
+
 struct PointSet {
-  std::vector<float> coordinates;   // potentially empty
+  CoordinateArray<float> coordinates;   // potentially empty. only used if element_type == Float32
+  CoordinateArray<uint8_t> compact_coordinates;     // raw coordinates for the other element types
+  std::vector<float> norms;     // cached squared norms of the points. empty until ComputeNorms() is called
+  ElementType element_type = ElementType::Float32;
   size_t d = 0, n = 0;
-  float* GetPoint(size_t i) { return &coordinates[i*d]; }
-  void Drop() { coordinates.clear(); coordinates.shrink_to_fit(); }
-  void Alloc() { coordinates.resize(n*d, 0.f); }
+  float* GetPoint(size_t i) { return &coordinates[i*d]; }     // only for Float32
+  const uint8_t* GetCompactPoint(size_t i) const { return &compact_coordinates[i * d * ElementSize(element_type)]; }
+  bool IsCompact() const { return element_type != ElementType::Float32; }
+  // Whether the coordinates point into a memory mapped file (see MapPoints)
+  bool IsMapped() const { return coordinates.IsMapped() || compact_coordinates.IsMapped(); }
+  // Writes point i converted to float to out
+  void CopyPointAsFloat(size_t i, float* out) const;
+  // Point i as floats. Points directly into coordinates for Float32, otherwise the point is converted into buffer
+  const float* GetPointAsFloat(size_t i, std::vector<float>& buffer);
+  // Converts the whole set to Float32 storage
+  void ConvertToFloat();
+  // Converts a Float32 set to one of the 16-bit float types (rounding to nearest even)
+  void ConvertFromFloat(ElementType type);
+  bool HasNorms() const { return n > 0 && norms.size() == n; }
+  // Computes the squared norms of all points once. Does nothing if they are already cached
+  void ComputeNorms();
+  void Drop() {
+      coordinates.clear(); coordinates.shrink_to_fit(); compact_coordinates.clear(); compact_coordinates.shrink_to_fit();
+      norms.clear(); norms.shrink_to_fit();
+  }
+  void Alloc() {
+      if (IsCompact()) compact_coordinates.resize(n * d * ElementSize(element_type), 0);
+      else coordinates.resize(n*d, 0.f);
+  }
   void Resize(size_t _n) {
       n = _n;
-      coordinates.resize(_n * d);
+      norms.clear();
+      if (IsCompact()) compact_coordinates.resize(_n * d * ElementSize(element_type));
+      else coordinates.resize(_n * d);
   }
   bool empty() const { return n == 0; }
 };
@@ -1,60 +1,26 @@
 #include "dist.h"
 
-#include "../external/hnswlib/hnswlib/space_l2.h"
+#include "distance_kernels.h"
 
 #include <iostream>
 #include <math.h>
 
 
 float sqr_l2_dist(const float *a, const float *b, unsigned size) {
-    float result = 0;
-#ifdef __AVX__
-    size_t qty = size;
-    size_t qty16 = qty >> 4 << 4;
-    result = hnswlib::L2SqrSIMD16ExtAVX(a, b, &qty16);
-    size_t qty_left = qty - qty16;
-    result += hnswlib::L2Sqr(a + qty16, b + qty16, &qty_left);
-#else
-    float diff0, diff1, diff2, diff3;
-    const float* last = a + size;
-    const float* unroll_group = last - 3;
-
-    /* Process 4 items with each loop for efficiency. */
-    while (a < unroll_group) {
-        diff0 = a[0] - b[0];
-        diff1 = a[1] - b[1];
-        diff2 = a[2] - b[2];
-        diff3 = a[3] - b[3];
-        result += diff0 * diff0 + diff1 * diff1 + diff2 * diff2 + diff3 * diff3;
-        a += 4;
-        b += 4;
-    }
-    /* Process last 0-3 pixels.  Not needed for standard vector lengths. */
-    while (a < last) {
-        diff0 = *a++ - *b++;
-        result += diff0 * diff0;
-    }
-#endif
-    return result;
+    return ActiveDistanceKernels().sqr_l2(a, b, size);
 }
 
 
-float inner_product(float* p, float* q, unsigned d) {
-    float result = 0;
-    for(unsigned i=0; i<d; i++){
-        result += (q[i]) * (p[i]);
-    }
-    return result;
+float inner_product(const float* p, const float* q, unsigned d) {
+    return ActiveDistanceKernels().inner_product(p, q, d);
 }
 
-float mips_distance(float *p, float *q, unsigned d){
+float mips_distance(const float *p, const float *q, unsigned d){
     return 1.0f - inner_product(p, q, d);
 }
 
-float vec_norm(float* p, unsigned d) {
-    float result = 0.f;
-    for (unsigned i = 0; i < d; ++i) result += p[i] * p[i];
-    return result;
+float vec_norm(const float* p, unsigned d) {
+    return ActiveDistanceKernels().vec_norm(p, d);
 }
 
 bool L2Normalize(float* p, unsigned d) {
@@ -72,7 +38,7 @@ bool L2Normalize(float* p, unsigned d) {
     return true;
 }
 
-float distance(float *p, float *q, unsigned d) {
+float distance(const float *p, const float *q, unsigned d) {
     #ifdef MIPS_DISTANCE
     return mips_distance(p, q, d);
     #else
@@ -80,7 +46,138 @@ float distance(float *p, float *q, unsigned d) {
     #endif
 }
 
-float pos_distance(float* p, float* q, unsigned d) {
+// the block functions dispatch on d, since the lookup is amortized over the whole block
+void SqrL2DistancesToBlock(const float* Q, const float* block, size_t count, unsigned d, float* out) {
+    ActiveDistanceKernels(d).sqr_l2_block(Q, block, count, d, out);
+}
+
+void InnerProductsToBlock(const float* Q, const float* block, size_t count, unsigned d, float* out) {
+    ActiveDistanceKernels(d).inner_product_block(Q, block, count, d, out);
+}
+
+void DistancesToBlock(const float* Q, const float* block, size_t count, unsigned d, float* out) {
+    #ifdef MIPS_DISTANCE
+    InnerProductsToBlock(Q, block, count, d, out);
+    for (size_t i = 0; i < count; ++i) out[i] = 1.0f - out[i];
+    #else
+    SqrL2DistancesToBlock(Q, block, count, d, out);
+    #endif
+}
+
+namespace {
+    float DistanceToFloatPoint(const DistanceKernels& kernels, const float* Q, const float* P, unsigned d) {
+        #ifdef MIPS_DISTANCE
+        return 1.0f - kernels.inner_product(P, Q, d);
+        #else
+        return kernels.sqr_l2(P, Q, d);
+        #endif
+    }
+
+    template<typename T>
+    float DistanceToCompactPoint(const CompactKernels<T>& kernels, const float* Q, const T* P, unsigned d) {
+        #ifdef MIPS_DISTANCE
+        return 1.0f - kernels.inner_product(Q, P, d);
+        #else
+        return kernels.sqr_l2(Q, P, d);
+        #endif
+    }
+
+    template<typename T>
+    float DistanceBetweenCompactPoints(const CompactKernels<T>& kernels, const T* P, const T* Q, unsigned d) {
+        #ifdef MIPS_DISTANCE
+        return 1.0f - kernels.inner_product_pair(P, Q, d);
+        #else
+        return kernels.sqr_l2_pair(P, Q, d);
+        #endif
+    }
+
+    const uint8_t* AsUInt8(PointSet& points, size_t i) { return points.GetCompactPoint(i); }
+    const int8_t* AsInt8(PointSet& points, size_t i) { return reinterpret_cast<const int8_t*>(points.GetCompactPoint(i)); }
+    const Float16* AsFloat16(PointSet& points, size_t i) { return reinterpret_cast<const Float16*>(points.GetCompactPoint(i)); }
+    const BFloat16* AsBFloat16(PointSet& points, size_t i) { return reinterpret_cast<const BFloat16*>(points.GetCompactPoint(i)); }
+} // namespace
+
+float DistanceToPoint(const float* Q, PointSet& points, size_t i) {
+    const DistanceKernels& kernels = ActiveDistanceKernels();
+    switch (points.element_type) {
+        case ElementType::UInt8: return DistanceToCompactPoint(kernels.u8, Q, AsUInt8(points, i), points.d);
+        case ElementType::Int8: return DistanceToCompactPoint(kernels.i8, Q, AsInt8(points, i), points.d);
+        case ElementType::Float16: return DistanceToCompactPoint(kernels.f16, Q, AsFloat16(points, i), points.d);
+        case ElementType::BFloat16: return DistanceToCompactPoint(kernels.bf16, Q, AsBFloat16(points, i), points.d);
+        default: return DistanceToFloatPoint(kernels, Q, points.GetPoint(i), points.d);
+    }
+}
+
+float PosDistanceToPoint(const float* Q, PointSet& points, size_t i) {
+#ifdef MIPS_DISTANCE
+    return DistanceToPoint(Q, points, i) + 1.0;
+#endif
+    return DistanceToPoint(Q, points, i);
+}
+
+float DistanceBetweenPoints(PointSet& points, size_t i, size_t j) {
+    const DistanceKernels& kernels = ActiveDistanceKernels();
+    switch (points.element_type) {
+        case ElementType::UInt8: return DistanceBetweenCompactPoints(kernels.u8, AsUInt8(points, i), AsUInt8(points, j), points.d);
+        case ElementType::Int8: return DistanceBetweenCompactPoints(kernels.i8, AsInt8(points, i), AsInt8(points, j), points.d);
+        case ElementType::Float16: return DistanceBetweenCompactPoints(kernels.f16, AsFloat16(points, i), AsFloat16(points, j), points.d);
+        case ElementType::BFloat16: return DistanceBetweenCompactPoints(kernels.bf16, AsBFloat16(points, i), AsBFloat16(points, j), points.d);
+        default: return distance(points.GetPoint(i), points.GetPoint(j), points.d);
+    }
+}
+
+float PointNorm(PointSet& points, size_t i) {
+    if (points.HasNorms()) {
+        return points.norms[i];
+    }
+    const DistanceKernels& kernels = ActiveDistanceKernels();
+    switch (points.element_type) {
+        case ElementType::UInt8: return kernels.u8.inner_product_pair(AsUInt8(points, i), AsUInt8(points, i), points.d);
+        case ElementType::Int8: return kernels.i8.inner_product_pair(AsInt8(points, i), AsInt8(points, i), points.d);
+        case ElementType::Float16: return kernels.f16.inner_product_pair(AsFloat16(points, i), AsFloat16(points, i), points.d);
+        case ElementType::BFloat16: return kernels.bf16.inner_product_pair(AsBFloat16(points, i), AsBFloat16(points, i), points.d);
+        default: return vec_norm(points.GetPoint(i), points.d);
+    }
+}
+
+void DistancesToPoints(const float* Q, PointSet& points, size_t begin, size_t count, float* out) {
+    if (!points.IsCompact()) {
+        DistancesToBlock(Q, points.coordinates.data() + begin * points.d, count, points.d, out);
+        return;
+    }
+    for (size_t j = 0; j < count; ++j) {
+        out[j] = DistanceToPoint(Q, points, begin + j);
+    }
+}
+
+void DistancesBetweenPoints(PointSet& points, size_t i, size_t begin, size_t count, float* out) {
+    if (!points.IsCompact()) {
+        DistancesToBlock(points.GetPoint(i), points.coordinates.data() + begin * points.d, count, points.d, out);
+        return;
+    }
+    for (size_t j = 0; j < count; ++j) {
+        out[j] = DistanceBetweenPoints(points, i, begin + j);
+    }
+}
+
+void ScanPointsIntoTopN(const float* Q, PointSet& points, size_t begin, size_t count, uint32_t first_id, TopN& top_k) {
+#ifndef MIPS_DISTANCE
+    if (!points.IsCompact()) {
+        const unsigned d = points.d;
+        const DistanceKernels& kernels = ActiveDistanceKernels(d);
+        const float* P = points.coordinates.data() + begin * d;
+        for (size_t i = 0; i < count; ++i, P += d) {
+            // an abandoned partial sum is > Top().first, so Add() rejects it
+            const float dist = top_k.Full() ? kernels.sqr_l2_bounded(P, Q, d, top_k.Top().first) : kernels.sqr_l2(P, Q, d);
+            top_k.Add(std::make_pair(dist, uint32_t(first_id + i)));
+        }
+        return;
+    }
+#endif
+    ForEachDistanceToPoints(Q, points, begin, count, [&](size_t i, float dist) { top_k.Add(std::make_pair(dist, uint32_t(first_id + i))); });
+}
+
+float pos_distance(const float* p, const float* q, unsigned d) {
 #ifdef MIPS_DISTANCE
     return distance(p, q, d) + 1.0;
 #endif
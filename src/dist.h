@@ -1,15 +1,80 @@
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
+
+#include "defs.h"
+
 float sqr_l2_dist(const float *a, const float *b, unsigned size);
 
-float inner_product(float* p, float* q, unsigned d);
+float inner_product(const float* p, const float* q, unsigned d);
 
-float mips_distance(float *p, float *q, unsigned d);
+float mips_distance(const float *p, const float *q, unsigned d);
 
-float vec_norm(float* p, unsigned d);
+float vec_norm(const float* p, unsigned d);
 
 bool L2Normalize(float* p, unsigned d);
 
-float distance(float *p, float *q, unsigned d);
+float distance(const float *p, const float *q, unsigned d);
+
+float pos_distance(const float* p, const float* q, unsigned d);
+
+// Distances from Q to count points stored contiguously at block (row-major, d floats each). out[i] = distance(block + i * d, Q, d).
+// Shares the query loads between several points and prefetches ahead, so prefer this over calling distance() in a loop.
+void DistancesToBlock(const float* Q, const float* block, size_t count, unsigned d, float* out);
+
+void SqrL2DistancesToBlock(const float* Q, const float* block, size_t count, unsigned d, float* out);
+
+void InnerProductsToBlock(const float* Q, const float* block, size_t count, unsigned d, float* out);
+
+constexpr size_t DISTANCE_BLOCK_SIZE = 256;
+
+// Calls f(i, dist) for every point i in [0, count) of block. The distances are computed chunk-wise with DistancesToBlock.
+template<typename F>
+void ForEachDistanceToBlock(const float* Q, const float* block, size_t count, unsigned d, F&& f) {
+    float dists[DISTANCE_BLOCK_SIZE];
+    for (size_t begin = 0; begin < count; begin += DISTANCE_BLOCK_SIZE) {
+        const size_t len = std::min(DISTANCE_BLOCK_SIZE, count - begin);
+        DistancesToBlock(Q, block + begin * d, len, d, dists);
+        for (size_t i = 0; i < len; ++i) {
+            f(begin + i, dists[i]);
+        }
+    }
+}
+
+// Distances between a float query (a query point or a centroid) and points of a PointSet with any element type.
+// For 8-bit points these use the mixed float x int kernels, so the points never have to be expanded to float.
+float DistanceToPoint(const float* Q, PointSet& points, size_t i);
+
+// pos_distance() counterpart of DistanceToPoint
+float PosDistanceToPoint(const float* Q, PointSet& points, size_t i);
+
+// Distance between two points of the same set. Computed exactly in integer arithmetic for 8-bit points.
+float DistanceBetweenPoints(PointSet& points, size_t i, size_t j);
+
+// Squared norm of point i. Uses the cached norms of the PointSet if they are there
+float PointNorm(PointSet& points, size_t i);
+
+// out[j] = DistanceToPoint(Q, points, begin + j) for j in [0, count)
+void DistancesToPoints(const float* Q, PointSet& points, size_t begin, size_t count, float* out);
+
+// out[j] = DistanceBetweenPoints(points, i, begin + j) for j in [0, count). Float points go through the block kernels.
+void DistancesBetweenPoints(PointSet& points, size_t i, size_t begin, size_t count, float* out);
+
+// Like ForEachDistanceToBlock, for points [begin, begin + count) of a PointSet with any element type. f gets the index relative to begin.
+template<typename F>
+void ForEachDistanceToPoints(const float* Q, PointSet& points, size_t begin, size_t count, F&& f) {
+    float dists[DISTANCE_BLOCK_SIZE];
+    for (size_t offset = 0; offset < count; offset += DISTANCE_BLOCK_SIZE) {
+        const size_t len = std::min(DISTANCE_BLOCK_SIZE, count - offset);
+        DistancesToPoints(Q, points, begin + offset, len, dists);
+        for (size_t i = 0; i < len; ++i) {
+            f(offset + i, dists[i]);
+        }
+    }
+}
 
-float pos_distance(float* p, float* q, unsigned d);
+// Adds points [begin, begin + count) to top_k, point begin + i with id first_id + i. Same result as calling top_k.Add() with
+// every DistanceToPoint, but for float points and L2 the distance computation of a point is abandoned as soon as its partial sum
+// exceeds the current k-th distance. The squared L2 partial sums only grow, so such a point can't make it into top_k anyways.
+void ScanPointsIntoTopN(const float* Q, PointSet& points, size_t begin, size_t count, uint32_t first_id, TopN& top_k);
@@ -0,0 +1,1387 @@
+#include "distance_kernels.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GP_ANN_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+    // --- Scalar kernels --- //
+
+    float SqrL2Scalar(const float* a, const float* b, unsigned d) {
+        float result = 0;
+        float diff0, diff1, diff2, diff3;
+        const float* last = a + d;
+        const float* unroll_group = last - 3;
+
+        /* Process 4 items with each loop for efficiency. */
+        while (a < unroll_group) {
+            diff0 = a[0] - b[0];
+            diff1 = a[1] - b[1];
+            diff2 = a[2] - b[2];
+            diff3 = a[3] - b[3];
+            result += diff0 * diff0 + diff1 * diff1 + diff2 * diff2 + diff3 * diff3;
+            a += 4;
+            b += 4;
+        }
+        /* Process last 0-3 pixels.  Not needed for standard vector lengths. */
+        while (a < last) {
+            diff0 = *a++ - *b++;
+            result += diff0 * diff0;
+        }
+        return result;
+    }
+
+    float SqrL2BoundedScalar(const float* a, const float* b, unsigned d, float bound) {
+        float result = 0;
+        unsigned i = 0;
+        for (; i + 4 <= d; i += 4) {
+            float diff0 = a[i] - b[i];
+            float diff1 = a[i + 1] - b[i + 1];
+            float diff2 = a[i + 2] - b[i + 2];
+            float diff3 = a[i + 3] - b[i + 3];
+            result += diff0 * diff0 + diff1 * diff1 + diff2 * diff2 + diff3 * diff3;
+            if ((i + 4) % BOUND_CHECK_INTERVAL == 0 && result > bound) return result;
+        }
+        for (; i < d; ++i) {
+            float diff = a[i] - b[i];
+            result += diff * diff;
+        }
+        return result;
+    }
+
+    float InnerProductScalar(const float* a, const float* b, unsigned d) {
+        float result = 0;
+        for (unsigned i = 0; i < d; i++) {
+            result += a[i] * b[i];
+        }
+        return result;
+    }
+
+    float VecNormScalar(const float* a, unsigned d) {
+        float result = 0.f;
+        for (unsigned i = 0; i < d; ++i) result += a[i] * a[i];
+        return result;
+    }
+
+    // Element conversion for the compact types. The 16-bit float overloads are in half_float.h
+    inline float ToFloat(float x) { return x; }
+    inline float ToFloat(uint8_t x) { return static_cast<float>(x); }
+    inline float ToFloat(int8_t x) { return static_cast<float>(x); }
+
+    template<typename T>
+    float SqrL2MixedScalar(const float* q, const T* p, unsigned d) {
+        float result = 0;
+        for (unsigned i = 0; i < d; ++i) {
+            float diff = q[i] - ToFloat(p[i]);
+            result += diff * diff;
+        }
+        return result;
+    }
+
+    template<typename T>
+    float InnerProductMixedScalar(const float* q, const T* p, unsigned d) {
+        float result = 0;
+        for (unsigned i = 0; i < d; ++i) {
+            result += q[i] * ToFloat(p[i]);
+        }
+        return result;
+    }
+
+    template<typename T>
+    float SqrL2IntScalar(const T* a, const T* b, unsigned d) {
+        int32_t result = 0;
+        for (unsigned i = 0; i < d; ++i) {
+            int32_t diff = int32_t(a[i]) - int32_t(b[i]);
+            result += diff * diff;
+        }
+        return static_cast<float>(result);
+    }
+
+    template<typename T>
+    float InnerProductIntScalar(const T* a, const T* b, unsigned d) {
+        int32_t result = 0;
+        for (unsigned i = 0; i < d; ++i) {
+            result += int32_t(a[i]) * int32_t(b[i]);
+        }
+        return static_cast<float>(result);
+    }
+
+    template<typename T>
+    float SqrL2PairScalar(const T* a, const T* b, unsigned d) {
+        float result = 0;
+        for (unsigned i = 0; i < d; ++i) {
+            float diff = ToFloat(a[i]) - ToFloat(b[i]);
+            result += diff * diff;
+        }
+        return result;
+    }
+
+    template<typename T>
+    float InnerProductPairScalar(const T* a, const T* b, unsigned d) {
+        float result = 0;
+        for (unsigned i = 0; i < d; ++i) {
+            result += ToFloat(a[i]) * ToFloat(b[i]);
+        }
+        return result;
+    }
+
+    template<typename T>
+    constexpr CompactKernels<T> ScalarCompactKernels() {
+        if constexpr (std::is_integral_v<T>) {
+            return CompactKernels<T>{ SqrL2MixedScalar<T>, InnerProductMixedScalar<T>, SqrL2IntScalar<T>, InnerProductIntScalar<T> };
+        } else {
+            return CompactKernels<T>{ SqrL2MixedScalar<T>, InnerProductMixedScalar<T>, SqrL2PairScalar<T>, InnerProductPairScalar<T> };
+        }
+    }
+
+
+    void SqrL2BlockScalar(const float* q, const float* block, size_t count, unsigned d, float* out) {
+        for (size_t p = 0; p < count; ++p) out[p] = SqrL2Scalar(block + p * d, q, d);
+    }
+
+    void InnerProductBlockScalar(const float* q, const float* block, size_t count, unsigned d, float* out) {
+        for (size_t p = 0; p < count; ++p) out[p] = InnerProductScalar(block + p * d, q, d);
+    }
+
+    // Fallback tile kernel for levels without a dedicated micro-kernel. One row of a against the block b at a time.
+    template<void (*Block)(const float*, const float*, size_t, unsigned, float*)>
+    void InnerProductTileFromBlock(const float* a, size_t a_count, const float* b, size_t b_count, unsigned d, float* out) {
+        for (size_t i = 0; i < a_count; ++i) Block(a + i * d, b, b_count, d, out + i * b_count);
+    }
+
+    // The tile micro-kernels compute TILE_A x TILE_B inner products per iteration, each with a single accumulator
+    constexpr size_t TILE_A = 2;
+    constexpr size_t TILE_B = 4;
+
+    // The block kernels process BLOCK_ROWS points at a time, so that every query load is shared between them.
+    // Each point keeps its own accumulators and reduces them in the same order as the single-pair kernel.
+    constexpr size_t BLOCK_ROWS = 4;
+
+    // Start of the next group of rows, clamped so that we never point past the end of the block
+    inline const float* NextRows(const float* block, size_t p, size_t count, unsigned d) {
+        return block + std::min(p + BLOCK_ROWS, count - BLOCK_ROWS) * d;
+    }
+
+    inline void PrefetchRows(const float* rows, unsigned d, unsigned offset) {
+        for (size_t r = 0; r < BLOCK_ROWS; ++r) __builtin_prefetch(rows + r * d + offset, 0, 3);
+    }
+
+    // The dimensions of our datasets (Deep 96, SpaceV and Turing 100, SIFT 128, text-to-image 200). The AVX2 and AVX-512
+    // float kernels are templates on the dimension D and are additionally compiled for these. With a constant dimension the
+    // loops have fixed trip counts, so the compiler unrolls them completely and resolves the tail handling at compile time.
+    constexpr unsigned FIXED_DIMENSIONS[] = { 96, 100, 128, 200 };
+    constexpr size_t NUM_FIXED_DIMENSIONS = std::size(FIXED_DIMENSIONS);
+
+    int FixedDimensionIndex(unsigned d) {
+        for (size_t i = 0; i < NUM_FIXED_DIMENSIONS; ++i) {
+            if (FIXED_DIMENSIONS[i] == d) return static_cast<int>(i);
+        }
+        return -1;
+    }
+
+    // D = 0 is the generic version that takes the dimension at runtime
+    template<unsigned D>
+    constexpr unsigned Dim(unsigned d) { return D == 0 ? d : D; }
+
+#ifdef GP_ANN_X86
+
+    // --- SSE kernels (part of the x86-64 baseline, so no target attribute needed) --- //
+
+    inline float HorizontalSum128(__m128 v) {
+        __m128 shuf = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+        __m128 sums = _mm_add_ps(v, shuf);
+        shuf = _mm_movehl_ps(shuf, sums);
+        sums = _mm_add_ss(sums, shuf);
+        return _mm_cvtss_f32(sums);
+    }
+
+    float SqrL2SSE(const float* a, const float* b, unsigned d) {
+        __m128 sum0 = _mm_setzero_ps();
+        __m128 sum1 = _mm_setzero_ps();
+        unsigned i = 0;
+        for (; i + 8 <= d; i += 8) {
+            __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+            __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+            sum0 = _mm_add_ps(sum0, _mm_mul_ps(d0, d0));
+            sum1 = _mm_add_ps(sum1, _mm_mul_ps(d1, d1));
+        }
+        for (; i + 4 <= d; i += 4) {
+            __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+            sum0 = _mm_add_ps(sum0, _mm_mul_ps(d0, d0));
+        }
+        float result = HorizontalSum128(_mm_add_ps(sum0, sum1));
+        for (; i < d; ++i) {
+            float diff = a[i] - b[i];
+            result += diff * diff;
+        }
+        return result;
+    }
+
+    float SqrL2BoundedSSE(const float* a, const float* b, unsigned d, float bound) {
+        __m128 sum0 = _mm_setzero_ps();
+        __m128 sum1 = _mm_setzero_ps();
+        unsigned i = 0;
+        for (; i + 8 <= d; i += 8) {
+            __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+            __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+            sum0 = _mm_add_ps(sum0, _mm_mul_ps(d0, d0));
+            sum1 = _mm_add_ps(sum1, _mm_mul_ps(d1, d1));
+            if ((i + 8) % BOUND_CHECK_INTERVAL == 0) {
+                if (float partial = HorizontalSum128(_mm_add_ps(sum0, sum1)); partial > bound) return partial;
+            }
+        }
+        for (; i + 4 <= d; i += 4) {
+            __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+            sum0 = _mm_add_ps(sum0, _mm_mul_ps(d0, d0));
+        }
+        float result = HorizontalSum128(_mm_add_ps(sum0, sum1));
+        for (; i < d; ++i) {
+            float diff = a[i] - b[i];
+            result += diff * diff;
+        }
+        return result;
+    }
+
+    float InnerProductSSE(const float* a, const float* b, unsigned d) {
+        __m128 sum0 = _mm_setzero_ps();
+        __m128 sum1 = _mm_setzero_ps();
+        unsigned i = 0;
+        for (; i + 8 <= d; i += 8) {
+            sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+            sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+        }
+        for (; i + 4 <= d; i += 4) {
+            sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        }
+        float result = HorizontalSum128(_mm_add_ps(sum0, sum1));
+        for (; i < d; ++i) {
+            result += a[i] * b[i];
+        }
+        return result;
+    }
+
+    float VecNormSSE(const float* a, unsigned d) { return InnerProductSSE(a, a, d); }
+
+    void SqrL2BlockSSE(const float* q, const float* block, size_t count, unsigned d, float* out) {
+        size_t p = 0;
+        for (; p + BLOCK_ROWS <= count; p += BLOCK_ROWS) {
+            const float* rows = block + p * d;
+            const float* next = NextRows(block, p, count, d);
+            __m128 sum0[BLOCK_ROWS], sum1[BLOCK_ROWS];
+            for (size_t r = 0; r < BLOCK_ROWS; ++r) sum0[r] = sum1[r] = _mm_setzero_ps();
+            unsigned i = 0;
+            for (; i + 8 <= d; i += 8) {
+                if ((i & 15) == 0) PrefetchRows(next, d, i);
+                const __m128 q0 = _mm_loadu_ps(q + i), q1 = _mm_loadu_ps(q + i + 4);
+                for (size_t r = 0; r < BLOCK_ROWS; ++r) {
+                    __m128 d0 = _mm_sub_ps(_mm_loadu_ps(rows + r * d + i), q0);
+                    __m128 d1 = _mm_sub_ps(_mm_loadu_ps(rows + r * d + i + 4), q1);
+                    sum0[r] = _mm_add_ps(sum0[r], _mm_mul_ps(d0, d0));
+                    sum1[r] = _mm_add_ps(sum1[r], _mm_mul_ps(d1, d1));
+                }
+            }
+            for (; i + 4 <= d; i += 4) {
+                const __m128 q0 = _mm_loadu_ps(q + i);
+                for (size_t r = 0; r < BLOCK_ROWS; ++r) {
+                    __m128 d0 = _mm_sub_ps(_mm_loadu_ps(rows + r * d + i), q0);
+                    sum0[r] = _mm_add_ps(sum0[r], _mm_mul_ps(d0, d0));
+                }
+            }
+            for (size_t r = 0; r < BLOCK_ROWS; ++r) {
+                float result = HorizontalSum128(_mm_add_ps(sum0[r], sum1[r]));
+                for (unsigned j = i; j < d; ++j) {
+                    float diff = rows[r * d + j] - q[j];
+                    result += diff * diff;
+                }
+                out[p + r] = result;
+            }
+        }
+        for (; p < count; ++p) out[p] = SqrL2SSE(block + p * d, q, d);
+    }
+
+    void InnerProductBlockSSE(const float* q, const float* block, size_t count, unsigned d, float* out) {
+        size_t p = 0;
+        for (; p + BLOCK_ROWS <= count; p += BLOCK_ROWS) {
+            const float* rows = block + p * d;
+            const float* next = NextRows(block, p, count, d);
+            __m128 sum0[BLOCK_ROWS], sum1[BLOCK_ROWS];
+            for (size_t r = 0; r < BLOCK_ROWS; ++r) sum0[r] = sum1[r] = _mm_setzero_ps();
+            unsigned i = 0;
+            for (; i + 8 <= d; i += 8) {
+                if ((i & 15) == 0) PrefetchRows(next, d, i);
+                const __m128 q0 = _mm_loadu_ps(q + i), q1 = _mm_loadu_ps(q + i + 4);
+                for (size_t r = 0; r < BLOCK_ROWS; ++r) {
+                    sum0[r] = _mm_add_ps(sum0[r], _mm_mul_ps(_mm_loadu_ps(rows + r * d + i), q0));
+                    sum1[r] = _mm_add_ps(sum1[r], _mm_mul_ps(_mm_loadu_ps(rows + r * d + i + 4), q1));
+                }
+            }
+            for (; i + 4 <= d; i += 4) {
+                const __m128 q0 = _mm_loadu_ps(q + i);
+                for (size_t r = 0; r < BLOCK_ROWS; ++r) {
+                    sum0[r] = _mm_add_ps(sum0[r], _mm_mul_ps(_mm_loadu_ps(rows + r * d + i), q0));
+                }
+            }
+            for (size_t r = 0; r < BLOCK_ROWS; ++r) {
+                float result = HorizontalSum128(_mm_add_ps(sum0[r], sum1[r]));
+                for (unsigned j = i; j < d; ++j) {
+                    result += rows[r * d + j] * q[j];
+                }
+                out[p + r] = result;
+            }
+        }
+        for (; p < count; ++p) out[p] = InnerProductSSE(block + p * d, q, d);
+    }
+
+    // --- AVX2 + FMA kernels. F16C is included for the fp16 conversions --- //
+
+    __attribute__((target("avx2,fma,f16c"))) inline float HorizontalSum256(__m256 v) {
+        __m128 lo = _mm256_castps256_ps128(v);
+        __m128 hi = _mm256_extractf128_ps(v, 1);
+        return HorizontalSum128(_mm_add_ps(lo, hi));
+    }
+
+    template<unsigned D = 0>
+    __attribute__((target("avx2,fma,f16c"))) float SqrL2AVX2(const float* a, const float* b, unsigned d) {
+        d = Dim<D>(d);
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        unsigned i = 0;
+        for (; i + 16 <= d; i += 16) {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+            __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+            sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+            sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+        }
+        for (; i + 8 <= d; i += 8) {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+            sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+        }
+        float result = HorizontalSum256(_mm256_add_ps(sum0, sum1));
+        for (; i < d; ++i) {
+            float diff = a[i] - b[i];
+            result += diff * diff;
+        }
+        return result;
+    }
+
+    // The partial sums are reduced from copies of the accumulators, so a scan that isn't abandoned accumulates like SqrL2AVX2
+    template<unsigned D = 0>
+    __attribute__((target("avx2,fma,f16c"))) float SqrL2BoundedAVX2(const float* a, const float* b, unsigned d, float bound) {
+        d = Dim<D>(d);
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        unsigned i = 0;
+        for (; i + 16 <= d; i += 16) {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+            __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+            sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+            sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+            if ((i + 16) % BOUND_CHECK_INTERVAL == 0) {
+                if (float partial = HorizontalSum256(_mm256_add_ps(sum0, sum1)); partial > bound) return partial;
+            }
+        }
+        for (; i + 8 <= d; i += 8) {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+            sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+        }
+        float result = HorizontalSum256(_mm256_add_ps(sum0, sum1));
+        for (; i < d; ++i) {
+            float diff = a[i] - b[i];
+            result += diff * diff;
+        }
+        return result;
+    }
+
+    template<unsigned D = 0>
+    __attribute__((target("avx2,fma,f16c"))) float InnerProductAVX2(const float* a, const float* b, unsigned d) {
+        d = Dim<D>(d);
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        unsigned i = 0;
+        for (; i + 16 <= d; i += 16) {
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+            sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+        }
+        for (; i + 8 <= d; i += 8) {
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+        }
+        float result = HorizontalSum256(_mm256_add_ps(sum0, sum1));
+        for (; i < d; ++i) {
+            result += a[i] * b[i];
+        }
+        return result;
+    }
+
+    template<unsigned D = 0>
+    __attribute__((target("avx2,fma,f16c"))) float VecNormAVX2(const float* a, unsigned d) { return InnerProductAVX2<D>(a, a, d); }
+
+    template<unsigned D = 0>
+    __attribute__((target("avx2,fma,f16c"))) void SqrL2BlockAVX2(const float* q, const float* block, size_t count, unsigned d, float* out) {
+        d = Dim<D>(d);
+        size_t p = 0;
+        for (; p + BLOCK_ROWS <= count; p += BLOCK_ROWS) {
+            const float* rows = block + p * d;
+            const float* next = NextRows(block, p, count, d);
+            __m256 sum0[BLOCK_ROWS], sum1[BLOCK_ROWS];
+            for (size_t r = 0; r < BLOCK_ROWS; ++r) sum0[r] = sum1[r] = _mm256_setzero_ps();
+            unsigned i = 0;
+            for (; i + 16 <= d; i += 16) {
+                PrefetchRows(next, d, i);
+                const __m256 q0 = _mm256_loadu_ps(q + i), q1 = _mm256_loadu_ps(q + i + 8);
+                for (size_t r = 0; r < BLOCK_ROWS; ++r) {
+                    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(rows + r * d + i), q0);
+                    __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(rows + r * d + i + 8), q1);
+                    sum0[r] = _mm256_fmadd_ps(d0, d0, sum0[r]);
+                    sum1[r] = _mm256_fmadd_ps(d1, d1, sum1[r]);
+                }
+            }
+            for (; i + 8 <= d; i += 8) {
+                const __m256 q0 = _mm256_loadu_ps(q + i);
+                for (size_t r = 0; r < BLOCK_ROWS; ++r) {
+                    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(rows + r * d + i), q0);
+                    sum0[r] = _mm256_fmadd_ps(d0, d0, sum0[r]);
+                }
+            }
+            for (size_t r = 0; r < BLOCK_ROWS; ++r) {
+                float result = HorizontalSum256(_mm256_add_ps(sum0[r], sum1[r]));
+                for (unsigned j = i; j < d; ++j) {
+                    float diff = rows[r * d + j] - q[j];
+                    result += diff * diff;
+                }
+                out[p + r] = result;
+            }
+        }
+        for (; p < count; ++p) out[p] = SqrL2AVX2<D>(block + p * d, q, d);
+    }
+
+    template<unsigned D = 0>
+    __attribute__((target("avx2,fma,f16c"))) void InnerProductBlockAVX2(const float* q, const float* block, size_t count, unsigned d, float* out) {
+        d = Dim<D>(d);
+        size_t p = 0;
+        for (; p + BLOCK_ROWS <= count; p += BLOCK_ROWS) {
+            const float* rows = block + p * d;
+            const float* next = NextRows(block, p, count, d);
+            __m256 sum0[BLOCK_ROWS], sum1[BLOCK_ROWS];
+            for (size_t r = 0; r < BLOCK_ROWS; ++r) sum0[r] = sum1[r] = _mm256_setzero_ps();
+            unsigned i = 0;
+            for (; i + 16 <= d; i += 16) {
+                PrefetchRows(next, d, i);
+                const __m256 q0 = _mm256_loadu_ps(q + i), q1 = _mm256_loadu_ps(q + i + 8);
+                for (size_t r = 0; r < BLOCK_ROWS; ++r) {
+                    sum0[r] = _mm256_fmadd_ps(_mm256_loadu_ps(rows + r * d + i), q0, sum0[r]);
+                    sum1[r] = _mm256_fmadd_ps(_mm256_loadu_ps(rows + r * d + i + 8), q1, sum1[r]);
+                }
+            }
+            for (; i + 8 <= d; i += 8) {
+                const __m256 q0 = _mm256_loadu_ps(q + i);
+                for (size_t r = 0; r < BLOCK_ROWS; ++r) {
+                    sum0[r] = _mm256_fmadd_ps(_mm256_loadu_ps(rows + r * d + i), q0, sum0[r]);
+                }
+            }
+            for (size_t r = 0; r < BLOCK_ROWS; ++r) {
+                float result = HorizontalSum256(_mm256_add_ps(sum0[r], sum1[r]));
+                for (unsigned j = i; j < d; ++j) {
+                    result += rows[r * d + j] * q[j];
+                }
+                out[p + r] = result;
+            }
+        }
+        for (; p < count; ++p) out[p] = InnerProductAVX2<D>(block + p * d, q, d);
+    }
+
+    template<unsigned D = 0>
+    __attribute__((target("avx2,fma,f16c"))) void InnerProductTileAVX2(const float* a, size_t a_count, const float* b, size_t b_count, unsigned d, float* out) {
+        d = Dim<D>(d);
+        size_t i = 0;
+        for (; i + TILE_A <= a_count; i += TILE_A) {
+            const float* A = a + i * d;
+            size_t j = 0;
+            for (; j + TILE_B <= b_count; j += TILE_B) {
+                const float* B = b + j * d;
+                __m256 acc[TILE_A][TILE_B];
+                for (size_t r = 0; r < TILE_A; ++r)
+                    for (size_t c = 0; c < TILE_B; ++c) acc[r][c] = _mm256_setzero_ps();
+                unsigned k = 0;
+                for (; k + 8 <= d; k += 8) {
+                    __m256 x[TILE_A];
+                    for (size_t r = 0; r < TILE_A; ++r) x[r] = _mm256_loadu_ps(A + r * d + k);
+                    for (size_t c = 0; c < TILE_B; ++c) {
+                        const __m256 y = _mm256_loadu_ps(B + c * d + k);
+                        for (size_t r = 0; r < TILE_A; ++r) acc[r][c] = _mm256_fmadd_ps(x[r], y, acc[r][c]);
+                    }
+                }
+                for (size_t r = 0; r < TILE_A; ++r) {
+                    for (size_t c = 0; c < TILE_B; ++c) {
+                        float result = HorizontalSum256(acc[r][c]);
+                        for (unsigned l = k; l < d; ++l) result += A[r * d + l] * B[c * d + l];
+                        out[(i + r) * b_count + j + c] = result;
+                    }
+                }
+            }
+            for (; j < b_count; ++j) {
+                for (size_t r = 0; r < TILE_A; ++r) out[(i + r) * b_count + j] = InnerProductAVX2<D>(A + r * d, b + j * d, d);
+            }
+        }
+        for (; i < a_count; ++i) InnerProductBlockAVX2<D>(a + i * d, b, b_count, d, out + i * b_count);
+    }
+
+    // --- AVX2 kernels for compact points --- //
+    // The mixed kernels widen 8 coordinates at a time to float (for fp16 with F16C, for bf16 with a shift). The integer kernels widen 16 coordinates to int16 and use pmaddwd,
+    // which is exact. pmaddubsw (the building block of VNNI's vpdpbusd) would be faster, but it saturates the int16 pair sums and is
+    // restricted to uint8 x int8, so it can't compute L2 distances or same-type inner products exactly.
+
+    template<typename T>
+    __attribute__((target("avx2,fma,f16c"))) inline __m256 Load8AsFloatAVX2(const T* p) {
+        __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+        if constexpr (std::is_signed_v<T>) {
+            return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(bytes));
+        } else {
+            return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+        }
+    }
+
+    __attribute__((target("avx2,fma,f16c"))) inline __m256 Load8AsFloatAVX2(const Float16* p) {
+        return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+    }
+
+    __attribute__((target("avx2,fma,f16c"))) inline __m256 Load8AsFloatAVX2(const BFloat16* p) {
+        __m256i widened = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+        return _mm256_castsi256_ps(_mm256_slli_epi32(widened, 16));
+    }
+
+    template<typename T>
+    __attribute__((target("avx2,fma,f16c"))) inline __m256i Load16AsInt16AVX2(const T* p) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        if constexpr (std::is_signed_v<T>) {
+            return _mm256_cvtepi8_epi16(bytes);
+        } else {
+            return _mm256_cvtepu8_epi16(bytes);
+        }
+    }
+
+    __attribute__((target("avx2,fma,f16c"))) inline int32_t HorizontalSumInt256(__m256i v) {
+        __m128i sums = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+        sums = _mm_add_epi32(sums, _mm_shuffle_epi32(sums, _MM_SHUFFLE(1, 0, 3, 2)));
+        sums = _mm_add_epi32(sums, _mm_shuffle_epi32(sums, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(sums);
+    }
+
+    template<typename T>
+    __attribute__((target("avx2,fma,f16c"))) float SqrL2MixedAVX2(const float* q, const T* p, unsigned d) {
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        unsigned i = 0;
+        for (; i + 16 <= d; i += 16) {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(q + i), Load8AsFloatAVX2(p + i));
+            __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(q + i + 8), Load8AsFloatAVX2(p + i + 8));
+            sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+            sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+        }
+        for (; i + 8 <= d; i += 8) {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(q + i), Load8AsFloatAVX2(p + i));
+            sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+        }
+        float result = HorizontalSum256(_mm256_add_ps(sum0, sum1));
+        for (; i < d; ++i) {
+            float diff = q[i] - ToFloat(p[i]);
+            result += diff * diff;
+        }
+        return result;
+    }
+
+    template<typename T>
+    __attribute__((target("avx2,fma,f16c"))) float InnerProductMixedAVX2(const float* q, const T* p, unsigned d) {
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        unsigned i = 0;
+        for (; i + 16 <= d; i += 16) {
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), Load8AsFloatAVX2(p + i), sum0);
+            sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i + 8), Load8AsFloatAVX2(p + i + 8), sum1);
+        }
+        for (; i + 8 <= d; i += 8) {
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), Load8AsFloatAVX2(p + i), sum0);
+        }
+        float result = HorizontalSum256(_mm256_add_ps(sum0, sum1));
+        for (; i < d; ++i) {
+            result += q[i] * ToFloat(p[i]);
+        }
+        return result;
+    }
+
+    template<typename T>
+    __attribute__((target("avx2,fma,f16c"))) float SqrL2PairAVX2(const T* a, const T* b, unsigned d) {
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        unsigned i = 0;
+        for (; i + 16 <= d; i += 16) {
+            __m256 d0 = _mm256_sub_ps(Load8AsFloatAVX2(a + i), Load8AsFloatAVX2(b + i));
+            __m256 d1 = _mm256_sub_ps(Load8AsFloatAVX2(a + i + 8), Load8AsFloatAVX2(b + i + 8));
+            sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+            sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+        }
+        for (; i + 8 <= d; i += 8) {
+            __m256 d0 = _mm256_sub_ps(Load8AsFloatAVX2(a + i), Load8AsFloatAVX2(b + i));
+            sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+        }
+        float result = HorizontalSum256(_mm256_add_ps(sum0, sum1));
+        for (; i < d; ++i) {
+            float diff = ToFloat(a[i]) - ToFloat(b[i]);
+            result += diff * diff;
+        }
+        return result;
+    }
+
+    template<typename T>
+    __attribute__((target("avx2,fma,f16c"))) float InnerProductPairAVX2(const T* a, const T* b, unsigned d) {
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        unsigned i = 0;
+        for (; i + 16 <= d; i += 16) {
+            sum0 = _mm256_fmadd_ps(Load8AsFloatAVX2(a + i), Load8AsFloatAVX2(b + i), sum0);
+            sum1 = _mm256_fmadd_ps(Load8AsFloatAVX2(a + i + 8), Load8AsFloatAVX2(b + i + 8), sum1);
+        }
+        for (; i + 8 <= d; i += 8) {
+            sum0 = _mm256_fmadd_ps(Load8AsFloatAVX2(a + i), Load8AsFloatAVX2(b + i), sum0);
+        }
+        float result = HorizontalSum256(_mm256_add_ps(sum0, sum1));
+        for (; i < d; ++i) {
+            result += ToFloat(a[i]) * ToFloat(b[i]);
+        }
+        return result;
+    }
+
+    template<typename T>
+    __attribute__((target("avx2,fma,f16c"))) float SqrL2IntAVX2(const T* a, const T* b, unsigned d) {
+        __m256i sum = _mm256_setzero_si256();
+        unsigned i = 0;
+        for (; i + 16 <= d; i += 16) {
+            __m256i diff = _mm256_sub_epi16(Load16AsInt16AVX2(a + i), Load16AsInt16AVX2(b + i));
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(diff, diff));
+        }
+        int32_t result = HorizontalSumInt256(sum);
+        for (; i < d; ++i) {
+            int32_t diff = int32_t(a[i]) - int32_t(b[i]);
+            result += diff * diff;
+        }
+        return static_cast<float>(result);
+    }
+
+    template<typename T>
+    __attribute__((target("avx2,fma,f16c"))) float InnerProductIntAVX2(const T* a, const T* b, unsigned d) {
+        __m256i sum = _mm256_setzero_si256();
+        unsigned i = 0;
+        for (; i + 16 <= d; i += 16) {
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(Load16AsInt16AVX2(a + i), Load16AsInt16AVX2(b + i)));
+        }
+        int32_t result = HorizontalSumInt256(sum);
+        for (; i < d; ++i) {
+            result += int32_t(a[i]) * int32_t(b[i]);
+        }
+        return static_cast<float>(result);
+    }
+
+    // --- AVX-512 kernels. The tail is handled with masked loads instead of a scalar loop --- //
+
+// GCC 12 reports false positives for the _mm512_undefined_* placeholders inside the intrinsics headers (GCC bug 105593)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+    template<unsigned D = 0>
+    __attribute__((target("avx512f"))) float SqrL2AVX512(const float* a, const float* b, unsigned d) {
+        d = Dim<D>(d);
+        __m512 sum0 = _mm512_setzero_ps();
+        __m512 sum1 = _mm512_setzero_ps();
+        unsigned i = 0;
+        for (; i + 32 <= d; i += 32) {
+            __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+            __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+            sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+            sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+        }
+        for (; i + 16 <= d; i += 16) {
+            __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+            sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+        }
+        if (i < d) {
+            __mmask16 mask = (__mmask16(1) << (d - i)) - 1;
+            __m512 d0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+            sum1 = _mm512_fmadd_ps(d0, d0, sum1);
+        }
+        return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+    }
+
+    template<unsigned D = 0>
+    __attribute__((target("avx512f"))) float SqrL2BoundedAVX512(const float* a, const float* b, unsigned d, float bound) {
+        d = Dim<D>(d);
+        __m512 sum0 = _mm512_setzero_ps();
+        __m512 sum1 = _mm512_setzero_ps();
+        unsigned i = 0;
+        for (; i + 32 <= d; i += 32) {
+            __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+            __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+            sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+            sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+            if ((i + 32) % BOUND_CHECK_INTERVAL == 0) {
+                if (float partial = _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1)); partial > bound) return partial;
+            }
+        }
+        for (; i + 16 <= d; i += 16) {
+            __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+            sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+        }
+        if (i < d) {
+            __mmask16 mask = (__mmask16(1) << (d - i)) - 1;
+            __m512 d0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+            sum1 = _mm512_fmadd_ps(d0, d0, sum1);
+        }
+        return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+    }
+
+    template<unsigned D = 0>
+    __attribute__((target("avx512f"))) float InnerProductAVX512(const float* a, const float* b, unsigned d) {
+        d = Dim<D>(d);
+        __m512 sum0 = _mm512_setzero_ps();
+        __m512 sum1 = _mm512_setzero_ps();
+        unsigned i = 0;
+        for (; i + 32 <= d; i += 32) {
+            sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum0);
+            sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), sum1);
+        }
+        for (; i + 16 <= d; i += 16) {
+            sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum0);
+        }
+        if (i < d) {
+            __mmask16 mask = (__mmask16(1) << (d - i)) - 1;
+            sum1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), sum1);
+        }
+        return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+    }
+
+    template<unsigned D = 0>
+    __attribute__((target("avx512f"))) float VecNormAVX512(const float* a, unsigned d) { return InnerProductAVX512<D>(a, a, d); }
+
+    template<unsigned D = 0>
+    __attribute__((target("avx512f"))) void SqrL2BlockAVX512(const float* q, const float* block, size_t count, unsigned d, float* out) {
+        d = Dim<D>(d);
+        size_t p = 0;
+        for (; p + BLOCK_ROWS <= count; p += BLOCK_ROWS) {
+            const float* rows = block + p * d;
+            const float* next = NextRows(block, p, count, d);
+            __m512 sum0[BLOCK_ROWS], sum1[BLOCK_ROWS];
+            for (size_t r = 0; r < BLOCK_ROWS; ++r) sum0[r] = sum1[r] = _mm512_setzero_ps();
+            unsigned i = 0;
+            for (; i + 32 <= d; i += 32) {
+                PrefetchRows(next, d, i);
+                PrefetchRows(next, d, i + 16);
+                const __m512 q0 = _mm512_loadu_ps(q + i), q1 = _mm512_loadu_ps(q + i + 16);
+                for (size_t r = 0; r < BLOCK_ROWS; ++r) {
+                    __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(rows + r * d + i), q0);
+                    __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(rows + r * d + i + 16), q1);
+                    sum0[r] = _mm512_fmadd_ps(d0, d0, sum0[r]);
+                    sum1[r] = _mm512_fmadd_ps(d1, d1, sum1[r]);
+                }
+            }
+            for (; i + 16 <= d; i += 16) {
+                PrefetchRows(next, d, i);
+                const __m512 q0 = _mm512_loadu_ps(q + i);
+                for (size_t r = 0; r < BLOCK_ROWS; ++r) {
+                    __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(rows + r * d + i), q0);
+                    sum0[r] = _mm512_fmadd_ps(d0, d0, sum0[r]);
+                }
+            }
+            if (i < d) {
+                __mmask16 mask = (__mmask16(1) << (d - i)) - 1;
+                const __m512 q0 = _mm512_maskz_loadu_ps(mask, q + i);
+                for (size_t r = 0; r < BLOCK_ROWS; ++r) {
+                    __m512 d0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, rows + r * d + i), q0);
+                    sum1[r] = _mm512_fmadd_ps(d0, d0, sum1[r]);
+                }
+            }
+            for (size_t r = 0; r < BLOCK_ROWS; ++r) {
+                out[p + r] = _mm512_reduce_add_ps(_mm512_add_ps(sum0[r], sum1[r]));
+            }
+        }
+        for (; p < count; ++p) out[p] = SqrL2AVX512<D>(block + p * d, q, d);
+    }
+
+    template<unsigned D = 0>
+    __attribute__((target("avx512f"))) void InnerProductBlockAVX512(const float* q, const float* block, size_t count, unsigned d, float* out) {
+        d = Dim<D>(d);
+        size_t p = 0;
+        for (; p + BLOCK_ROWS <= count; p += BLOCK_ROWS) {
+            const float* rows = block + p * d;
+            const float* next = NextRows(block, p, count, d);
+            __m512 sum0[BLOCK_ROWS], sum1[BLOCK_ROWS];
+            for (size_t r = 0; r < BLOCK_ROWS; ++r) sum0[r] = sum1[r] = _mm512_setzero_ps();
+            unsigned i = 0;
+            for (; i + 32 <= d; i += 32) {
+                PrefetchRows(next, d, i);
+                PrefetchRows(next, d, i + 16);
+                const __m512 q0 = _mm512_loadu_ps(q + i), q1 = _mm512_loadu_ps(q + i + 16);
+                for (size_t r = 0; r < BLOCK_ROWS; ++r) {
+                    sum0[r] = _mm512_fmadd_ps(_mm512_loadu_ps(rows + r * d + i), q0, sum0[r]);
+                    sum1[r] = _mm512_fmadd_ps(_mm512_loadu_ps(rows + r * d + i + 16), q1, sum1[r]);
+                }
+            }
+            for (; i + 16 <= d; i += 16) {
+                PrefetchRows(next, d, i);
+                const __m512 q0 = _mm512_loadu_ps(q + i);
+                for (size_t r = 0; r < BLOCK_ROWS; ++r) {
+                    sum0[r] = _mm512_fmadd_ps(_mm512_loadu_ps(rows + r * d + i), q0, sum0[r]);
+                }
+            }
+            if (i < d) {
+                __mmask16 mask = (__mmask16(1) << (d - i)) - 1;
+                const __m512 q0 = _mm512_maskz_loadu_ps(mask, q + i);
+                for (size_t r = 0; r < BLOCK_ROWS; ++r) {
+                    sum1[r] = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, rows + r * d + i), q0, sum1[r]);
+                }
+            }
+            for (size_t r = 0; r < BLOCK_ROWS; ++r) {
+                out[p + r] = _mm512_reduce_add_ps(_mm512_add_ps(sum0[r], sum1[r]));
+            }
+        }
+        for (; p < count; ++p) out[p] = InnerProductAVX512<D>(block + p * d, q, d);
+    }
+
+    template<unsigned D = 0>
+    __attribute__((target("avx512f"))) void InnerProductTileAVX512(const float* a, size_t a_count, const float* b, size_t b_count, unsigned d, float* out) {
+        d = Dim<D>(d);
+        size_t i = 0;
+        for (; i + TILE_A <= a_count; i += TILE_A) {
+            const float* A = a + i * d;
+            size_t j = 0;
+            for (; j + TILE_B <= b_count; j += TILE_B) {
+                const float* B = b + j * d;
+                __m512 acc[TILE_A][TILE_B];
+                for (size_t r = 0; r < TILE_A; ++r)
+                    for (size_t c = 0; c < TILE_B; ++c) acc[r][c] = _mm512_setzero_ps();
+                unsigned k = 0;
+                for (; k + 16 <= d; k += 16) {
+                    __m512 x[TILE_A];
+                    for (size_t r = 0; r < TILE_A; ++r) x[r] = _mm512_loadu_ps(A + r * d + k);
+                    for (size_t c = 0; c < TILE_B; ++c) {
+                        const __m512 y = _mm512_loadu_ps(B + c * d + k);
+                        for (size_t r = 0; r < TILE_A; ++r) acc[r][c] = _mm512_fmadd_ps(x[r], y, acc[r][c]);
+                    }
+                }
+                if (k < d) {
+                    __mmask16 mask = (__mmask16(1) << (d - k)) - 1;
+                    __m512 x[TILE_A];
+                    for (size_t r = 0; r < TILE_A; ++r) x[r] = _mm512_maskz_loadu_ps(mask, A + r * d + k);
+                    for (size_t c = 0; c < TILE_B; ++c) {
+                        const __m512 y = _mm512_maskz_loadu_ps(mask, B + c * d + k);
+                        for (size_t r = 0; r < TILE_A; ++r) acc[r][c] = _mm512_fmadd_ps(x[r], y, acc[r][c]);
+                    }
+                }
+                for (size_t r = 0; r < TILE_A; ++r) {
+                    for (size_t c = 0; c < TILE_B; ++c) out[(i + r) * b_count + j + c] = _mm512_reduce_add_ps(acc[r][c]);
+                }
+            }
+            for (; j < b_count; ++j) {
+                for (size_t r = 0; r < TILE_A; ++r) out[(i + r) * b_count + j] = InnerProductAVX512<D>(A + r * d, b + j * d, d);
+            }
+        }
+        for (; i < a_count; ++i) InnerProductBlockAVX512<D>(a + i * d, b, b_count, d, out + i * b_count);
+    }
+
+    // Without AVX-512BW there are no 512-bit int16 operations, so the AVX-512 level uses the AVX2 integer kernels
+    // (every AVX-512 CPU supports AVX2). The other kernels widen 16 coordinates at a time to float.
+    // bf16 is widened with a shift as well. The AVX-512-BF16 instructions only help for bf16 x bf16 dot products, and our queries are float.
+
+    template<typename T>
+    __attribute__((target("avx512f"))) inline __m512 Load16AsFloatAVX512(const T* p) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        if constexpr (std::is_signed_v<T>) {
+            return _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(bytes));
+        } else {
+            return _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(bytes));
+        }
+    }
+
+    __attribute__((target("avx512f"))) inline __m512 Load16AsFloatAVX512(const Float16* p) {
+        return _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)));
+    }
+
+    __attribute__((target("avx512f"))) inline __m512 Load16AsFloatAVX512(const BFloat16* p) {
+        __m512i widened = _mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)));
+        return _mm512_castsi512_ps(_mm512_slli_epi32(widened, 16));
+    }
+
+    // Masked 8-bit and 16-bit loads need AVX-512BW, so the tail of a compact point goes through a zero-padded copy
+    template<typename T>
+    __attribute__((target("avx512f"))) inline __m512 LoadTailAsFloatAVX512(const T* p, unsigned count) {
+        T tail[16] = {}; // all zero bits is 0.0 for the 16-bit float types as well
+        std::copy(p, p + count, tail);
+        return Load16AsFloatAVX512(tail);
+    }
+
+    template<typename T>
+    __attribute__((target("avx512f"))) float SqrL2MixedAVX512(const float* q, const T* p, unsigned d) {
+        __m512 sum0 = _mm512_setzero_ps();
+        __m512 sum1 = _mm512_setzero_ps();
+        unsigned i = 0;
+        for (; i + 32 <= d; i += 32) {
+            __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(q + i), Load16AsFloatAVX512(p + i));
+            __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(q + i + 16), Load16AsFloatAVX512(p + i + 16));
+            sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+            sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+        }
+        for (; i + 16 <= d; i += 16) {
+            __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(q + i), Load16AsFloatAVX512(p + i));
+            sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+        }
+        if (i < d) {
+            __mmask16 mask = (__mmask16(1) << (d - i)) - 1;
+            __m512 d0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, q + i), LoadTailAsFloatAVX512(p + i, d - i));
+            sum1 = _mm512_fmadd_ps(d0, d0, sum1);
+        }
+        return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+    }
+
+    template<typename T>
+    __attribute__((target("avx512f"))) float InnerProductMixedAVX512(const float* q, const T* p, unsigned d) {
+        __m512 sum0 = _mm512_setzero_ps();
+        __m512 sum1 = _mm512_setzero_ps();
+        unsigned i = 0;
+        for (; i + 32 <= d; i += 32) {
+            sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(q + i), Load16AsFloatAVX512(p + i), sum0);
+            sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(q + i + 16), Load16AsFloatAVX512(p + i + 16), sum1);
+        }
+        for (; i + 16 <= d; i += 16) {
+            sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(q + i), Load16AsFloatAVX512(p + i), sum0);
+        }
+        if (i < d) {
+            __mmask16 mask = (__mmask16(1) << (d - i)) - 1;
+            sum1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, q + i), LoadTailAsFloatAVX512(p + i, d - i), sum1);
+        }
+        return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+    }
+
+    template<typename T>
+    __attribute__((target("avx512f"))) float SqrL2PairAVX512(const T* a, const T* b, unsigned d) {
+        __m512 sum0 = _mm512_setzero_ps();
+        __m512 sum1 = _mm512_setzero_ps();
+        unsigned i = 0;
+        for (; i + 32 <= d; i += 32) {
+            __m512 d0 = _mm512_sub_ps(Load16AsFloatAVX512(a + i), Load16AsFloatAVX512(b + i));
+            __m512 d1 = _mm512_sub_ps(Load16AsFloatAVX512(a + i + 16), Load16AsFloatAVX512(b + i + 16));
+            sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+            sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+        }
+        for (; i + 16 <= d; i += 16) {
+            __m512 d0 = _mm512_sub_ps(Load16AsFloatAVX512(a + i), Load16AsFloatAVX512(b + i));
+            sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+        }
+        if (i < d) {
+            __m512 d0 = _mm512_sub_ps(LoadTailAsFloatAVX512(a + i, d - i), LoadTailAsFloatAVX512(b + i, d - i));
+            sum1 = _mm512_fmadd_ps(d0, d0, sum1);
+        }
+        return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+    }
+
+    template<typename T>
+    __attribute__((target("avx512f"))) float InnerProductPairAVX512(const T* a, const T* b, unsigned d) {
+        __m512 sum0 = _mm512_setzero_ps();
+        __m512 sum1 = _mm512_setzero_ps();
+        unsigned i = 0;
+        for (; i + 32 <= d; i += 32) {
+            sum0 = _mm512_fmadd_ps(Load16AsFloatAVX512(a + i), Load16AsFloatAVX512(b + i), sum0);
+            sum1 = _mm512_fmadd_ps(Load16AsFloatAVX512(a + i + 16), Load16AsFloatAVX512(b + i + 16), sum1);
+        }
+        for (; i + 16 <= d; i += 16) {
+            sum0 = _mm512_fmadd_ps(Load16AsFloatAVX512(a + i), Load16AsFloatAVX512(b + i), sum0);
+        }
+        if (i < d) {
+            sum1 = _mm512_fmadd_ps(LoadTailAsFloatAVX512(a + i, d - i), LoadTailAsFloatAVX512(b + i, d - i), sum1);
+        }
+        return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+    }
+
+#pragma GCC diagnostic pop
+
+#endif
+
+    const DistanceKernels scalar_kernels{ SimdLevel::Scalar, "scalar", SqrL2Scalar, InnerProductScalar, VecNormScalar, SqrL2BlockScalar, InnerProductBlockScalar,
+                                          InnerProductTileFromBlock<InnerProductBlockScalar>, SqrL2BoundedScalar,
+                                          ScalarCompactKernels<uint8_t>(), ScalarCompactKernels<int8_t>(),
+                                          ScalarCompactKernels<Float16>(), ScalarCompactKernels<BFloat16>() };
+#ifdef GP_ANN_X86
+    const DistanceKernels sse_kernels{ SimdLevel::SSE, "sse", SqrL2SSE, InnerProductSSE, VecNormSSE, SqrL2BlockSSE, InnerProductBlockSSE,
+                                       InnerProductTileFromBlock<InnerProductBlockSSE>, SqrL2BoundedSSE,
+                                       // SSE2 has no cheap widening of 8-bit or 16-bit elements, so the compact points go through the scalar kernels
+                                       ScalarCompactKernels<uint8_t>(), ScalarCompactKernels<int8_t>(),
+                                       ScalarCompactKernels<Float16>(), ScalarCompactKernels<BFloat16>() };
+    template<unsigned D>
+    constexpr DistanceKernels AVX2Kernels() {
+        return DistanceKernels{ SimdLevel::AVX2, "avx2", SqrL2AVX2<D>, InnerProductAVX2<D>, VecNormAVX2<D>, SqrL2BlockAVX2<D>, InnerProductBlockAVX2<D>,
+                                InnerProductTileAVX2<D>, SqrL2BoundedAVX2<D>,
+                                { SqrL2MixedAVX2<uint8_t>, InnerProductMixedAVX2<uint8_t>, SqrL2IntAVX2<uint8_t>, InnerProductIntAVX2<uint8_t> },
+                                { SqrL2MixedAVX2<int8_t>, InnerProductMixedAVX2<int8_t>, SqrL2IntAVX2<int8_t>, InnerProductIntAVX2<int8_t> },
+                                { SqrL2MixedAVX2<Float16>, InnerProductMixedAVX2<Float16>, SqrL2PairAVX2<Float16>, InnerProductPairAVX2<Float16> },
+                                { SqrL2MixedAVX2<BFloat16>, InnerProductMixedAVX2<BFloat16>, SqrL2PairAVX2<BFloat16>, InnerProductPairAVX2<BFloat16> } };
+    }
+
+    template<unsigned D>
+    constexpr DistanceKernels AVX512Kernels() {
+        return DistanceKernels{ SimdLevel::AVX512, "avx512", SqrL2AVX512<D>, InnerProductAVX512<D>, VecNormAVX512<D>, SqrL2BlockAVX512<D>,
+                                InnerProductBlockAVX512<D>, InnerProductTileAVX512<D>, SqrL2BoundedAVX512<D>,
+                                { SqrL2MixedAVX512<uint8_t>, InnerProductMixedAVX512<uint8_t>, SqrL2IntAVX2<uint8_t>, InnerProductIntAVX2<uint8_t> },
+                                { SqrL2MixedAVX512<int8_t>, InnerProductMixedAVX512<int8_t>, SqrL2IntAVX2<int8_t>, InnerProductIntAVX2<int8_t> },
+                                { SqrL2MixedAVX512<Float16>, InnerProductMixedAVX512<Float16>, SqrL2PairAVX512<Float16>, InnerProductPairAVX512<Float16> },
+                                { SqrL2MixedAVX512<BFloat16>, InnerProductMixedAVX512<BFloat16>, SqrL2PairAVX512<BFloat16>, InnerProductPairAVX512<BFloat16> } };
+    }
+
+    const DistanceKernels avx2_kernels = AVX2Kernels<0>();
+    const DistanceKernels avx512_kernels = AVX512Kernels<0>();
+    // indexed like FIXED_DIMENSIONS
+    const DistanceKernels avx2_fixed_kernels[NUM_FIXED_DIMENSIONS] = { AVX2Kernels<FIXED_DIMENSIONS[0]>(), AVX2Kernels<FIXED_DIMENSIONS[1]>(),
+                                                                       AVX2Kernels<FIXED_DIMENSIONS[2]>(), AVX2Kernels<FIXED_DIMENSIONS[3]>() };
+    const DistanceKernels avx512_fixed_kernels[NUM_FIXED_DIMENSIONS] = { AVX512Kernels<FIXED_DIMENSIONS[0]>(), AVX512Kernels<FIXED_DIMENSIONS[1]>(),
+                                                                         AVX512Kernels<FIXED_DIMENSIONS[2]>(), AVX512Kernels<FIXED_DIMENSIONS[3]>() };
+#endif
+
+    // The kernels specialized for FIXED_DIMENSIONS[index] at the given level, or nullptr if the level has none
+    const DistanceKernels* FixedDimensionKernels(SimdLevel level, int index) {
+        switch (level) {
+#ifdef GP_ANN_X86
+            case SimdLevel::AVX512: return &avx512_fixed_kernels[index];
+            case SimdLevel::AVX2: return &avx2_fixed_kernels[index];
+#endif
+            default: return nullptr;
+        }
+    }
+
+    std::atomic<const DistanceKernels*> active_kernels{ nullptr };
+    std::once_flag select_kernels_flag;
+
+    SimdLevel ParseSimdLevel(const std::string& s) {
+        if (s == "scalar") return SimdLevel::Scalar;
+        if (s == "sse") return SimdLevel::SSE;
+        if (s == "avx2") return SimdLevel::AVX2;
+        if (s == "avx512") return SimdLevel::AVX512;
+        throw std::runtime_error("Unknown SIMD level " + s + ". Valid options are [scalar, sse, avx2, avx512]");
+    }
+
+    void SelectKernels() {
+        SimdLevel level = DetectSimdLevel();
+        if (const char* env = std::getenv("GP_ANN_SIMD"); env != nullptr) {
+            level = std::min(level, ParseSimdLevel(env));
+        }
+        // walk down until we find a level whose kernels pass the self-check
+        for (int l = static_cast<int>(level); l >= 0; --l) {
+            const DistanceKernels& kernels = KernelsForLevel(static_cast<SimdLevel>(l));
+            if (ValidateDistanceKernels(kernels)) {
+                active_kernels.store(&kernels, std::memory_order_release);
+                return;
+            }
+            std::cerr << "Distance kernels for " << kernels.name << " failed the self-check. Fall back to a lower level." << std::endl;
+        }
+        active_kernels.store(&scalar_kernels, std::memory_order_release);
+    }
+
+    // Accumulate in double so that the reference is more precise than every kernel under test
+    template<typename A, typename B>
+    double ReferenceSqrL2(const A* a, const B* b, unsigned d) {
+        double result = 0.0;
+        for (unsigned i = 0; i < d; ++i) {
+            double diff = double(ToFloat(a[i])) - double(ToFloat(b[i]));
+            result += diff * diff;
+        }
+        return result;
+    }
+
+    template<typename A, typename B>
+    double ReferenceInnerProduct(const A* a, const B* b, unsigned d) {
+        double result = 0.0;
+        for (unsigned i = 0; i < d; ++i) {
+            result += double(ToFloat(a[i])) * double(ToFloat(b[i]));
+        }
+        return result;
+    }
+
+    bool Close(double expected, float actual, double scale) {
+        return std::abs(expected - double(actual)) <= 1e-4 * scale + 1e-5;
+    }
+
+    // Random elements of type T and a random float query in the same value range
+    template<typename T>
+    struct CompactTestValues {
+        std::uniform_int_distribution<int> element{ std::numeric_limits<T>::min(), std::numeric_limits<T>::max() };
+        std::uniform_real_distribution<float> coordinate{ std::numeric_limits<T>::min(), std::numeric_limits<T>::max() };
+        T Element(std::mt19937& prng) { return static_cast<T>(element(prng)); }
+        float Query(std::mt19937& prng) { return coordinate(prng); }
+    };
+
+    template<>
+    struct CompactTestValues<Float16> {
+        std::uniform_real_distribution<float> coordinate{ -2.f, 2.f };
+        Float16 Element(std::mt19937& prng) { return ToFloat16(coordinate(prng)); }
+        float Query(std::mt19937& prng) { return coordinate(prng); }
+    };
+
+    template<>
+    struct CompactTestValues<BFloat16> {
+        std::uniform_real_distribution<float> coordinate{ -2.f, 2.f };
+        BFloat16 Element(std::mt19937& prng) { return ToBFloat16(coordinate(prng)); }
+        float Query(std::mt19937& prng) { return coordinate(prng); }
+    };
+
+    template<typename T>
+    bool ValidateCompactKernels(const CompactKernels<T>& kernels, const char* name, const char* type_name, bool verbose) {
+        constexpr unsigned MAX_DIM = 300;
+        std::mt19937 prng(555);
+        CompactTestValues<T> values_of_t;
+        std::vector<T> a(MAX_DIM), b(MAX_DIM);
+        std::vector<float> q(MAX_DIM);
+        bool ok = true;
+        for (unsigned d = 1; d <= MAX_DIM; ++d) {
+            for (unsigned j = 0; j < d; ++j) {
+                a[j] = values_of_t.Element(prng);
+                b[j] = values_of_t.Element(prng);
+                q[j] = values_of_t.Query(prng);
+            }
+            const double scale = ReferenceInnerProduct(q.data(), q.data(), d) + ReferenceInnerProduct(a.data(), a.data(), d) +
+                                 ReferenceInnerProduct(b.data(), b.data(), d);
+            const float values[4] = { kernels.sqr_l2(q.data(), a.data(), d), kernels.inner_product(q.data(), a.data(), d),
+                                      kernels.sqr_l2_pair(a.data(), b.data(), d), kernels.inner_product_pair(a.data(), b.data(), d) };
+            const double expected[4] = { ReferenceSqrL2(q.data(), a.data(), d), ReferenceInnerProduct(q.data(), a.data(), d),
+                                         ReferenceSqrL2(a.data(), b.data(), d), ReferenceInnerProduct(a.data(), b.data(), d) };
+            for (int k = 0; k < 4; ++k) {
+                if (!Close(expected[k], values[k], scale)) {
+                    if (verbose) {
+                        std::cerr << "Kernel " << name << " for " << type_name << " mismatch at d = " << d << ": kernel " << k << " " << values[k] << " vs "
+                                  << expected[k] << std::endl;
+                    }
+                    ok = false;
+                }
+            }
+        }
+        return ok;
+    }
+
+    // The kernels specialized for dimension d are only checked at d
+    bool ValidateFixedDimensionKernels(const DistanceKernels& kernels, unsigned d, bool verbose) {
+        constexpr size_t COUNT_A = 5;
+        constexpr size_t COUNT_B = 11;
+        std::mt19937 prng(555 + d);
+        std::uniform_real_distribution<float> coordinate(-2.f, 2.f);
+        std::vector<float> a(COUNT_A * d), b(COUNT_B * d), out(COUNT_A * COUNT_B), l2_out(COUNT_B), ip_out(COUNT_B);
+        for (float& x : a) x = coordinate(prng);
+        for (float& x : b) x = coordinate(prng);
+        kernels.sqr_l2_block(a.data(), b.data(), COUNT_B, d, l2_out.data());
+        kernels.inner_product_block(a.data(), b.data(), COUNT_B, d, ip_out.data());
+        kernels.inner_product_tile(a.data(), COUNT_A, b.data(), COUNT_B, d, out.data());
+        bool ok = true;
+        for (size_t i = 0; i < COUNT_A; ++i) {
+            const float* A = a.data() + i * d;
+            for (size_t j = 0; j < COUNT_B; ++j) {
+                const float* B = b.data() + j * d;
+                const double scale = ReferenceInnerProduct(A, A, d) + ReferenceInnerProduct(B, B, d);
+                const double l2 = ReferenceSqrL2(A, B, d);
+                const double ip = ReferenceInnerProduct(A, B, d);
+                const float l2_kernel = kernels.sqr_l2(A, B, d);
+                bool pair_ok = Close(l2, l2_kernel, scale) && Close(ip, kernels.inner_product(A, B, d), scale) &&
+                               Close(ip, out[i * COUNT_B + j], scale) && Close(l2, kernels.sqr_l2_bounded(A, B, d, 2.f * l2_kernel), scale);
+                if (i == 0) {
+                    pair_ok &= Close(l2, l2_out[j], scale) && Close(ip, ip_out[j], scale);
+                }
+                if (j == 0) {
+                    pair_ok &= Close(ReferenceInnerProduct(A, A, d), kernels.vec_norm(A, d), scale);
+                }
+                if (!pair_ok) {
+                    if (verbose) {
+                        std::cerr << "Kernel " << kernels.name << " specialized for d = " << d << " mismatch at entry " << i << " " << j << std::endl;
+                    }
+                    ok = false;
+                }
+            }
+        }
+        return ok;
+    }
+} // namespace
+
+std::string SimdLevelName(SimdLevel level) { return KernelsForLevel(level).name; }
+
+SimdLevel DetectSimdLevel() {
+#ifdef GP_ANN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return SimdLevel::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c")) {
+        return SimdLevel::AVX2;
+    }
+    return SimdLevel::SSE;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+const DistanceKernels& KernelsForLevel(SimdLevel level) {
+    switch (level) {
+#ifdef GP_ANN_X86
+        case SimdLevel::AVX512: return avx512_kernels;
+        case SimdLevel::AVX2: return avx2_kernels;
+        case SimdLevel::SSE: return sse_kernels;
+#endif
+        default: return scalar_kernels;
+    }
+}
+
+const DistanceKernels& ActiveDistanceKernels() {
+    const DistanceKernels* kernels = active_kernels.load(std::memory_order_acquire);
+    if (kernels == nullptr) [[unlikely]] {
+        std::call_once(select_kernels_flag, SelectKernels);
+        kernels = active_kernels.load(std::memory_order_acquire);
+    }
+    return *kernels;
+}
+
+const DistanceKernels& ActiveDistanceKernels(unsigned d) {
+    const DistanceKernels& kernels = ActiveDistanceKernels();
+    if (const int index = FixedDimensionIndex(d); index >= 0) {
+        if (const DistanceKernels* fixed = FixedDimensionKernels(kernels.level, index); fixed != nullptr) {
+            return *fixed;
+        }
+    }
+    return kernels;
+}
+
+bool SetActiveDistanceKernels(SimdLevel level) {
+    ActiveDistanceKernels(); // make sure the automatic selection doesn't overwrite ours later
+    if (level > DetectSimdLevel()) {
+        return false;
+    }
+    const DistanceKernels& kernels = KernelsForLevel(level);
+    if (kernels.level != level || !ValidateDistanceKernels(kernels)) {
+        return false;
+    }
+    active_kernels.store(&kernels, std::memory_order_release);
+    return true;
+}
+
+bool ValidateDistanceKernels(const DistanceKernels& kernels, bool verbose) {
+    constexpr unsigned MAX_DIM = 300;
+    std::mt19937 prng(555);
+    std::uniform_real_distribution<float> coordinate(-2.f, 2.f);
+    std::vector<float> a(MAX_DIM), b(MAX_DIM);
+    bool ok = true;
+    for (unsigned d = 1; d <= MAX_DIM; ++d) {
+        for (unsigned j = 0; j < d; ++j) {
+            a[j] = coordinate(prng);
+            b[j] = coordinate(prng);
+        }
+        // the magnitude of the summands determines the tolerable rounding error
+        const double scale = ReferenceInnerProduct(a.data(), a.data(), d) + ReferenceInnerProduct(b.data(), b.data(), d);
+        const double expected_l2 = ReferenceSqrL2(a.data(), b.data(), d);
+        const double expected_ip = ReferenceInnerProduct(a.data(), b.data(), d);
+        const double expected_norm = ReferenceInnerProduct(a.data(), a.data(), d);
+        const float l2 = kernels.sqr_l2(a.data(), b.data(), d);
+        const float ip = kernels.inner_product(a.data(), b.data(), d);
+        const float norm = kernels.vec_norm(a.data(), d);
+        // with a bound above the distance the full distance comes out. with half the distance we get a partial sum between the two
+        const float full = kernels.sqr_l2_bounded(a.data(), b.data(), d, 2.f * l2);
+        const float abandoned = kernels.sqr_l2_bounded(a.data(), b.data(), d, 0.5f * l2);
+        if (!Close(expected_l2, full, scale) || abandoned <= 0.5f * l2 || double(abandoned) > double(full) + 1e-4 * scale + 1e-5) {
+            if (verbose) {
+                std::cerr << "Kernel " << kernels.name << " bounded sqr_l2 mismatch at d = " << d << std::endl;
+            }
+            ok = false;
+        }
+        if (!Close(expected_l2, l2, scale) || !Close(expected_ip, ip, scale) || !Close(expected_norm, norm, scale)) {
+            if (verbose) {
+                std::cerr << "Kernel " << kernels.name << " mismatch at d = " << d << ": sqr_l2 " << l2 << " vs " << expected_l2 << ", inner_product " << ip
+                          << " vs " << expected_ip << ", vec_norm " << norm << " vs " << expected_norm << std::endl;
+            }
+            ok = false;
+        }
+    }
+
+    // the block kernels have to agree with the reference as well, including the leftover rows
+    constexpr size_t BLOCK_COUNT = 11;
+    std::vector<float> block(BLOCK_COUNT * MAX_DIM), l2_out(BLOCK_COUNT), ip_out(BLOCK_COUNT);
+    for (unsigned d : { 1u, 7u, 16u, 33u, 100u, 128u, 300u }) {
+        for (unsigned j = 0; j < d; ++j) a[j] = coordinate(prng);
+        for (size_t j = 0; j < BLOCK_COUNT * d; ++j) block[j] = coordinate(prng);
+        kernels.sqr_l2_block(a.data(), block.data(), BLOCK_COUNT, d, l2_out.data());
+        kernels.inner_product_block(a.data(), block.data(), BLOCK_COUNT, d, ip_out.data());
+        for (size_t p = 0; p < BLOCK_COUNT; ++p) {
+            const float* P = block.data() + p * d;
+            const double scale = ReferenceInnerProduct(a.data(), a.data(), d) + ReferenceInnerProduct(P, P, d);
+            const double l2 = ReferenceSqrL2(P, a.data(), d);
+            const double ip = ReferenceInnerProduct(P, a.data(), d);
+            if (!Close(l2, l2_out[p], scale) || !Close(ip, ip_out[p], scale)) {
+                if (verbose) {
+                    std::cerr << "Block kernel " << kernels.name << " mismatch at d = " << d << " point " << p << ": sqr_l2 " << l2_out[p] << " vs " << l2
+                              << ", inner_product " << ip_out[p] << " vs " << ip << std::endl;
+                }
+                ok = false;
+            }
+        }
+    }
+
+    // tiles with leftover rows on both sides
+    constexpr size_t TILE_COUNT_A = 5;
+    std::vector<float> tile_rows(TILE_COUNT_A * MAX_DIM), tile_out(TILE_COUNT_A * BLOCK_COUNT);
+    for (unsigned d : { 1u, 9u, 16u, 100u, 128u, 300u }) {
+        for (size_t j = 0; j < TILE_COUNT_A * d; ++j) tile_rows[j] = coordinate(prng);
+        for (size_t j = 0; j < BLOCK_COUNT * d; ++j) block[j] = coordinate(prng);
+        kernels.inner_product_tile(tile_rows.data(), TILE_COUNT_A, block.data(), BLOCK_COUNT, d, tile_out.data());
+        for (size_t i = 0; i < TILE_COUNT_A; ++i) {
+            for (size_t p = 0; p < BLOCK_COUNT; ++p) {
+                const float* A = tile_rows.data() + i * d;
+                const float* P = block.data() + p * d;
+                const double scale = ReferenceInnerProduct(A, A, d) + ReferenceInnerProduct(P, P, d);
+                const double ip = ReferenceInnerProduct(A, P, d);
+                if (!Close(ip, tile_out[i * BLOCK_COUNT + p], scale)) {
+                    if (verbose) {
+                        std::cerr << "Tile kernel " << kernels.name << " mismatch at d = " << d << " entry " << i << " " << p << ": inner_product "
+                                  << tile_out[i * BLOCK_COUNT + p] << " vs " << ip << std::endl;
+                    }
+                    ok = false;
+                }
+            }
+        }
+    }
+    ok &= ValidateCompactKernels(kernels.u8, kernels.name, "uint8", verbose);
+    ok &= ValidateCompactKernels(kernels.i8, kernels.name, "int8", verbose);
+    ok &= ValidateCompactKernels(kernels.f16, kernels.name, "fp16", verbose);
+    ok &= ValidateCompactKernels(kernels.bf16, kernels.name, "bf16", verbose);
+    if (&kernels == &KernelsForLevel(kernels.level)) {
+        for (size_t i = 0; i < NUM_FIXED_DIMENSIONS; ++i) {
+            if (const DistanceKernels* fixed = FixedDimensionKernels(kernels.level, i); fixed != nullptr) {
+                ok &= ValidateFixedDimensionKernels(*fixed, FIXED_DIMENSIONS[i], verbose);
+            }
+        }
+    }
+    return ok;
+}
+
+bool ValidateDistanceKernels(bool verbose) {
+    bool ok = true;
+    for (int l = 0; l <= static_cast<int>(DetectSimdLevel()); ++l) {
+        const DistanceKernels& kernels = KernelsForLevel(static_cast<SimdLevel>(l));
+        bool kernels_ok = ValidateDistanceKernels(kernels, verbose);
+        if (verbose) {
+            std::cout << "Distance kernels " << kernels.name << (kernels_ok ? " passed" : " FAILED") << " the self-check" << std::endl;
+        }
+        ok &= kernels_ok;
+    }
+    return ok;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "half_float.h"
+
+// Instruction set levels for which we ship distance kernels. Ordered from weakest to strongest.
+enum class SimdLevel {
+    Scalar = 0,
+    SSE = 1,
+    AVX2 = 2,     // AVX2 + FMA + F16C
+    AVX512 = 3,   // AVX-512F
+};
+
+// Kernels for points stored in a compact element type T (see ElementType in defs.h). The first two take a float query
+// (a query point or a centroid). The _pair variants compute the distance between two stored points. For the 8-bit types they
+// are exact in integer arithmetic (the 32-bit accumulators are exact for d < 33000), the 16-bit float types are converted to float.
+template<typename T>
+struct CompactKernels {
+    float (*sqr_l2)(const float* q, const T* p, unsigned d) = nullptr;
+    float (*inner_product)(const float* q, const T* p, unsigned d) = nullptr;
+    float (*sqr_l2_pair)(const T* a, const T* b, unsigned d) = nullptr;
+    float (*inner_product_pair)(const T* a, const T* b, unsigned d) = nullptr;
+};
+
+// One set of distance kernels compiled for a specific instruction set.
+// The kernels are compiled with function-level target attributes, so that a single binary
+// (built without -march=native) carries all of them and picks the best one at startup.
+struct DistanceKernels {
+    SimdLevel level = SimdLevel::Scalar;
+    const char* name = "scalar";
+    float (*sqr_l2)(const float* a, const float* b, unsigned d) = nullptr;
+    float (*inner_product)(const float* a, const float* b, unsigned d) = nullptr;
+    float (*vec_norm)(const float* a, unsigned d) = nullptr;
+    // One query against count points stored contiguously (row-major) at block. out[i] is the value for the i-th point.
+    // Every point is accumulated in the same order as in the single-pair kernels, so the results agree up to rounding.
+    void (*sqr_l2_block)(const float* q, const float* block, size_t count, unsigned d, float* out) = nullptr;
+    void (*inner_product_block)(const float* q, const float* block, size_t count, unsigned d, float* out) = nullptr;
+    // All inner products between a_count points at a and b_count points at b (both contiguous, row-major).
+    // out[i * b_count + j] = a_i . b_j. Several points of a and b are register-blocked, which is the micro-kernel of the distance matrix engine.
+    void (*inner_product_tile)(const float* a, size_t a_count, const float* b, size_t b_count, unsigned d, float* out) = nullptr;
+    // Like sqr_l2, but checks the partial sum against bound every BOUND_CHECK_INTERVAL dimensions and stops as soon as it exceeds bound.
+    // Then the returned value is some partial sum > bound, otherwise it is the full distance (same as sqr_l2 up to rounding).
+    float (*sqr_l2_bounded)(const float* a, const float* b, unsigned d, float bound) = nullptr;
+    CompactKernels<uint8_t> u8;
+    CompactKernels<int8_t> i8;
+    CompactKernels<Float16> f16;
+    CompactKernels<BFloat16> bf16;
+};
+
+// How often the bounded kernels compare the partial sum against the bound
+constexpr unsigned BOUND_CHECK_INTERVAL = 32;
+
+// Highest level supported by the CPU we're running on.
+SimdLevel DetectSimdLevel();
+
+// Kernels compiled for the given level. The caller has to make sure the CPU supports it.
+const DistanceKernels& KernelsForLevel(SimdLevel level);
+
+// The kernels that distance(), inner_product(), vec_norm() etc. are routed through.
+// Selected on first use: the detected level, capped by the environment variable GP_ANN_SIMD=scalar|sse|avx2|avx512
+// if it is set. Kernels that fail the self-check are skipped.
+const DistanceKernels& ActiveDistanceKernels();
+
+// The active kernels with the float kernels specialized for dimension d, if the active level has a version for d
+// (96, 100, 128 and 200 for AVX2 and AVX-512). Otherwise the same as ActiveDistanceKernels(). The returned kernels
+// must only be called with dimension d. Look them up once at the entry of a hot loop.
+const DistanceKernels& ActiveDistanceKernels(unsigned d);
+
+// Force a specific level (e.g. for benchmarks). Returns false and leaves the selection unchanged
+// if the CPU doesn't support the level or its kernels fail validation.
+bool SetActiveDistanceKernels(SimdLevel level);
+
+// Checks the kernels of every supported level against a double-precision scalar reference on
+// random vectors of all lengths in [1, 300] (so the tail handling is exercised as well).
+bool ValidateDistanceKernels(bool verbose = false);
+
+bool ValidateDistanceKernels(const DistanceKernels& kernels, bool verbose = false);
+
+std::string SimdLevelName(SimdLevel level);
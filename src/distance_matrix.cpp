@@ -0,0 +1,317 @@
+#include "distance_matrix.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <parlay/parallel.h>
+#include <parlay/primitives.h>
+
+#include "dist.h"
+#include "distance_kernels.h"
+#include "topn.h"
+
+namespace {
+    constexpr size_t POINT_TILE = 32;
+    constexpr size_t CENTER_TILE_BYTES = 128 * 1024;
+
+    size_t CenterTileSize(size_t d) {
+        size_t tile = CENTER_TILE_BYTES / (d * sizeof(float));
+        tile -= tile % 4; // multiple of the micro-kernel width
+        return std::max<size_t>(tile, 16);
+    }
+
+#ifdef MIPS_DISTANCE
+    constexpr bool SQUARED_L2 = false;
+#else
+    constexpr bool SQUARED_L2 = true;
+#endif
+
+    // Packs the points of one tile contiguously and computes their norms, unless the PointSet has them cached.
+    // The tile computes squared L2 distances if squared_l2 is set, else 1 - inner product
+    struct PointTile {
+        std::vector<float> coordinates;
+        std::vector<float> norms;
+        std::vector<float> dists;
+        size_t n = 0;
+        bool squared_l2;
+
+        explicit PointTile(bool squared_l2 = SQUARED_L2) : squared_l2(squared_l2) { }
+
+        // Compact points are converted to float here, so the rest of the engine only deals with floats
+        template<typename GetPointID>
+        void Pack(PointSet& points, size_t count, size_t center_tile, GetPointID&& get_point_id) {
+            const size_t d = points.d;
+            n = count;
+            coordinates.resize(count * d);
+            norms.resize(count);
+            dists.resize(count * center_tile);
+            for (size_t i = 0; i < count; ++i) {
+                const size_t id = get_point_id(i);
+                points.CopyPointAsFloat(id, coordinates.data() + i * d);
+                if (squared_l2) {
+                    norms[i] = points.HasNorms() ? points.norms[id] : vec_norm(coordinates.data() + i * d, d);
+                }
+            }
+        }
+
+        // dists[i * num_centers + j] = distance of point i in the tile to center c_begin + j
+        void ComputeDistances(const DistanceKernels& kernels, PointSet& centers, const std::vector<float>& center_norms, size_t c_begin, size_t num_centers) {
+            const size_t d = centers.d;
+            kernels.inner_product_tile(coordinates.data(), n, centers.coordinates.data() + c_begin * d, num_centers, d, dists.data());
+            for (size_t i = 0; i < n; ++i) {
+                float* row = dists.data() + i * num_centers;
+                if (!squared_l2) {
+                    for (size_t j = 0; j < num_centers; ++j) row[j] = 1.0f - row[j];
+                    continue;
+                }
+                for (size_t j = 0; j < num_centers; ++j) {
+                    // clamp, since cancellation can make the decomposed distance slightly negative
+                    row[j] = std::max(0.0f, norms[i] - 2.0f * row[j] + center_norms[c_begin + j]);
+                }
+            }
+        }
+    };
+
+    std::vector<float> CenterNorms(PointSet& centers, bool squared_l2 = SQUARED_L2) {
+        std::vector<float> center_norms(centers.n, 0.f);
+        if (squared_l2) {
+            parlay::parallel_for(0, centers.n, [&](size_t j) { center_norms[j] = vec_norm(centers.GetPoint(j), centers.d); });
+        }
+        return center_norms;
+    }
+
+    // Queries per pass of ExactNearestNeighbors over the points
+    constexpr size_t QUERY_BATCH = 2048;
+
+    // How far a decomposed distance can be off the exact one: a float inner product over d dimensions is off by at most about
+    // d * FLT_EPSILON * |x| |q|. Twice that, since both the candidate and the current k-th neighbor can be off. norms are squared
+    float DecomposedDistanceSlack(float query_norm, float max_point_norm, size_t d) {
+        const float relative_error = 4.0f * d * std::numeric_limits<float>::epsilon();
+#ifdef MIPS_DISTANCE
+        return relative_error * std::sqrt(query_norm * max_point_norm);
+#else
+        return relative_error * (query_norm + max_point_norm);
+#endif
+    }
+
+    // The candidates of one query in one block of points: everything whose decomposed distance is within slack of the k-th smallest seen so far
+    struct CandidateBuffer {
+        NNVec candidates;
+        float threshold = std::numeric_limits<float>::max();
+        size_t capacity;
+
+        explicit CandidateBuffer(size_t k) : capacity(2 * k + 64) { }
+
+        void Add(float dist, uint32_t id, float slack, size_t k) {
+            if (dist > threshold + slack) {
+                return;
+            }
+            candidates.emplace_back(dist, id);
+            if (candidates.size() >= capacity) {
+                Shrink(slack, k);
+            }
+        }
+
+        void Shrink(float slack, size_t k) {
+            std::nth_element(candidates.begin(), candidates.begin() + (k - 1), candidates.end());
+            threshold = candidates[k - 1].first;
+            std::erase_if(candidates, [&](const auto& c) { return c.first > threshold + slack; });
+            // many ties within the slack would otherwise trigger a shrink on every add
+            capacity = std::max(capacity, 2 * candidates.size());
+        }
+    };
+
+    float MaxNorm(PointSet& points) {
+        constexpr size_t BLOCK = 4096;
+        const size_t num_blocks = (points.n + BLOCK - 1) / BLOCK;
+        std::vector<float> block_max(num_blocks, 0.f);
+        parlay::parallel_for(0, num_blocks, [&](size_t b) {
+            std::vector<float> buffer;
+            for (size_t i = b * BLOCK; i < std::min(points.n, (b + 1) * BLOCK); ++i) {
+                const float norm = points.HasNorms() ? points.norms[i] : vec_norm(points.GetPointAsFloat(i, buffer), points.d);
+                block_max[b] = std::max(block_max[b], norm);
+            }
+        }, 1);
+        return num_blocks == 0 ? 0.f : *std::max_element(block_max.begin(), block_max.end());
+    }
+} // namespace
+
+namespace {
+    // ClosestCenters for the points get_point_id(0..num_points-1), with the distances to the closest and the second closest center
+    // written to best_out / second_out if they aren't null. The results are indexed like the points
+    template<typename GetPointID>
+    void ClosestCentersImpl(PointSet& points, size_t num_points, GetPointID&& get_point_id, PointSet& centers, int* closest_center, float* best_out,
+                            float* second_out, bool squared_l2 = SQUARED_L2) {
+        const DistanceKernels& kernels = ActiveDistanceKernels(points.d);
+        const std::vector<float> center_norms = CenterNorms(centers, squared_l2);
+        const size_t center_tile = CenterTileSize(points.d);
+        const size_t num_tiles = (num_points + POINT_TILE - 1) / POINT_TILE;
+        parlay::parallel_for(0, num_tiles, [&](size_t t) {
+            const size_t begin = t * POINT_TILE;
+            const size_t count = std::min(POINT_TILE, num_points - begin);
+            PointTile tile(squared_l2);
+            tile.Pack(points, count, center_tile, [&](size_t i) { return get_point_id(begin + i); });
+            std::vector<float> best_dist(count, std::numeric_limits<float>::max());
+            std::vector<float> second_dist(count, std::numeric_limits<float>::max());
+            std::vector<int> best(count, -1);
+            for (size_t c_begin = 0; c_begin < centers.n; c_begin += center_tile) {
+                const size_t num_centers = std::min(center_tile, centers.n - c_begin);
+                tile.ComputeDistances(kernels, centers, center_norms, c_begin, num_centers);
+                for (size_t i = 0; i < count; ++i) {
+                    const float* row = tile.dists.data() + i * num_centers;
+                    for (size_t j = 0; j < num_centers; ++j) {
+                        if (row[j] < best_dist[i]) {
+                            second_dist[i] = best_dist[i];
+                            best_dist[i] = row[j];
+                            best[i] = c_begin + j;
+                        } else if (row[j] < second_dist[i]) {
+                            second_dist[i] = row[j];
+                        }
+                    }
+                }
+            }
+            std::copy(best.begin(), best.end(), closest_center + begin);
+            if (best_out != nullptr) std::copy(best_dist.begin(), best_dist.end(), best_out + begin);
+            if (second_out != nullptr) std::copy(second_dist.begin(), second_dist.end(), second_out + begin);
+        }, 1);
+    }
+} // namespace
+
+void ClosestCenters(PointSet& points, PointSet& centers, std::vector<int>& closest_center) {
+    ClosestCentersImpl(points, points.n, [](size_t i) { return i; }, centers, closest_center.data(), nullptr, nullptr);
+}
+
+void ClosestCenters(PointSet& points, PointSet& centers, std::vector<int>& closest_center, std::vector<float>& closest_dist,
+                    std::vector<float>* second_dist) {
+    closest_dist.resize(points.n);
+    if (second_dist != nullptr) second_dist->resize(points.n);
+    ClosestCentersImpl(points, points.n, [](size_t i) { return i; }, centers, closest_center.data(), closest_dist.data(),
+                       second_dist != nullptr ? second_dist->data() : nullptr);
+}
+
+void ClosestCentersL2(PointSet& points, PointSet& centers, std::vector<int>& closest_center) {
+    ClosestCentersImpl(points, points.n, [](size_t i) { return i; }, centers, closest_center.data(), nullptr, nullptr, /* squared_l2 = */ true);
+}
+
+void ClosestTwoCenters(PointSet& points, const std::vector<uint32_t>& ids, PointSet& centers, std::vector<int>& closest_center,
+                       std::vector<float>& closest_dist, std::vector<float>& second_dist) {
+    closest_center.resize(ids.size());
+    closest_dist.resize(ids.size());
+    second_dist.resize(ids.size());
+    ClosestCentersImpl(points, ids.size(), [&](size_t i) { return ids[i]; }, centers, closest_center.data(), closest_dist.data(), second_dist.data());
+}
+
+void DistancesToCenters(PointSet& points, PointSet& centers, float* out) {
+    const DistanceKernels& kernels = ActiveDistanceKernels(points.d);
+    const std::vector<float> center_norms = CenterNorms(centers);
+    const size_t center_tile = CenterTileSize(points.d);
+    const size_t num_tiles = (points.n + POINT_TILE - 1) / POINT_TILE;
+    parlay::parallel_for(0, num_tiles, [&](size_t t) {
+        const size_t begin = t * POINT_TILE;
+        const size_t count = std::min(POINT_TILE, points.n - begin);
+        PointTile tile;
+        tile.Pack(points, count, center_tile, [&](size_t i) { return begin + i; });
+        for (size_t c_begin = 0; c_begin < centers.n; c_begin += center_tile) {
+            const size_t num_centers = std::min(center_tile, centers.n - c_begin);
+            tile.ComputeDistances(kernels, centers, center_norms, c_begin, num_centers);
+            for (size_t i = 0; i < count; ++i) {
+                std::copy_n(tile.dists.data() + i * num_centers, num_centers, out + (begin + i) * centers.n + c_begin);
+            }
+        }
+    }, 1);
+}
+
+std::vector<NNVec> ClosestCenters(PointSet& points, const std::vector<uint32_t>& ids, PointSet& centers, int k) {
+    const DistanceKernels& kernels = ActiveDistanceKernels(points.d);
+    const std::vector<float> center_norms = CenterNorms(centers);
+    const size_t center_tile = CenterTileSize(points.d);
+    const size_t num_tiles = (ids.size() + POINT_TILE - 1) / POINT_TILE;
+    std::vector<NNVec> result(ids.size());
+    parlay::parallel_for(0, num_tiles, [&](size_t t) {
+        const size_t begin = t * POINT_TILE;
+        const size_t count = std::min(POINT_TILE, ids.size() - begin);
+        PointTile tile;
+        tile.Pack(points, count, center_tile, [&](size_t i) { return ids[begin + i]; });
+        std::vector<TopN> top_k(count, TopN(k));
+        for (size_t c_begin = 0; c_begin < centers.n; c_begin += center_tile) {
+            const size_t num_centers = std::min(center_tile, centers.n - c_begin);
+            tile.ComputeDistances(kernels, centers, center_norms, c_begin, num_centers);
+            for (size_t i = 0; i < count; ++i) {
+                const float* row = tile.dists.data() + i * num_centers;
+                for (size_t j = 0; j < num_centers; ++j) {
+                    top_k[i].Add(std::make_pair(row[j], uint32_t(c_begin + j)));
+                }
+            }
+        }
+        for (size_t i = 0; i < count; ++i) {
+            result[begin + i] = top_k[i].Take();
+        }
+    }, 1);
+    return result;
+}
+
+std::vector<NNVec> ExactNearestNeighbors(PointSet& points, PointSet& queries, int k) {
+    const size_t d = points.d;
+    const DistanceKernels& kernels = ActiveDistanceKernels(d);
+    // the queries take the part of the centers
+    PointSet query_points;
+    query_points.d = d;
+    query_points.n = queries.n;
+    query_points.Alloc();
+    parlay::parallel_for(0, queries.n, [&](size_t q) { queries.CopyPointAsFloat(q, query_points.GetPoint(q)); });
+    const std::vector<float> center_norms = CenterNorms(query_points);
+    const float max_point_norm = MaxNorm(points);
+    std::vector<float> slack(queries.n);
+    parlay::parallel_for(0, queries.n, [&](size_t q) {
+        slack[q] = DecomposedDistanceSlack(vec_norm(query_points.GetPoint(q), d), max_point_norm, d);
+    });
+
+    const size_t query_tile = CenterTileSize(d);
+    const size_t num_tiles = (points.n + POINT_TILE - 1) / POINT_TILE;
+    const size_t num_blocks = std::max<size_t>(1, std::min<size_t>(num_tiles, parlay::num_workers()));
+    const size_t tiles_per_block = (num_tiles + num_blocks - 1) / num_blocks;
+
+    std::vector<NNVec> result(queries.n);
+    Timer timer;
+    for (size_t batch_begin = 0; batch_begin < queries.n; batch_begin += QUERY_BATCH) {
+        timer.Start();
+        const size_t batch_size = std::min(QUERY_BATCH, queries.n - batch_begin);
+        std::vector<std::vector<CandidateBuffer>> buffers(num_blocks);
+        parlay::parallel_for(0, num_blocks, [&](size_t block) {
+            std::vector<CandidateBuffer>& my_buffers = buffers[block];
+            my_buffers.assign(batch_size, CandidateBuffer(k));
+            PointTile tile;
+            for (size_t t = block * tiles_per_block; t < std::min(num_tiles, (block + 1) * tiles_per_block); ++t) {
+                const size_t begin = t * POINT_TILE;
+                const size_t count = std::min(POINT_TILE, points.n - begin);
+                tile.Pack(points, count, query_tile, [&](size_t i) { return begin + i; });
+                for (size_t q_begin = batch_begin; q_begin < batch_begin + batch_size; q_begin += query_tile) {
+                    const size_t num_queries = std::min(query_tile, batch_begin + batch_size - q_begin);
+                    tile.ComputeDistances(kernels, query_points, center_norms, q_begin, num_queries);
+                    for (size_t j = 0; j < num_queries; ++j) {
+                        CandidateBuffer& buffer = my_buffers[q_begin - batch_begin + j];
+                        for (size_t i = 0; i < count; ++i) {
+                            buffer.Add(tile.dists[i * num_queries + j], begin + i, slack[q_begin + j], k);
+                        }
+                    }
+                }
+            }
+        }, 1);
+
+        // merge the blocks and rank with the exact distances
+        parlay::parallel_for(0, batch_size, [&](size_t j) {
+            const size_t q = batch_begin + j;
+            TopN top_k(k);
+            for (auto& block_buffers : buffers) {
+                for (const auto& [_, id] : block_buffers[j].candidates) {
+                    top_k.Add(std::make_pair(DistanceToPoint(query_points.GetPoint(q), points, id), id));
+                }
+            }
+            result[q] = top_k.Take();
+        });
+        std::cout << "Exact neighbors of queries " << batch_begin << " - " << batch_begin + batch_size << " / " << queries.n << " took "
+                  << timer.Stop() << " s" << std::endl;
+    }
+    return result;
+}
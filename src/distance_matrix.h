@@ -0,0 +1,36 @@
+#pragma once
+
+#include "defs.h"
+
+// Many-to-many distances between a large set of points and a smaller set of centers (k-means centroids, leaders, aggregates).
+// Organized like a matrix multiplication: tiles of points are packed so they stay in L1, tiles of centers stay in L2, and the
+// distances are assembled from the inner products with precomputed norms, i.e., ||x||^2 - 2 x.c + ||c||^2 for L2 and 1 - x.c for MIPS.
+// The decomposed L2 distance can differ from distance() by rounding errors, so only use it where that doesn't matter.
+// The points can have any element type, the centers have to be Float32.
+
+// closest_center[i] = id of the center closest to points[i]
+void ClosestCenters(PointSet& points, PointSet& centers, std::vector<int>& closest_center);
+
+// Also the distance to the closest center, and to the second closest one if second_dist isn't null (max float if there is none)
+void ClosestCenters(PointSet& points, PointSet& centers, std::vector<int>& closest_center, std::vector<float>& closest_dist,
+                    std::vector<float>* second_dist = nullptr);
+
+// ClosestCenters by squared L2 distance, also when built with MIPS_DISTANCE. For quantizers, which minimize the reconstruction error
+void ClosestCentersL2(PointSet& points, PointSet& centers, std::vector<int>& closest_center);
+
+// The closest and second closest center of each of the points with the given ids. The results are indexed like ids
+void ClosestTwoCenters(PointSet& points, const std::vector<uint32_t>& ids, PointSet& centers, std::vector<int>& closest_center,
+                       std::vector<float>& closest_dist, std::vector<float>& second_dist);
+
+// out[i * centers.n + j] = distance of point i to center j, for all points. Only for a few centers, the matrix has n * centers.n entries
+void DistancesToCenters(PointSet& points, PointSet& centers, float* out);
+
+// The k closest centers for each of the points with the given ids, sorted by ascending distance
+std::vector<NNVec> ClosestCenters(PointSet& points, const std::vector<uint32_t>& ids, PointSet& centers, int k);
+
+// The exact k nearest neighbors of every query among all points, sorted by ascending distance. For ground truth.
+// Runs on the tiled engine above with the queries as centers, parallel over blocks of points. Each block keeps the candidates of a query
+// whose decomposed distance is within the rounding error bound of the k-th smallest one it has seen. The blocks' candidates are merged
+// and ranked with the exact distance() at the end, so the result is the same as scanning all points with distance().
+// The queries are processed in batches, so the memory for the candidates stays bounded.
+std::vector<NNVec> ExactNearestNeighbors(PointSet& points, PointSet& queries, int k);
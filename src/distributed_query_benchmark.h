@@ -41,46 +41,19 @@ public:
     }
 
     void LoadPartition(const std::string& partition_file) {
-        partition = ReadMetisPartition(partition_file);
+        partition = ReadPartition(partition_file);
         num_shards = NumPartsInPartition(partition);
     }
 
     void LoadShardPointSet(const std::string& point_set_file) {
-        size_t num_points_in_shard = 0;
-        for (const auto& part : partition) {
-            if (part == rank) {
-                num_points_in_shard++;
-            }
-        }
-
-        uint32_t n, d;
-        size_t offset = 0;
-
-        std::ifstream in(point_set_file, std::ios::binary);
-        in.read(reinterpret_cast<char*>(&n), sizeof(uint32_t));
-        offset += sizeof(uint32_t);
-        in.read(reinterpret_cast<char*>(&d), sizeof(uint32_t));
-        offset += sizeof(uint32_t);
-
-        shard_points.n = num_points_in_shard;
-        shard_points.d = d;
-        shard_points.coordinates.resize(shard_points.n * shard_points.d);
-        dim = d;
-
-        size_t coords_end = 0;
-        for (uint32_t point_id = 0; point_id < n; ++point_id) {
+        std::vector<uint32_t> ids;
+        for (uint32_t point_id = 0; point_id < partition.size(); ++point_id) {
             if (partition[point_id] == rank) {
-                size_t begin = offset + point_id * d * sizeof(float);
-                size_t range_length = 0;
-                for ( ; point_id < n && partition[point_id] == rank; ++point_id) {
-                    range_length += 1;
-                }
-
-                in.seekg(begin);
-                in.read(reinterpret_cast<char*>(&shard_points.coordinates[coords_end]), range_length * d * sizeof(float));
-                coords_end += range_length * d;
+                ids.push_back(point_id);
             }
         }
+        shard_points = ReadPointsSubset(point_set_file, ids);
+        dim = shard_points.d;
     }
 
     void BuildInShardIndex() {
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+
+// 16-bit floating point storage types (see ElementType). Only used for storage, the arithmetic is always done in float.
+// The conversions round to nearest even, like the hardware instructions (F16C / AVX-512-BF16) do.
+
+// IEEE 754 half precision (binary16): 5 exponent bits, 10 mantissa bits
+struct Float16 {
+    uint16_t bits = 0;
+};
+
+// bfloat16: the upper 16 bits of a float32. Same range as float, 7 mantissa bits
+struct BFloat16 {
+    uint16_t bits = 0;
+};
+
+inline float ToFloat(Float16 h) {
+    const uint32_t sign = uint32_t(h.bits & 0x8000) << 16;
+    uint32_t exponent = (h.bits >> 10) & 0x1f;
+    uint32_t mantissa = h.bits & 0x3ff;
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            return std::bit_cast<float>(sign);
+        }
+        // subnormal --> normalize
+        int e = -14;
+        while ((mantissa & 0x400) == 0) {
+            mantissa <<= 1;
+            e--;
+        }
+        mantissa &= 0x3ff;
+        return std::bit_cast<float>(sign | (uint32_t(e + 127) << 23) | (mantissa << 13));
+    }
+    if (exponent == 0x1f) {
+        return std::bit_cast<float>(sign | 0x7f800000 | (mantissa << 13));
+    }
+    return std::bit_cast<float>(sign | ((exponent - 15 + 127) << 23) | (mantissa << 13));
+}
+
+inline Float16 ToFloat16(float f) {
+    const uint32_t x = std::bit_cast<uint32_t>(f);
+    const uint32_t sign = (x >> 16) & 0x8000;
+    const uint32_t exponent = (x >> 23) & 0xff;
+    uint32_t mantissa = x & 0x7fffff;
+    if (exponent == 0xff) {
+        return Float16{ uint16_t(sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0)) };
+    }
+    const int e = int(exponent) - 127 + 15;
+    if (e >= 0x1f) {
+        return Float16{ uint16_t(sign | 0x7c00) };
+    }
+    if (e <= 0) {
+        if (e < -10) {
+            return Float16{ uint16_t(sign) };
+        }
+        // subnormal half
+        mantissa |= 0x800000;
+        const int shift = 14 - e;
+        uint32_t half_mantissa = mantissa >> shift;
+        const uint32_t remainder = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (half_mantissa & 1))) {
+            half_mantissa++;
+        }
+        return Float16{ uint16_t(sign | half_mantissa) };
+    }
+    uint32_t half = sign | (uint32_t(e) << 10) | (mantissa >> 13);
+    const uint32_t remainder = mantissa & 0x1fff;
+    if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) {
+        half++; // a carry into the exponent is correct, even if it rounds up to infinity
+    }
+    return Float16{ uint16_t(half) };
+}
+
+inline float ToFloat(BFloat16 b) { return std::bit_cast<float>(uint32_t(b.bits) << 16); }
+
+inline BFloat16 ToBFloat16(float f) {
+    const uint32_t x = std::bit_cast<uint32_t>(f);
+    if ((x & 0x7fffffff) > 0x7f800000) {
+        return BFloat16{ uint16_t((x >> 16) | 0x40) }; // keep NaNs quiet
+    }
+    return BFloat16{ uint16_t((x + 0x7fff + ((x >> 16) & 1)) >> 16) };
+}
@@ -49,7 +49,7 @@ struct HNSWRouter {
 
     void Serialize(const std::string& file) {
         hnsw->saveIndex(file);
-        WriteMetisPartition(partition, file + ".routing_index_partition");
+        WritePartition(partition, file + ".routing_index_partition");
     }
 
     struct ShardPriorities {
@@ -2,6 +2,7 @@
 
 #include "defs.h"
 #include "dist.h"
+#include "scalar_quantization.h"
 #include "topn.h"
 
 struct InvertedIndex {
@@ -9,6 +10,11 @@ struct InvertedIndex {
     std::vector<int> offsets;
     std::vector<uint32_t> permutation;
 
+    // Optional SQ8 copy of clustered_points, see BuildScalarQuantization()
+    ScalarQuantizer quantizer;
+    PointSet quantized_points;
+    std::vector<float> quantized_norms;
+
     InvertedIndex(PointSet& points, const Clusters& clusters) {
         size_t num_shards = clusters.size();
         offsets.assign(num_shards + 1, 0);
@@ -22,7 +28,9 @@ struct InvertedIndex {
 
         clustered_points.n = num_inserts;
         clustered_points.d = points.d;
-        clustered_points.coordinates.resize(num_inserts * points.d);
+        clustered_points.element_type = points.element_type;
+        clustered_points.Alloc();
+        const size_t point_bytes = points.d * ElementSize(points.element_type);
 
         parlay::parallel_for(
                 0, clusters.size(),
@@ -30,6 +38,11 @@ struct InvertedIndex {
                     parlay::parallel_for(0, clusters[b].size(), [&](size_t i_local) {
                         const uint32_t point_id = clusters[b][i_local];
                         permutation[offsets[b] + i_local] = point_id;
+                        if (points.IsCompact()) {
+                            const uint8_t* O = points.GetCompactPoint(point_id);
+                            std::copy(O, O + point_bytes, &clustered_points.compact_coordinates[(offsets[b] + i_local) * point_bytes]);
+                            return;
+                        }
                         float* P = clustered_points.GetPoint(offsets[b] + i_local);
                         float* O = points.GetPoint(point_id);
                         for (uint32_t j = 0; j < points.d; ++j) {
@@ -40,15 +53,18 @@ struct InvertedIndex {
                 1);
     }
 
+    // The points of a bucket are contiguous in clustered_points, so the whole bucket is scanned in one go.
+    // top_k carries over between buckets, so the later buckets can abandon most distance computations early
+    void ScanBucket(float* Q, int bucket, TopN& top_k) {
+        const int begin = offsets[bucket];
+        ScanPointsIntoTopN(Q, clustered_points, begin, offsets[bucket + 1] - begin, begin, top_k);
+    }
+
     NNVec Query(float* Q, int k, const std::vector<int>& buckets_to_probe, size_t num_buckets_to_probe) {
         TopN top_k(k);
         for (size_t j = 0; j < num_buckets_to_probe; ++j) {
             int b = buckets_to_probe[j];
-            for (int i = offsets[b]; i < offsets[b + 1]; ++i) {
-                float new_dist = distance(clustered_points.GetPoint(i), Q, clustered_points.d);
-                auto x = std::make_pair(new_dist, i);
-                top_k.Add(x);
-            }
+            ScanBucket(Q, b, top_k);
         }
 
         auto result = top_k.Take();
@@ -61,16 +77,54 @@ struct InvertedIndex {
 
     NNVec QueryBucket(float* Q, int k, int bucket) {
         TopN top_k(k);
+        ScanBucket(Q, bucket, top_k);
+        auto result = top_k.Take();
+        // remap the IDs
+        for (auto& x : result) {
+            x.second = permutation[x.second];
+        }
+        return result;
+    }
+
+    // Builds an 8-bit scalar quantized copy of clustered_points, which the *SQ queries scan instead of the full-precision points
+    void BuildScalarQuantization() {
+        quantizer.Train(clustered_points);
+        quantized_points = quantizer.Encode(clustered_points, quantized_norms);
+    }
+
+    void ScanBucketSQ(const ScalarQuantizer::Query& query, int bucket, TopN& candidates) {
         for (int i = offsets[bucket]; i < offsets[bucket + 1]; ++i) {
-            float new_dist = distance(clustered_points.GetPoint(i), Q, clustered_points.d);
-            auto x = std::make_pair(new_dist, i);
-            top_k.Add(x);
+            candidates.Add(std::make_pair(ScalarQuantizer::Distance(query, quantized_points, quantized_norms, i), uint32_t(i)));
+        }
+    }
+
+    // Re-ranks the candidates with the full-precision points and remaps the IDs
+    NNVec Rerank(float* Q, int k, TopN& candidates) {
+        TopN top_k(k);
+        for (const auto& [_, i] : candidates.Take()) {
+            top_k.Add(std::make_pair(DistanceToPoint(Q, clustered_points, i), i));
         }
         auto result = top_k.Take();
-        // remap the IDs
         for (auto& x : result) {
             x.second = permutation[x.second];
         }
         return result;
     }
+
+    // The top rerank_factor * k candidates of the SQ8 scan are re-ranked with exact distances
+    NNVec QuerySQ(float* Q, int k, const std::vector<int>& buckets_to_probe, size_t num_buckets_to_probe, int rerank_factor) {
+        const ScalarQuantizer::Query query = quantizer.PrepareQuery(Q);
+        TopN candidates(size_t(k) * rerank_factor);
+        for (size_t j = 0; j < num_buckets_to_probe; ++j) {
+            ScanBucketSQ(query, buckets_to_probe[j], candidates);
+        }
+        return Rerank(Q, k, candidates);
+    }
+
+    NNVec QueryBucketSQ(float* Q, int k, int bucket, int rerank_factor) {
+        const ScalarQuantizer::Query query = quantizer.PrepareQuery(Q);
+        TopN candidates(size_t(k) * rerank_factor);
+        ScanBucketSQ(query, bucket, candidates);
+        return Rerank(Q, k, candidates);
+    }
 };
@@ -1,5 +1,12 @@
 #pragma once
 
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+
 #include "defs.h"
 #include "topn.h"
 
@@ -7,6 +14,10 @@
 
 #include <parlay/parallel.h>
 
+// One HNSW per shard. The shard indices can be saved to one file each, tied to the cluster IDs by a text manifest:
+//   first line: num_shards dim
+//   then per shard: cluster_id num_points file
+// The files are relative to the directory of the manifest. With lazy loading, a shard is only read when a query first probes it.
 struct InvertedIndexHNSW {
     HNSWParameters hnsw_parameters;
 #ifdef MIPS_DISTANCE
@@ -14,20 +25,26 @@ struct InvertedIndexHNSW {
 #else
     hnswlib::L2Space space;
 #endif
+    size_t dim;
 
-    std::vector<hnswlib::HierarchicalNSW<float> *> bucket_hnsws;
+    // nullptr for the shards a lazy Load didn't read yet
+    mutable std::vector<std::unique_ptr<hnswlib::HierarchicalNSW<float>>> bucket_hnsws;
 
 
-    InvertedIndexHNSW(PointSet& points) : space(points.d) {
+    InvertedIndexHNSW(PointSet& points) : space(points.d), dim(points.d) {
 
     }
 
     void Build(PointSet& points, const Clusters& clusters) {
         size_t num_shards = clusters.size();
+        bucket_hnsws.clear();
         bucket_hnsws.resize(num_shards);
+        shard_files.clear();
+        shard_sizes.clear();
+        load_once.reset();
         size_t total_insertions = 0;
-        for (int b = 0; b < num_shards; ++b) {
-            bucket_hnsws[b] = new hnswlib::HierarchicalNSW<float>(
+        for (size_t b = 0; b < num_shards; ++b) {
+            bucket_hnsws[b] = std::make_unique<hnswlib::HierarchicalNSW<float>>(
                 &space, clusters[b].size(),
                 hnsw_parameters.M, hnsw_parameters.ef_construction,
                 /* random_seed = */ 555 + b);
@@ -46,17 +63,81 @@ struct InvertedIndexHNSW {
         });
     }
 
-    ~InvertedIndexHNSW() {
-        for (size_t i = 0; i < bucket_hnsws.size(); ++i) {
-            delete bucket_hnsws[i];
+    // Writes the index of shard b to manifest_file + ".shard<b>" and the manifest to manifest_file. All shards must be in memory
+    void Save(const std::string& manifest_file) const {
+        std::ofstream manifest(manifest_file);
+        if (!manifest) {
+            throw std::runtime_error("Can't open " + manifest_file + " for writing");
+        }
+        manifest << bucket_hnsws.size() << " " << dim << "\n";
+        for (size_t b = 0; b < bucket_hnsws.size(); ++b) {
+            if (bucket_hnsws[b] == nullptr) {
+                throw std::runtime_error("Can't save shard " + std::to_string(b) + " of the HNSW inverted index, it is not loaded");
+            }
+            const std::string shard_file = manifest_file + ".shard" + std::to_string(b);
+            bucket_hnsws[b]->saveIndex(shard_file);
+            manifest << b << " " << static_cast<size_t>(bucket_hnsws[b]->cur_element_count) << " " << std::filesystem::path(shard_file).filename().string() << "\n";
+        }
+        if (!manifest) {
+            throw std::runtime_error("Writing " + manifest_file + " failed");
+        }
+    }
+
+    // Reads the manifest written by Save. Without lazy, all shards are read right away.
+    // Throws if the manifest doesn't match the clusters (number of shards and points per shard), e.g., because the index was
+    // saved for another partition. The index is left unchanged then
+    void Load(const std::string& manifest_file, const Clusters& clusters, bool lazy) {
+        std::ifstream manifest(manifest_file);
+        size_t num_shards = 0, file_dim = 0;
+        if (!(manifest >> num_shards >> file_dim)) {
+            throw std::runtime_error("Can't read the manifest " + manifest_file);
+        }
+        if (file_dim != dim) {
+            throw std::runtime_error(manifest_file + " is for dimension " + std::to_string(file_dim) + " but the points have dimension " +
+                                     std::to_string(dim));
+        }
+        if (num_shards != clusters.size()) {
+            throw std::runtime_error(manifest_file + " has " + std::to_string(num_shards) + " shards but the partition has " +
+                                     std::to_string(clusters.size()));
+        }
+        const std::filesystem::path directory = std::filesystem::path(manifest_file).parent_path();
+        std::vector<std::string> files(num_shards, "");
+        for (size_t i = 0; i < num_shards; ++i) {
+            size_t b = 0, num_points = 0;
+            std::string file;
+            if (!(manifest >> b >> num_points >> file) || b >= num_shards) {
+                throw std::runtime_error("Broken entry " + std::to_string(i) + " in the manifest " + manifest_file);
+            }
+            if (num_points != clusters[b].size()) {
+                throw std::runtime_error(manifest_file + " has " + std::to_string(num_points) + " points in shard " + std::to_string(b) +
+                                         " but the partition has " + std::to_string(clusters[b].size()));
+            }
+            files[b] = (directory / file).string();
+            if (!lazy && !std::filesystem::exists(files[b])) {
+                throw std::runtime_error("The HNSW inverted index of shard " + std::to_string(b) + " is missing: " + files[b]);
+            }
+        }
+        shard_files = std::move(files);
+        shard_sizes.resize(num_shards);
+        for (size_t b = 0; b < num_shards; ++b) {
+            shard_sizes[b] = clusters[b].size();
+        }
+        bucket_hnsws.clear();
+        bucket_hnsws.resize(num_shards);
+        load_once = std::make_unique<std::once_flag[]>(num_shards);
+        num_loaded_shards = 0;
+        if (!lazy) {
+            parlay::parallel_for(0, num_shards, [&](size_t b) { Shard(b); }, 1);
         }
     }
 
+    size_t NumLoadedShards() const { return num_loaded_shards; }
+
     NNVec Query(float* Q, int num_neighbors, const std::vector<int>& buckets_to_probe, int num_probes) const {
         TopN top_k(num_neighbors);
         for (int i = 0; i < num_probes; ++i) {
             const int bucket = buckets_to_probe[i];
-            auto result = bucket_hnsws[bucket]->searchKnn(Q, num_neighbors);
+            auto result = Shard(bucket).searchKnn(Q, num_neighbors);
             while (!result.empty()) {
                 const auto [dist, label] = result.top();
                 result.pop();
@@ -67,7 +148,7 @@ struct InvertedIndexHNSW {
     }
 
     NNVec QueryBucket(float* Q, int num_neighbors, int bucket) {
-        auto result_pq = bucket_hnsws[bucket]->searchKnn(Q, num_neighbors);
+        auto result_pq = Shard(bucket).searchKnn(Q, num_neighbors);
         NNVec result;
         while (!result_pq.empty()) {
             result.emplace_back(result_pq.top());
@@ -75,4 +156,32 @@ struct InvertedIndexHNSW {
         }
         return result;
     }
+
+private:
+    // The index of shard b, read from its file on the first call if it was loaded lazily
+    hnswlib::HierarchicalNSW<float>& Shard(size_t b) const {
+        if (load_once != nullptr) {
+            std::call_once(load_once[b], [&] {
+                if (!std::filesystem::exists(shard_files[b])) {
+                    throw std::runtime_error("The HNSW inverted index of shard " + std::to_string(b) + " is missing: " + shard_files[b]);
+                }
+                // hnswlib wants a mutable space, but only reads it
+                auto* shard_space = const_cast<std::remove_const_t<decltype(space)>*>(&space);
+                auto shard = std::make_unique<hnswlib::HierarchicalNSW<float>>(shard_space, shard_files[b]);
+                if (shard->cur_element_count != shard_sizes[b]) {
+                    throw std::runtime_error(shard_files[b] + " has " + std::to_string(static_cast<size_t>(shard->cur_element_count)) +
+                                             " points but its shard has " + std::to_string(shard_sizes[b]));
+                }
+                bucket_hnsws[b] = std::move(shard);
+                bucket_hnsws[b]->setEf(hnsw_parameters.ef_search);
+                num_loaded_shards++;
+            });
+        }
+        return *bucket_hnsws[b];
+    }
+
+    std::vector<std::string> shard_files;
+    std::vector<size_t> shard_sizes;               // from the clusters passed to Load
+    std::unique_ptr<std::once_flag[]> load_once;    // nullptr after Build
+    mutable std::atomic<size_t> num_loaded_shards = 0;
 };
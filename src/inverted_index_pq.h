@@ -0,0 +1,185 @@
+#pragma once
+
+#include <algorithm>
+#include <parlay/parallel.h>
+
+#include "defs.h"
+#include "dist.h"
+#include "distance_matrix.h"
+#include "kmeans.h"
+#include "topn.h"
+
+struct PQParameters {
+    size_t num_subspaces = 16;              // bytes per encoded point
+    size_t num_centroids = 256;             // per subspace, at most 256 so that a code fits in one byte
+    size_t num_training_points = 50000;
+    size_t num_rerank = 0;                  // if > 0, the top num_rerank candidates of the code scan are re-ranked with exact distances
+};
+
+// Inverted index over product-quantized points. The d dimensions are split into num_subspaces contiguous subspaces,
+// each with its own codebook trained by Euclidean k-means on a sample, also for MIPS: the codebook entries are means and
+// the points are encoded by their nearest entry in L2, so the codes minimize the reconstruction error. Only the lookup
+// table uses the inner product. A point is stored as one byte per subspace (the id of its
+// closest codebook entry), so a bucket takes num_subspaces bytes per point instead of 4 * d.
+// Queries compute one lookup table with the distance from each query sub-vector to each codebook entry, after which
+// the distance to an encoded point is a sum of num_subspaces table entries (asymmetric distance computation).
+// The points are encoded directly, not as residuals to their bucket, so the same table works for every bucket.
+struct InvertedIndexPQ {
+    PQParameters parameters;
+    size_t d = 0;
+    std::vector<size_t> subspace_offsets;    // subspace m covers the dimensions [subspace_offsets[m], subspace_offsets[m+1])
+    std::vector<PointSet> codebooks;
+    std::vector<uint8_t> codes;              // codes[i * num_subspaces + m] for the i-th point in cluster order
+    std::vector<int> offsets;
+    std::vector<uint32_t> permutation;
+    PointSet* rerank_points = nullptr;       // the original points for the re-ranking. Have to outlive the index
+
+    InvertedIndexPQ(PointSet& points, const Clusters& clusters, PQParameters parameters) : parameters(parameters), d(points.d) {
+        if (parameters.num_subspaces == 0 || parameters.num_subspaces > points.d) {
+            throw std::runtime_error("PQ needs between 1 and d subspaces. Have " + std::to_string(parameters.num_subspaces) + " d = " + std::to_string(points.d));
+        }
+        if (parameters.num_centroids == 0 || parameters.num_centroids > 256) {
+            throw std::runtime_error("PQ codebooks can have at most 256 entries");
+        }
+        rerank_points = &points;
+
+        size_t num_shards = clusters.size();
+        offsets.assign(num_shards + 1, 0);
+        for (size_t b = 0; b < clusters.size(); b++) {
+            offsets[b + 1] = clusters[b].size();
+        }
+        for (size_t i = 2; i < num_shards + 1; ++i)
+            offsets[i] += offsets[i - 1];
+        size_t num_inserts = offsets.back();
+        permutation.resize(num_inserts);
+        for (size_t b = 0; b < clusters.size(); ++b) {
+            std::copy(clusters[b].begin(), clusters[b].end(), permutation.begin() + offsets[b]);
+        }
+
+        const size_t M = parameters.num_subspaces;
+        subspace_offsets.assign(M + 1, 0);
+        for (size_t m = 0; m < M; ++m) {
+            subspace_offsets[m + 1] = subspace_offsets[m] + d / M + (m < d % M ? 1 : 0);
+        }
+
+        TrainCodebooks(points);
+        Encode(points);
+    }
+
+    size_t SubspaceDim(size_t m) const { return subspace_offsets[m + 1] - subspace_offsets[m]; }
+
+    // Copies the dimensions of subspace m of the given points (in float)
+    PointSet ExtractSubspace(PointSet& points, size_t m, size_t begin, size_t count, const std::vector<uint32_t>* ids) const {
+        PointSet sub;
+        sub.n = count;
+        sub.d = SubspaceDim(m);
+        sub.Alloc();
+        parlay::parallel_for(0, count, [&](size_t i) {
+            std::vector<float> buffer;
+            const float* p = points.GetPointAsFloat(ids != nullptr ? (*ids)[begin + i] : begin + i, buffer);
+            std::copy(p + subspace_offsets[m], p + subspace_offsets[m + 1], sub.GetPoint(i));
+        });
+        return sub;
+    }
+
+    void TrainCodebooks(PointSet& points) {
+        const size_t M = parameters.num_subspaces;
+        PointSet sample = RandomSample(points, std::min(parameters.num_training_points, points.n), 555);
+        codebooks.resize(M);
+        for (size_t m = 0; m < M; ++m) {
+            PointSet sub = ExtractSubspace(sample, m, 0, sample.n, nullptr);
+#ifdef MIPS_DISTANCE
+            // k-means|| would seed with inner product distances
+            codebooks[m] = RandomSample(sub, std::min(parameters.num_centroids, sub.n), 555 + m);
+#else
+            codebooks[m] = InitialCentroids(sub, std::min(parameters.num_centroids, sub.n), 555 + m);
+#endif
+            EuclideanKMeans(sub, codebooks[m]);
+        }
+    }
+
+    void Encode(PointSet& points) {
+        const size_t M = parameters.num_subspaces;
+        codes.assign(permutation.size() * M, 0);
+        // bound the memory for the extracted subspace
+        constexpr size_t CHUNK_SIZE = 1 << 20;
+        std::vector<int> closest;
+        for (size_t begin = 0; begin < permutation.size(); begin += CHUNK_SIZE) {
+            const size_t count = std::min(CHUNK_SIZE, permutation.size() - begin);
+            closest.resize(count);
+            for (size_t m = 0; m < M; ++m) {
+                PointSet sub = ExtractSubspace(points, m, begin, count, &permutation);
+                ClosestCentersL2(sub, codebooks[m], closest);
+                parlay::parallel_for(0, count, [&](size_t i) { codes[(begin + i) * M + m] = static_cast<uint8_t>(closest[i]); });
+            }
+        }
+    }
+
+    // lut[m * 256 + c] = distance contribution of codebook entry c in subspace m
+    std::vector<float> LookupTable(const float* Q) const {
+        const size_t M = parameters.num_subspaces;
+        std::vector<float> lut(M * 256, 0.f);
+        for (size_t m = 0; m < M; ++m) {
+            const float* Q_m = Q + subspace_offsets[m];
+            const PointSet& codebook = codebooks[m];
+#ifdef MIPS_DISTANCE
+            InnerProductsToBlock(Q_m, codebook.coordinates.data(), codebook.n, codebook.d, &lut[m * 256]);
+#else
+            SqrL2DistancesToBlock(Q_m, codebook.coordinates.data(), codebook.n, codebook.d, &lut[m * 256]);
+#endif
+        }
+        return lut;
+    }
+
+    void ScanBucket(const std::vector<float>& lut, int bucket, TopN& top_k) const {
+        const size_t M = parameters.num_subspaces;
+        for (int i = offsets[bucket]; i < offsets[bucket + 1]; ++i) {
+            const uint8_t* code = &codes[size_t(i) * M];
+            float sum = 0.f;
+            for (size_t m = 0; m < M; ++m) {
+                sum += lut[m * 256 + code[m]];
+            }
+#ifdef MIPS_DISTANCE
+            top_k.Add(std::make_pair(1.0f - sum, uint32_t(i)));
+#else
+            top_k.Add(std::make_pair(sum, uint32_t(i)));
+#endif
+        }
+    }
+
+    // Remaps the candidate IDs and optionally re-ranks them with exact distances
+    NNVec Finish(float* Q, int k, TopN& candidates) const {
+        auto result = candidates.Take();
+        for (auto& x : result) {
+            x.second = permutation[x.second];
+        }
+        if (parameters.num_rerank > 0 && rerank_points != nullptr) {
+            TopN top_k(k);
+            for (const auto& x : result) {
+                top_k.Add(std::make_pair(DistanceToPoint(Q, *rerank_points, x.second), x.second));
+            }
+            result = top_k.Take();
+        }
+        return result;
+    }
+
+    size_t NumCandidates(int k) const { return std::max<size_t>(k, parameters.num_rerank); }
+
+    NNVec Query(float* Q, int k, const std::vector<int>& buckets_to_probe, size_t num_buckets_to_probe) const {
+        const std::vector<float> lut = LookupTable(Q);
+        TopN candidates(NumCandidates(k));
+        for (size_t j = 0; j < num_buckets_to_probe; ++j) {
+            ScanBucket(lut, buckets_to_probe[j], candidates);
+        }
+        return Finish(Q, k, candidates);
+    }
+
+    NNVec QueryBucket(float* Q, int k, int bucket) const {
+        const std::vector<float> lut = LookupTable(Q);
+        TopN candidates(NumCandidates(k));
+        ScanBucket(lut, bucket, candidates);
+        return Finish(Q, k, candidates);
+    }
+
+    size_t MemoryUsage() const { return codes.size() + permutation.size() * sizeof(uint32_t); }
+};
@@ -1,5 +1,8 @@
 #include "kmeans.h"
 
+#include <atomic>
+#include <fstream>
+#include <mutex>
 #include <numeric>
 #include <parlay/parallel.h>
 #include <parlay/primitives.h>
@@ -7,23 +10,11 @@
 #include <random>
 #include "defs.h"
 #include "dist.h"
+#include "distance_matrix.h"
 
 namespace {
-    int Top1Neighbor(PointSet& P, float* Q) {
-        int best = -1;
-        float best_dist = std::numeric_limits<float>::max();
-        for (size_t i = 0; i < P.n; ++i) {
-            float new_dist = distance(P.GetPoint(i), Q, P.d);
-            if (new_dist < best_dist) {
-                best_dist = new_dist;
-                best = i;
-            }
-        }
-        return best;
-    }
-
     void NearestCenters(PointSet& P, PointSet& centroids, std::vector<int>& closest_center) {
-        parlay::parallel_for(0, P.n, [&](size_t i) { closest_center[i] = Top1Neighbor(centroids, P.GetPoint(i)); });
+        ClosestCenters(P, centroids, closest_center);
     }
 
     void RemoveEmptyClusters(PointSet& centroids, std::vector<int>& closest_center, const std::vector<size_t>& cluster_size) {
@@ -86,11 +77,12 @@ namespace {
 
     void SumPointsInClustersIP(PointSet& P, PointSet& centroids, std::vector<int>& closest_center, std::vector<size_t>& cluster_size,
                                const parlay::sequence<float>& vector_sqrt_norms, std::vector<float>& norm_sums, size_t start, size_t end) {
+        std::vector<float> buffer;
         for (size_t i = start; i < end; ++i) {
             int c = closest_center[i];
             cluster_size[c]++;
             float* C = centroids.GetPoint(c);
-            float* Pi = P.GetPoint(i);
+            const float* Pi = P.GetPointAsFloat(i, buffer);
             norm_sums[c] += vector_sqrt_norms[i] * vector_sqrt_norms[i];
             float multiplier = 1.0f / vector_sqrt_norms[i];
             for (size_t j = 0; j < P.d; ++j) {
@@ -99,7 +91,7 @@ namespace {
         }
     }
 
-#else
+#endif
 
     void NormalizeCentroidsL2(PointSet& centroids, const std::vector<size_t>& cluster_size) {
         for (size_t c = 0; c < centroids.n; ++c) {
@@ -115,18 +107,18 @@ namespace {
 
     void SumPointsInClustersL2(PointSet& P, PointSet& centroids, std::vector<int>& closest_center, std::vector<size_t>& cluster_size, size_t start,
                                size_t end) {
+        std::vector<float> buffer;
         for (size_t i = start; i < end; ++i) {
             int c = closest_center[i];
             cluster_size[c]++;
             float* C = centroids.GetPoint(c);
-            float* Pi = P.GetPoint(i);
+            const float* Pi = P.GetPointAsFloat(i, buffer);
             for (size_t j = 0; j < P.d; ++j) {
                 C[j] += Pi[j];
             }
         }
     }
 
-#endif
 
     std::vector<size_t> AggregateClusters(PointSet& P, PointSet& centroids, std::vector<int>& closest_center, const parlay::sequence<float>& vector_sqrt_norms,
                                           bool normalize = true) {
@@ -148,20 +140,10 @@ namespace {
         return cluster_size;
     }
 
-    std::vector<size_t> AggregateClustersParallel(PointSet& P, PointSet& centroids, std::vector<int>& closest_center,
-                                                  const parlay::sequence<float>& vector_sqrt_norms, bool normalize = true) {
-        size_t block_size = std::max<size_t>(5000000, centroids.coordinates.size() * 200);
-        if (P.n <= block_size)
-            return AggregateClusters(P, centroids, closest_center, vector_sqrt_norms, normalize);
-
-        centroids.coordinates.assign(centroids.coordinates.size(), 0.f);
-        std::vector<size_t> cluster_size(centroids.n, 0);
-
-#ifdef MIPS_DISTANCE
-        std::vector<float> norm_sums(centroids.n, 0.f);
-#endif
-
-        // This is what a distributed implementation would do... Not great but at least it can get some speedups
+    // Adds the points of P to the clusters given by closest_center, in parallel blocks of block_size points.
+    // This is what a distributed implementation would do... Not great but at least it can get some speedups
+    void SumPointsInClustersParallel(PointSet& P, PointSet& centroids, std::vector<int>& closest_center, std::vector<size_t>& cluster_size,
+                                     const parlay::sequence<float>& vector_sqrt_norms, std::vector<float>& norm_sums, size_t block_size) {
         parlay::internal::sliced_for(P.n, block_size, [&](size_t block_id, size_t start, size_t end) {
             PointSet b_centroids;
             b_centroids.n = centroids.n;
@@ -190,72 +172,684 @@ namespace {
                 }
             }
         });
+    }
 
-        if (normalize) {
+    void NormalizeCentroids(PointSet& centroids, const std::vector<size_t>& cluster_size, const std::vector<float>& norm_sums) {
 #ifdef MIPS_DISTANCE
-            NormalizeCentroidsIP(centroids, cluster_size, norm_sums);
+        NormalizeCentroidsIP(centroids, cluster_size, norm_sums);
 #else
-            NormalizeCentroidsL2(centroids, cluster_size);
+        NormalizeCentroidsL2(centroids, cluster_size);
 #endif
+    }
+
+    std::vector<size_t> AggregateClustersParallel(PointSet& P, PointSet& centroids, std::vector<int>& closest_center,
+                                                  const parlay::sequence<float>& vector_sqrt_norms, bool normalize = true) {
+        size_t block_size = std::max<size_t>(5000000, centroids.coordinates.size() * 200);
+        if (P.n <= block_size)
+            return AggregateClusters(P, centroids, closest_center, vector_sqrt_norms, normalize);
+
+        centroids.coordinates.assign(centroids.coordinates.size(), 0.f);
+        std::vector<size_t> cluster_size(centroids.n, 0);
+        std::vector<float> norm_sums(centroids.n, 0.f);
+        SumPointsInClustersParallel(P, centroids, closest_center, cluster_size, vector_sqrt_norms, norm_sums, block_size);
+
+        if (normalize) {
+            NormalizeCentroids(centroids, cluster_size, norm_sums);
         }
 
         RemoveEmptyClusters(centroids, closest_center, cluster_size);
         return cluster_size;
     }
+
+    std::vector<int> SampleIDs(size_t n, size_t num_samples, int seed) {
+        std::vector<int> iota(n);
+        std::iota(iota.begin(), iota.end(), 0);
+
+        std::mt19937 prng(seed);
+        std::vector<int> sample(num_samples);
+        std::sample(iota.begin(), iota.end(), sample.begin(), num_samples, prng);
+        return sample;
+    }
+
+    // Mean squared move of the centroids relative to the mean squared distance of the centroids to their mean, so that it doesn't
+    // depend on the scale or the offset of the data
+    double RelativeCentroidShift(PointSet& old_centroids, PointSet& centroids) {
+        if (old_centroids.n != centroids.n) {
+            return std::numeric_limits<double>::infinity();
+        }
+        std::vector<double> mean(centroids.d, 0.0);
+        for (size_t c = 0; c < centroids.n; ++c) {
+            for (size_t j = 0; j < centroids.d; ++j) mean[j] += centroids.GetPoint(c)[j];
+        }
+        for (double& x : mean) x /= centroids.n;
+        double shift = 0.0, spread = 0.0;
+        for (size_t c = 0; c < centroids.n; ++c) {
+            shift += sqr_l2_dist(old_centroids.GetPoint(c), centroids.GetPoint(c), centroids.d);
+            for (size_t j = 0; j < centroids.d; ++j) {
+                const double diff = centroids.GetPoint(c)[j] - mean[j];
+                spread += diff * diff;
+            }
+        }
+        if (spread == 0.0) {
+            return shift == 0.0 ? 0.0 : std::numeric_limits<double>::infinity();
+        }
+        return shift / spread;
+    }
+
+    // Completes the stats of a round, reports them and decides whether KMeans has converged.
+    // objective() is only called if the config needs it
+    class RoundTracker {
+    public:
+        RoundTracker(const KMeansConfig& config, size_t n) : config(config), n(n) { }
+
+        template<typename Objective>
+        bool Converged(size_t round, double seconds, size_t num_reassigned, PointSet& old_centroids, PointSet& centroids, Objective&& objective) {
+            KMeansRoundStats stats;
+            stats.n = n;
+            stats.k = centroids.n;
+            stats.round = round;
+            stats.seconds = seconds;
+            stats.num_reassigned = num_reassigned;
+            stats.centroid_shift = RelativeCentroidShift(old_centroids, centroids);
+            if (config.objective_improvement > 0.0 || config.on_round) {
+                stats.objective = objective();
+            }
+            if (config.on_round) {
+                config.on_round(stats);
+            }
+
+            // the first round moves every point out of the unassigned state
+            bool converged = config.reassigned_fraction > 0.0 && round > 0 && num_reassigned <= config.reassigned_fraction * n;
+            converged |= config.centroid_shift > 0.0 && stats.centroid_shift <= config.centroid_shift;
+            if (config.objective_improvement > 0.0 && previous_objective >= 0.0 && stats.objective >= 0.0) {
+                converged |= previous_objective - stats.objective <= config.objective_improvement * previous_objective;
+            }
+            previous_objective = stats.objective;
+            return converged;
+        }
+
+    private:
+        const KMeansConfig& config;
+        size_t n;
+        double previous_objective = -1.0;
+    };
+
+    // NearestCenters that returns how many points changed their cluster
+    size_t ReassignToNearestCenters(PointSet& P, PointSet& centroids, std::vector<int>& closest_center) {
+        std::vector<int> previous = closest_center;
+        NearestCenters(P, centroids, closest_center);
+        return parlay::count_if(parlay::iota<size_t>(P.n), [&](size_t i) { return previous[i] != closest_center[i]; });
+    }
+
+    // Random ids for a mini-batch, drawn with replacement, so that it costs O(batch_size) and not O(n). Sorted, so that reads from a
+    // stream coalesce
+    std::vector<uint32_t> SampleBatchIDs(size_t n, size_t batch_size, std::mt19937& prng) {
+        std::uniform_int_distribution<uint32_t> dist(0, n - 1);
+        std::vector<uint32_t> ids(batch_size);
+        for (uint32_t& id : ids) id = dist(prng);
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    }
+
+    // Every centroid is kept at the mean of all points it absorbed so far. This is the per-centroid learning rate 1 / #absorbed points of
+    // Sculley's mini-batch k-means, applied to a whole batch at once. read_batch(ids) returns the points with the given ids
+    template<typename ReadBatch>
+    void MiniBatchRounds(size_t n, PointSet& centroids, size_t batch_size, int seed, const KMeansConfig& config, ReadBatch&& read_batch) {
+        PointSet sums;
+        sums.n = centroids.n;
+        sums.d = centroids.d;
+        sums.Alloc();
+        std::vector<size_t> num_absorbed(centroids.n, 0);
+        std::vector<float> norm_sums(centroids.n, 0.f);
+        std::mt19937 prng(seed);
+        for (size_t it = 0; it < config.max_rounds; ++it) {
+            Timer timer;
+            timer.Start();
+            PointSet batch = read_batch(SampleBatchIDs(n, batch_size, prng));
+            std::vector<int> closest_center(batch.n, -1);
+            std::vector<float> closest_dist;
+            ClosestCenters(batch, centroids, closest_center, closest_dist);
+            parlay::sequence<float> vector_sqrt_norms;
+#ifdef MIPS_DISTANCE
+            batch.ComputeNorms();
+            vector_sqrt_norms = parlay::tabulate(batch.n, [&](size_t i) -> float { return std::sqrt(batch.norms[i]); });
+#endif
+            size_t block_size = std::max<size_t>(idiv_ceil(batch.n, parlay::num_workers()), 1024);
+            SumPointsInClustersParallel(batch, sums, closest_center, num_absorbed, vector_sqrt_norms, norm_sums, block_size);
+            PointSet means = sums;
+            NormalizeCentroids(means, num_absorbed, norm_sums);
+            PointSet old_centroids;
+            if (config.on_round) {
+                old_centroids = centroids;
+            }
+            // centroids that didn't absorb any point yet stay where they are
+            parlay::parallel_for(0, centroids.n, [&](size_t c) {
+                if (num_absorbed[c] > 0) std::copy(means.GetPoint(c), means.GetPoint(c) + centroids.d, centroids.GetPoint(c));
+            });
+            if (config.on_round) {
+                KMeansRoundStats stats;
+                stats.n = batch.n;
+                stats.k = centroids.n;
+                stats.round = it;
+                stats.seconds = timer.Stop();
+                stats.centroid_shift = RelativeCentroidShift(old_centroids, centroids);
+                // like ObjectiveValue, i.e., shifted to be positive for MIPS
+                stats.objective = parlay::reduce(parlay::delayed_map(closest_dist, [](float x) -> double {
+#ifdef MIPS_DISTANCE
+                    return x + 1.0;
+#endif
+                    return x;
+                }));
+                config.on_round(stats);
+            }
+        }
+    }
+
+    void RemoveEmptyClusters(PointSet& centroids, std::vector<int>& closest_center) {
+        auto histogram = parlay::histogram_by_index(closest_center, centroids.n);
+        RemoveEmptyClusters(centroids, closest_center, std::vector<size_t>(histogram.begin(), histogram.end()));
+    }
+
+#ifndef MIPS_DISTANCE
+    // Lloyd's rounds that skip most of the distance computations with the triangle inequality. Each point keeps an upper bound on the
+    // distance to its centroid and lower bounds on the distances to the others, which get loosened by how far the centroids move.
+    // Hamerly keeps a single lower bound for the second closest centroid, Elkan one per centroid. Elkan prunes far better with many
+    // centroids, but needs n * k bounds, so it is only used when they fit. The MIPS distance is no metric, so this is for L2 only.
+    // The full assignment passes (the first one and after empty clusters were removed) and the points whose bounds fail in Hamerly
+    // go through the tiled distance engine. With more than ELKAN_MAX_CENTROIDS centroids, Hamerly's single bound prunes little, so
+    // then every round is a plain pass of the tiled engine.
+    constexpr size_t ELKAN_MIN_CENTROIDS = 32;
+    constexpr size_t ELKAN_MAX_CENTROIDS = 1024;    // k * k distances between the centroids
+    constexpr size_t ELKAN_MAX_BOUNDS = (512UL << 20) / sizeof(float);     // 512 MB of lower bounds, above that Hamerly is used
+    constexpr size_t BOUNDS_BLOCK_SIZE = 1024;
+
+    bool UseElkan(size_t n, size_t k) { return k >= ELKAN_MIN_CENTROIDS && k <= ELKAN_MAX_CENTROIDS && n * k <= ELKAN_MAX_BOUNDS; }
+
+    // The bounds need the actual distance, not the squared one
+    float EuclideanDistance(const float* c, const float* p, size_t d) { return std::sqrt(std::max(0.f, distance(c, p, d))); }
+
+    float SqrtDistance(float squared) { return squared == std::numeric_limits<float>::max() ? squared : std::sqrt(squared); }
+
+    class BoundedAssignment {
+    public:
+        BoundedAssignment(PointSet& P, PointSet& centroids, std::vector<int>& closest_center) : P(P), centroids(centroids), closest_center(closest_center) { }
+
+        // Assigns all points to their closest centroid, with the bounds loosened by how far the centroids moved since the last call.
+        // Returns the number of points that changed their cluster
+        size_t Assign() {
+            if (centroids.n > ELKAN_MAX_CENTROIDS) {
+                k = 0;
+                return ReassignToNearestCenters(P, centroids, closest_center);
+            }
+            size_t num_reassigned;
+            if (k != centroids.n) {
+                num_reassigned = Init();
+            } else if (elkan) {
+                num_reassigned = AssignElkan();
+            } else {
+                num_reassigned = AssignHamerly();
+            }
+            old_centroids = centroids;
+            return num_reassigned;
+        }
+
+    private:
+        // Computes all distances and sets up the bounds. Also when the number of centroids changed, since the bounds refer to centroid ids
+        size_t Init() {
+            k = centroids.n;
+            elkan = UseElkan(P.n, k);
+            const std::vector<int> previous = closest_center;
+            if (elkan) {
+                lower.assign(P.n * k, 0.f);
+                upper.resize(P.n);
+                DistancesToCenters(P, centroids, lower.data());
+                parlay::parallel_for(0, P.n, [&](size_t i) {
+                    float* l = &lower[i * k];
+                    for (size_t j = 0; j < k; ++j) l[j] = std::sqrt(l[j]);
+                    closest_center[i] = std::min_element(l, l + k) - l;
+                    upper[i] = l[closest_center[i]];
+                });
+            } else {
+                ClosestCenters(P, centroids, closest_center, upper, &lower);
+                parlay::parallel_for(0, P.n, [&](size_t i) {
+                    upper[i] = SqrtDistance(upper[i]);
+                    lower[i] = SqrtDistance(lower[i]);
+                });
+            }
+            return parlay::count_if(parlay::iota<size_t>(P.n), [&](size_t i) { return previous[i] != closest_center[i]; });
+        }
+
+        size_t AssignHamerly() {
+            ComputeCentroidGeometry();
+            // a point's lower bound shrinks by the largest movement among the other centroids
+            const int max_drift_id = std::max_element(drift.begin(), drift.end()) - drift.begin();
+            float second_max_drift = 0.f;
+            for (size_t j = 0; j < k; ++j) {
+                if (int(j) != max_drift_id) second_max_drift = std::max(second_max_drift, drift[j]);
+            }
+            std::vector<uint8_t> unsure(P.n, 0);
+            ForEachBlock([&](size_t i, std::vector<float>& buffer) {
+                const int a = closest_center[i];
+                upper[i] += drift[a];
+                lower[i] -= a == max_drift_id ? second_max_drift : drift[max_drift_id];
+                const float bound = std::max(lower[i], half_min_gap[a]);
+                if (upper[i] <= bound) {
+                    return false;
+                }
+                upper[i] = EuclideanDistance(centroids.GetPoint(a), P.GetPointAsFloat(i, buffer), P.d);
+                unsure[i] = upper[i] > bound;
+                return false;
+            });
+
+            // the points whose bounds failed get their two closest centroids from the tiled engine
+            auto unsure_ids = parlay::filter(parlay::iota<uint32_t>(P.n), [&](uint32_t i) { return unsure[i] != 0; });
+            const std::vector<uint32_t> ids(unsure_ids.begin(), unsure_ids.end());
+            std::vector<int> best;
+            std::vector<float> best_dist, second_dist;
+            ClosestTwoCenters(P, ids, centroids, best, best_dist, second_dist);
+            return parlay::count_if(parlay::iota<size_t>(ids.size()), [&](size_t x) {
+                const uint32_t i = ids[x];
+                const bool reassigned = closest_center[i] != best[x];
+                closest_center[i] = best[x];
+                upper[i] = SqrtDistance(best_dist[x]);
+                lower[i] = SqrtDistance(second_dist[x]);
+                return reassigned;
+            });
+        }
+
+        size_t AssignElkan() {
+            ComputeCentroidGeometry();
+            return ForEachBlock([&](size_t i, std::vector<float>& buffer) {
+                float* l = &lower[i * k];
+                for (size_t j = 0; j < k; ++j) {
+                    l[j] = std::max(0.f, l[j] - drift[j]);
+                }
+                int a = closest_center[i];
+                float u = upper[i] + drift[a];
+                if (u <= half_min_gap[a]) {
+                    upper[i] = u;
+                    return false;
+                }
+                const int old_a = a;
+                const float* p = nullptr;
+                bool tight = false;
+                for (size_t j = 0; j < k; ++j) {
+                    if (int(j) == a || u <= l[j] || u <= half_gaps[a * k + j]) continue;
+                    if (!tight) {
+                        p = P.GetPointAsFloat(i, buffer);
+                        u = l[a] = EuclideanDistance(centroids.GetPoint(a), p, P.d);
+                        tight = true;
+                        if (u <= l[j] || u <= half_gaps[a * k + j]) continue;
+                    }
+                    l[j] = EuclideanDistance(centroids.GetPoint(j), p, P.d);
+                    if (l[j] < u) {
+                        a = j;
+                        u = l[j];
+                    }
+                }
+                closest_center[i] = a;
+                upper[i] = u;
+                return a != old_a;
+            });
+        }
+
+        // How far each centroid moved since the last assignment, and the distances between the centroids
+        void ComputeCentroidGeometry() {
+            drift.resize(k);
+            half_min_gap.resize(k);
+            half_gaps.resize(elkan ? k * k : 0);
+            parlay::parallel_for(0, k, [&](size_t j) {
+                drift[j] = EuclideanDistance(old_centroids.GetPoint(j), centroids.GetPoint(j), centroids.d);
+                std::vector<float> gaps(k);
+                DistancesToBlock(centroids.GetPoint(j), centroids.coordinates.data(), k, centroids.d, gaps.data());
+                for (float& gap : gaps) gap = std::sqrt(std::max(0.f, gap));
+                gaps[j] = std::numeric_limits<float>::max();
+                for (float& gap : gaps) gap /= 2;
+                half_min_gap[j] = *std::min_element(gaps.begin(), gaps.end());
+                if (elkan) {
+                    std::copy(gaps.begin(), gaps.end(), half_gaps.begin() + j * k);
+                }
+            }, 1);
+        }
+
+        // f(i, buffer) for all points, in parallel blocks that share the buffer. Returns for how many points f returned true
+        template<typename F>
+        size_t ForEachBlock(F&& f) {
+            std::atomic<size_t> count = 0;
+            parlay::parallel_for(0, idiv_ceil(P.n, BOUNDS_BLOCK_SIZE), [&](size_t block) {
+                std::vector<float> buffer;
+                size_t block_count = 0;
+                for (size_t i = block * BOUNDS_BLOCK_SIZE; i < std::min(P.n, (block + 1) * BOUNDS_BLOCK_SIZE); ++i) {
+                    block_count += f(i, buffer);
+                }
+                count.fetch_add(block_count, std::memory_order_relaxed);
+            }, 1);
+            return count;
+        }
+
+        PointSet& P;
+        PointSet& centroids;
+        std::vector<int>& closest_center;
+        PointSet old_centroids;
+        size_t k = 0;       // the number of centroids the bounds refer to. 0 before the first assignment
+        bool elkan = false;
+        std::vector<float> upper, lower;
+        std::vector<float> drift, half_min_gap, half_gaps;
+    };
+#endif
+
+    // The points with the given ids as a Float32 set without cached norms, so it can be used as centroids
+    template<typename IDs>
+    PointSet GatherAsFloat(PointSet& points, const IDs& ids) {
+        PointSet centroids;
+        centroids.n = ids.size();
+        centroids.d = points.d;
+        centroids.coordinates.reserve(centroids.n * centroids.d);
+        std::vector<float> buffer;
+        for (const auto i : ids) {
+            const float* p = points.GetPointAsFloat(i, buffer);
+            centroids.coordinates.insert(centroids.coordinates.end(), p, p + points.d);
+        }
+        return centroids;
+    }
+
+    // The sampling of k-means++ / k-means|| needs non-negative distances. For MIPS that is 1 - <x, c>, like pos_distance
+    float SeedingDistance(float dist) {
+#ifdef MIPS_DISTANCE
+        dist += 1.0f;
+#endif
+        return std::max(0.f, dist);
+    }
+
+    // Lowers min_dist[i] to the distance from point i to its closest center in centers, and sets closest[i] to first_id + that center then
+    void UpdateMinDistances(PointSet& points, PointSet& centers, uint32_t first_id, std::vector<float>& min_dist, std::vector<uint32_t>& closest) {
+        std::vector<int> closest_center(points.n, -1);
+        std::vector<float> closest_dist;
+        ClosestCenters(points, centers, closest_center, closest_dist);
+        parlay::parallel_for(0, points.n, [&](size_t i) {
+            const float dist = SeedingDistance(closest_dist[i]);
+            if (dist < min_dist[i]) {
+                min_dist[i] = dist;
+                closest[i] = first_id + closest_center[i];
+            }
+        });
+    }
+
+    // Picks k of the weighted candidates with k-means++, i.e., each one with probability proportional to weight * distance to the
+    // closest one picked so far. The candidates are few, so the picks are sequential and only the distance updates run in parallel
+    std::vector<uint32_t> WeightedKMeansPlusPlus(PointSet& candidates, const std::vector<double>& weights, size_t k, std::mt19937& prng) {
+        std::vector<uint32_t> picked;
+        std::vector<float> min_dist(candidates.n, std::numeric_limits<float>::max());
+        std::vector<double> score(weights);
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        constexpr size_t BLOCK = 1024;
+        while (picked.size() < k) {
+            const double total = std::accumulate(score.begin(), score.end(), 0.0);
+            if (total <= 0.0) {
+                break;      // all candidates are picked or coincide with a picked one
+            }
+            double r = uniform(prng) * total;
+            size_t c = 0;
+            while (c + 1 < candidates.n && (score[c] <= 0.0 || (r -= score[c]) > 0.0)) ++c;
+            while (score[c] <= 0.0) --c;    // rounding at the end of the range
+            picked.push_back(c);
+            parlay::parallel_for(0, idiv_ceil(candidates.n, BLOCK), [&](size_t block) {
+                const size_t begin = block * BLOCK, count = std::min(BLOCK, candidates.n - begin);
+                float dists[BLOCK];
+                DistancesToBlock(candidates.GetPoint(c), candidates.GetPoint(begin), count, candidates.d, dists);
+                for (size_t i = 0; i < count; ++i) {
+                    min_dist[begin + i] = std::min(min_dist[begin + i], SeedingDistance(dists[i]));
+                    score[begin + i] = weights[begin + i] * min_dist[begin + i];
+                }
+            });
+            score[c] = 0.0;
+        }
+        return picked;
+    }
+
+    constexpr size_t KMEANS_PARALLEL_ROUNDS = 5;
+    // expected samples per round, as a multiple of k. Every round costs about oversampling many Lloyd rounds, and Bahmani et al. found
+    // little difference in the final cost between 0.5 and 2
+    constexpr double KMEANS_PARALLEL_OVERSAMPLING = 0.5;
 } // namespace
 
 PointSet RandomSample(PointSet& points, size_t num_samples, int seed) {
-    PointSet centroids;
-    centroids.n = num_samples;
-    centroids.d = points.d;
-
-    std::vector<int> iota(points.n);
-    std::iota(iota.begin(), iota.end(), 0);
+    return GatherAsFloat(points, SampleIDs(points.n, num_samples, seed));
+}
 
+PointSet KMeansParallelSeeding(PointSet& points, size_t k, int seed) {
+    if (k >= points.n) {
+        return RandomSample(points, k, seed);
+    }
     std::mt19937 prng(seed);
-    std::vector<int> sample(num_samples);
-    std::sample(iota.begin(), iota.end(), sample.begin(), num_samples, prng);
-
-    for (int i : sample) {
-        float* p = points.GetPoint(i);
-        for (size_t j = 0; j < points.d; ++j) {
-            centroids.coordinates.push_back(p[j]);
+    std::vector<uint32_t> candidate_ids = { std::uniform_int_distribution<uint32_t>(0, points.n - 1)(prng) };
+    std::vector<float> min_dist(points.n, std::numeric_limits<float>::max());
+    std::vector<uint32_t> closest_candidate(points.n, 0);
+    PointSet first = GatherAsFloat(points, candidate_ids);
+    UpdateMinDistances(points, first, 0, min_dist, closest_candidate);
+
+    // oversampling: every round samples each point independently with probability l * min_dist / sum of min_dist
+    const double l = KMEANS_PARALLEL_OVERSAMPLING * k;
+    for (size_t round = 0; round < KMEANS_PARALLEL_ROUNDS; ++round) {
+        const double cost = parlay::reduce(parlay::delayed_map(min_dist, [](float x) -> double { return x; }));
+        if (cost <= 0.0) {
+            break;
         }
+        const parlay::random rng(seed + round + 1);
+        auto sampled = parlay::filter(parlay::iota<uint32_t>(points.n), [&](uint32_t i) {
+            const double u = double(rng.ith_rand(i) >> 11) / double(1UL << 53);
+            return u < l * min_dist[i] / cost;
+        });
+        if (sampled.empty()) {
+            continue;
+        }
+        PointSet centers = GatherAsFloat(points, sampled);
+        UpdateMinDistances(points, centers, candidate_ids.size(), min_dist, closest_candidate);
+        candidate_ids.insert(candidate_ids.end(), sampled.begin(), sampled.end());
     }
-    return centroids;
+
+    // reduction: weigh the candidates by the number of points closest to them and pick k of them with k-means++
+    PointSet candidates = GatherAsFloat(points, candidate_ids);
+    auto histogram = parlay::histogram_by_index(closest_candidate, candidates.n);
+    const std::vector<double> weights(histogram.begin(), histogram.end());
+    std::vector<uint32_t> picked = WeightedKMeansPlusPlus(candidates, weights, k, prng);
+    std::vector<uint32_t> centroid_ids;
+    for (uint32_t c : picked) centroid_ids.push_back(candidate_ids[c]);
+    // fewer distinct candidates than k, e.g., with many duplicate points. Fill up uniformly, KMeans drops the clusters that stay empty
+    while (centroid_ids.size() < k) {
+        centroid_ids.push_back(std::uniform_int_distribution<uint32_t>(0, points.n - 1)(prng));
+    }
+    return GatherAsFloat(points, centroid_ids);
+}
+
+PointSet InitialCentroids(PointSet& points, size_t k, int seed, const KMeansConfig& config) {
+    if (config.seeding == KMeansSeeding::KMeansParallel) {
+        return KMeansParallelSeeding(points, k, seed);
+    }
+    return RandomSample(points, k, seed);
 }
 
-std::vector<int> KMeans(PointSet& P, PointSet& centroids) {
+std::function<void(const KMeansRoundStats&)> KMeansCSVLog(const std::string& path) {
+    auto out = std::make_shared<std::ofstream>(path);
+    if (!*out) {
+        throw std::runtime_error("Can't open " + path + " for writing");
+    }
+    *out << "n,k,round,seconds,reassigned,centroid_shift,objective" << std::endl;
+    auto lock = std::make_shared<std::mutex>();
+    return [out, lock](const KMeansRoundStats& stats) {
+        std::lock_guard<std::mutex> guard(*lock);
+        *out << stats.n << "," << stats.k << "," << stats.round << "," << stats.seconds << "," << stats.num_reassigned << "," << stats.centroid_shift
+             << "," << stats.objective << std::endl;
+    };
+}
+
+std::vector<int> KMeans(PointSet& P, PointSet& centroids, const KMeansConfig& config) {
     if (centroids.n < 1) {
         throw std::runtime_error("KMeans #centroids < 1");
     }
     std::vector<int> closest_center(P.n, -1);
     parlay::sequence<float> vector_sqrt_norms;
 #ifdef MIPS_DISTANCE
-    // precompute norms and sqrts since it slowed down centroid calculation
-    vector_sqrt_norms = parlay::tabulate(P.n, [&](size_t i) -> float { return std::sqrt(vec_norm(P.GetPoint(i), P.d)); });
+    // the norms are cached in P, so recursive calls on extracted buckets don't recompute them.
+    // L2 doesn't cache them: the distance matrix engine computes the norms of each tile on the fly
+    P.ComputeNorms();
+    // precompute sqrts since it slowed down centroid calculation
+    vector_sqrt_norms = parlay::tabulate(P.n, [&](size_t i) -> float { return std::sqrt(P.norms[i]); });
+#else
+    BoundedAssignment assignment(P, centroids, closest_center);
 #endif
-    static constexpr size_t NUM_ROUNDS = 20;
-    for (size_t r = 0; r < NUM_ROUNDS; ++r) {
-        NearestCenters(P, centroids, closest_center);
+    RoundTracker tracker(config, P.n);
+    for (size_t r = 0; r < config.max_rounds; ++r) {
+        Timer timer;
+        timer.Start();
+#ifdef MIPS_DISTANCE
+        const size_t num_reassigned = ReassignToNearestCenters(P, centroids, closest_center);
+#else
+        const size_t num_reassigned = assignment.Assign();
+#endif
+        PointSet old_centroids = centroids;
         AggregateClustersParallel(P, centroids, closest_center, vector_sqrt_norms);
+        if (tracker.Converged(r, timer.Stop(), num_reassigned, old_centroids, centroids,
+                              [&] { return ObjectiveValue(P, centroids, closest_center); })) {
+            break;
+        }
+    }
+    return closest_center;
+}
+
+PointSet RandomSample(PointStream& points, size_t num_samples, int seed) {
+    std::vector<int> sample = SampleIDs(points.n, num_samples, seed);
+    PointSet subset = points.ReadSubset(std::vector<uint32_t>(sample.begin(), sample.end()));
+    subset.ConvertToFloat();
+    return subset;
+}
+
+std::vector<int> KMeans(PointStream& P, PointSet& centroids, const KMeansConfig& config) {
+    if (centroids.n < 1) {
+        throw std::runtime_error("KMeans #centroids < 1");
+    }
+    std::vector<int> closest_center(P.n, -1);
+    RoundTracker tracker(config, P.n);
+    for (size_t r = 0; r < config.max_rounds; ++r) {
+        Timer timer;
+        timer.Start();
+        std::atomic<size_t> num_reassigned = 0;
+        // assignment and centroid sums fused into one pass over the points
+        PointSet sums;
+        sums.n = centroids.n;
+        sums.d = centroids.d;
+        sums.Alloc();
+        std::vector<size_t> cluster_size(centroids.n, 0);
+        std::vector<float> norm_sums(centroids.n, 0.f);
+        P.ForEachChunk([&](PointSet& chunk, size_t first) {
+            std::vector<int> chunk_closest(chunk.n, -1);
+            NearestCenters(chunk, centroids, chunk_closest);
+            num_reassigned += parlay::count_if(parlay::iota<size_t>(chunk.n), [&](size_t i) { return closest_center[first + i] != chunk_closest[i]; });
+            std::copy(chunk_closest.begin(), chunk_closest.end(), closest_center.begin() + first);
+            parlay::sequence<float> vector_sqrt_norms;
+#ifdef MIPS_DISTANCE
+            chunk.ComputeNorms();
+            vector_sqrt_norms = parlay::tabulate(chunk.n, [&](size_t i) -> float { return std::sqrt(chunk.norms[i]); });
+#endif
+            size_t block_size = std::max<size_t>(idiv_ceil(chunk.n, parlay::num_workers()), 1024);
+            SumPointsInClustersParallel(chunk, sums, chunk_closest, cluster_size, vector_sqrt_norms, norm_sums, block_size);
+        });
+        NormalizeCentroids(sums, cluster_size, norm_sums);
+        PointSet old_centroids = std::move(centroids);
+        centroids = std::move(sums);
+        RemoveEmptyClusters(centroids, closest_center, cluster_size);
+        std::cout << "Streaming KMeans round " << r << " done. " << num_reassigned << " points changed their cluster" << std::endl;
+        // the objective would take another pass over the stream
+        if (tracker.Converged(r, timer.Stop(), num_reassigned, old_centroids, centroids, [] { return -1.0; })) {
+            break;
+        }
     }
     return closest_center;
 }
 
+std::vector<int> MiniBatchKMeans(PointSet& P, PointSet& centroids, size_t batch_size, int seed, const KMeansConfig& config) {
+    if (centroids.n < 1) {
+        throw std::runtime_error("MiniBatchKMeans #centroids < 1");
+    }
+    Timer timer;
+    timer.Start();
+    batch_size = std::min(batch_size, P.n);
+    MiniBatchRounds(P.n, centroids, batch_size, seed, config, [&](const std::vector<uint32_t>& ids) { return ExtractPointsInBucket(ids, P); });
+    std::vector<int> closest_center(P.n, -1);
+    NearestCenters(P, centroids, closest_center);
+    RemoveEmptyClusters(centroids, closest_center);
+    std::cout << "Mini-batch KMeans with " << config.max_rounds << " batches of " << batch_size << " points took " << timer.Stop() << " s" << std::endl;
+    return closest_center;
+}
+
+std::vector<int> MiniBatchKMeans(PointStream& P, PointSet& centroids, size_t batch_size, int seed, const KMeansConfig& config) {
+    if (centroids.n < 1) {
+        throw std::runtime_error("MiniBatchKMeans #centroids < 1");
+    }
+    Timer timer;
+    timer.Start();
+    batch_size = std::min(batch_size, P.n);
+    MiniBatchRounds(P.n, centroids, batch_size, seed, config, [&](const std::vector<uint32_t>& ids) { return P.ReadSubset(ids); });
+    std::vector<int> closest_center(P.n, -1);
+    P.ForEachChunk([&](PointSet& chunk, size_t first) {
+        std::vector<int> chunk_closest(chunk.n, -1);
+        NearestCenters(chunk, centroids, chunk_closest);
+        std::copy(chunk_closest.begin(), chunk_closest.end(), closest_center.begin() + first);
+    });
+    RemoveEmptyClusters(centroids, closest_center);
+    std::cout << "Streaming mini-batch KMeans with " << config.max_rounds << " batches of " << batch_size << " points took " << timer.Stop() << " s"
+              << std::endl;
+    return closest_center;
+}
+
+std::vector<int> EuclideanKMeans(PointSet& P, PointSet& centroids, const KMeansConfig& config) {
+#ifdef MIPS_DISTANCE
+    if (centroids.n < 1) {
+        throw std::runtime_error("KMeans #centroids < 1");
+    }
+    std::vector<int> closest_center(P.n, -1);
+    RoundTracker tracker(config, P.n);
+    for (size_t r = 0; r < config.max_rounds; ++r) {
+        Timer timer;
+        timer.Start();
+        std::vector<int> previous = closest_center;
+        ClosestCentersL2(P, centroids, closest_center);
+        const size_t num_reassigned = parlay::count_if(parlay::iota<size_t>(P.n), [&](size_t i) { return previous[i] != closest_center[i]; });
+        PointSet old_centroids = centroids;
+        centroids.coordinates.assign(centroids.coordinates.size(), 0.f);
+        std::vector<size_t> cluster_size(centroids.n, 0);
+        SumPointsInClustersL2(P, centroids, closest_center, cluster_size, 0, P.n);
+        NormalizeCentroidsL2(centroids, cluster_size);
+        RemoveEmptyClusters(centroids, closest_center, cluster_size);
+        auto objective = [&] {
+            return parlay::reduce(parlay::delayed_tabulate(P.n, [&](size_t i) -> double {
+                std::vector<float> buffer;
+                return sqr_l2_dist(centroids.GetPoint(closest_center[i]), P.GetPointAsFloat(i, buffer), P.d);
+            }));
+        };
+        if (tracker.Converged(r, timer.Stop(), num_reassigned, old_centroids, centroids, objective)) {
+            break;
+        }
+    }
+    return closest_center;
+#else
+    return KMeans(P, centroids, config);
+#endif
+}
+
 double ObjectiveValue(PointSet& points, PointSet& centroids, const std::vector<int>& closest_center) {
     return parlay::reduce(parlay::delayed_tabulate(
-            points.n, [&](size_t i) -> double { return pos_distance(points.GetPoint(i), centroids.GetPoint(closest_center[i]), points.d); }));
+            points.n, [&](size_t i) -> double { return PosDistanceToPoint(centroids.GetPoint(closest_center[i]), points, i); }));
 }
 
 double square(double x) { return x * x; }
 
-std::vector<int> BalancedKMeans(PointSet& points, PointSet& centroids, size_t max_cluster_size) {
-    std::vector<int> closest_center = KMeans(points, centroids);
+std::vector<int> BalancedKMeans(PointSet& points, PointSet& centroids, size_t max_cluster_size, const KMeansConfig& config) {
+    std::vector<int> closest_center = KMeans(points, centroids, config);
 
-    // precompute norms and sqrts since it slowed down centroid calculation
-    parlay::sequence<float> vector_sqrt_norms =
-            parlay::tabulate(points.n, [&](size_t i) -> float { return std::sqrt(vec_norm(points.GetPoint(i), points.d)); });
+    // precompute sqrts since it slowed down centroid calculation
+    points.ComputeNorms();
+    parlay::sequence<float> vector_sqrt_norms = parlay::tabulate(points.n, [&](size_t i) -> float { return std::sqrt(points.norms[i]); });
 
     PointSet cluster_coordinate_sums = centroids;
     std::vector<size_t> cluster_sizes = AggregateClustersParallel(points, cluster_coordinate_sums, closest_center, vector_sqrt_norms, false);
@@ -311,7 +905,7 @@ std::vector<int> BalancedKMeans(PointSet& points, PointSet& centroids, size_t ma
 
     print_cluster_sizes();
 
-    auto atomic_move = [&](uint32_t point_id, int old_cluster, int new_cluster) {
+    auto atomic_move = [&](uint32_t point_id, const float* p, int old_cluster, int new_cluster) {
         if (new_cluster == old_cluster) {
             return;
         }
@@ -327,7 +921,6 @@ std::vector<int> BalancedKMeans(PointSet& points, PointSet& centroids, size_t ma
         atomic_fetch_add_double(&cluster_norm_sums[new_cluster], square(vector_sqrt_norms[point_id]));
         multiplier = 1.0f / vector_sqrt_norms[point_id];
 #endif
-        float* p = points.GetPoint(point_id);
         for (size_t j = 0; j < points.d; ++j) {
             atomic_fetch_add_float(coords_best + j, p[j] * multiplier);
             atomic_fetch_add_float(coords_old + j, -p[j] * multiplier);
@@ -392,7 +985,7 @@ std::vector<int> BalancedKMeans(PointSet& points, PointSet& centroids, size_t ma
                 while (closest_center[point_id] != largest) {
                     ++point_id;
                 }
-                atomic_move(point_id, largest, smallest);
+                atomic_move(point_id, points.GetPoint(point_id), largest, smallest);
                 --half;
             }
             update_centroids();
@@ -402,57 +995,67 @@ std::vector<int> BalancedKMeans(PointSet& points, PointSet& centroids, size_t ma
         // mini-batch cluster moves and updates
         auto perm = parlay::random_shuffle(parlay::iota<uint32_t>(points.n), parlay::random(round));
         size_t num_subrounds = 1000;
+        constexpr size_t MOVE_BLOCK_SIZE = 16;
         size_t n = points.n;
         size_t chunk_size = idiv_ceil(n, num_subrounds);
         for (size_t sub_round = 0; sub_round < num_subrounds; ++sub_round) {
             auto [start, end] = bounds(sub_round, n, chunk_size);
 
-            // moving phase
-            parlay::parallel_for(start, end, [&](size_t i) {
-                uint32_t point_id = perm[i];
-                float* p = points.GetPoint(point_id);
-                const int old_cluster = closest_center[point_id];
-                const float old_cluster_dist = pos_distance(centroids.GetPoint(old_cluster), p, points.d);
-
-                const size_t old_cluster_size = cluster_sizes[old_cluster];
-
-                int best = old_cluster;
-                double best_score = std::numeric_limits<double>::max();
-                double min_penalty_needed = std::numeric_limits<double>::max();
-
-                for (int j = 0; j < int(centroids.n); ++j) {
-                    const size_t cluster_size = cluster_sizes[j];
-                    const float dist = pos_distance(centroids.GetPoint(j), p, points.d);
-                    const double score = dist + round_penalty * cluster_size;
-                    int denom = old_cluster_size - cluster_size;
-                    if (denom == 0) {
-                        denom = 1;
-                    }
+            // moving phase. In small blocks of points, so that the buffers are allocated once per block and not per point
+            parlay::parallel_for(0, idiv_ceil(end - start, MOVE_BLOCK_SIZE), [&](size_t block) {
+                std::vector<float> buffer;
+                // all centroid distances in one block, so that the kernels for the dimension are looked up once per point
+                std::vector<float> dists(centroids.n);
+                for (size_t i = start + block * MOVE_BLOCK_SIZE; i < std::min(end, start + (block + 1) * MOVE_BLOCK_SIZE); ++i) {
+                    uint32_t point_id = perm[i];
+                    const float* p = points.GetPointAsFloat(point_id, buffer);
+                    const int old_cluster = closest_center[point_id];
+                    DistancesToBlock(p, centroids.coordinates.data(), centroids.n, points.d, dists.data());
+#ifdef MIPS_DISTANCE
+                    for (float& dist : dists) dist += 1.0f;
+#endif
+                    const float old_cluster_dist = dists[old_cluster];
+
+                    const size_t old_cluster_size = cluster_sizes[old_cluster];
+
+                    int best = old_cluster;
+                    double best_score = std::numeric_limits<double>::max();
+                    double min_penalty_needed = std::numeric_limits<double>::max();
 
-                    const double penalty_needed = (dist - old_cluster_dist) / denom;
-                    if (old_cluster_size > cluster_size) {
-                        if (round_penalty < penalty_needed) {
-                            if (penalty_needed < min_penalty_needed) {
-                                min_penalty_needed = penalty_needed;
+                    for (int j = 0; j < int(centroids.n); ++j) {
+                        const size_t cluster_size = cluster_sizes[j];
+                        const float dist = dists[j];
+                        const double score = dist + round_penalty * cluster_size;
+                        int denom = old_cluster_size - cluster_size;
+                        if (denom == 0) {
+                            denom = 1;
+                        }
+
+                        const double penalty_needed = (dist - old_cluster_dist) / denom;
+                        if (old_cluster_size > cluster_size) {
+                            if (round_penalty < penalty_needed) {
+                                if (penalty_needed < min_penalty_needed) {
+                                    min_penalty_needed = penalty_needed;
+                                }
+                            } else {
+                                if (score < best_score) {
+                                    best = j;
+                                    best_score = score;
+                                }
                             }
                         } else {
-                            if (score < best_score) {
+                            if (round_penalty < penalty_needed && score < best_score) {
                                 best = j;
                                 best_score = score;
                             }
                         }
-                    } else {
-                        if (round_penalty < penalty_needed && score < best_score) {
-                            best = j;
-                            best_score = score;
-                        }
                     }
-                }
 
-                penalties_needed[point_id] = min_penalty_needed;
+                    penalties_needed[point_id] = min_penalty_needed;
 
-                atomic_move(point_id, old_cluster, best);
-            });
+                    atomic_move(point_id, p, old_cluster, best);
+                }
+            }, 1);
 
             update_centroids();
         }
@@ -501,7 +1104,7 @@ std::vector<int> BalancedKMeans(PointSet& points, PointSet& centroids, size_t ma
             int target = -1;
             for (size_t j = 0; j < clusters.size(); ++j) {
                 if (clusters[j].size() < max_cluster_size) {
-                    if (float dist = distance(points.GetPoint(v), centroids.GetPoint(j), points.d); dist < min_dist) {
+                    if (float dist = DistanceToPoint(centroids.GetPoint(j), points, v); dist < min_dist) {
                         min_dist = dist;
                         target = j;
                     }
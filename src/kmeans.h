@@ -1,8 +1,63 @@
 #pragma once
 
+#include <functional>
+#include <string>
+
 #include "defs.h"
+#include "point_stream.h"
+
+// What happened in one round of KMeans
+struct KMeansRoundStats {
+    size_t n = 0, k = 0;            // k after removing empty clusters
+    size_t round = 0;
+    double seconds = 0.0;
+    size_t num_reassigned = 0;      // points that changed their cluster
+    double centroid_shift = 0.0;    // see KMeansConfig. Infinite if clusters were removed
+    double objective = -1.0;        // -1 if it wasn't computed
+};
+
+enum class KMeansSeeding { Random, KMeansParallel };
+
+// When KMeans stops. It stops after max_rounds, or as soon as one of the thresholds is met.
+// A threshold of 0 disables it, so with all thresholds 0 it runs max_rounds rounds.
+struct KMeansConfig {
+    size_t max_rounds = 20;
+    // fraction of the points that changed their cluster in a round
+    double reassigned_fraction = 1e-3;
+    // mean squared move of the centroids, relative to the mean squared distance of the centroids to their mean
+    double centroid_shift = 1e-4;
+    // relative improvement of the objective. Computing it costs another pass over the points, so it is off by default
+    double objective_improvement = 0.0;
+    // called after every round. The objective is also computed when this is set (not by the streaming KMeans)
+    std::function<void(const KMeansRoundStats&)> on_round;
+    // how InitialCentroids picks the initial centroids
+    KMeansSeeding seeding = KMeansSeeding::KMeansParallel;
+};
+
+// An on_round callback that appends one line per round to a CSV file. Safe to use from concurrent KMeans calls
+std::function<void(const KMeansRoundStats&)> KMeansCSVLog(const std::string& path);
 
 PointSet RandomSample(PointSet& points, size_t num_samples, int seed);
-std::vector<int> KMeans(PointSet& P, PointSet& centroids);
+// k-means|| (Bahmani et al., Scalable K-Means++). Starts with one random point, then oversamples for a few rounds: each round picks
+// every point independently with probability proportional to its distance to the closest candidate so far, about k / 2 per round.
+// The candidates are weighted by the number of points closest to them and reduced to k with weighted k-means++.
+// A handful of passes over the points, but the start is far better than uniform samples, so KMeans needs fewer rounds
+PointSet KMeansParallelSeeding(PointSet& points, size_t k, int seed);
+// The initial centroids for KMeans, RandomSample or KMeansParallelSeeding as config.seeding says
+PointSet InitialCentroids(PointSet& points, size_t k, int seed, const KMeansConfig& config = KMeansConfig());
+std::vector<int> KMeans(PointSet& P, PointSet& centroids, const KMeansConfig& config = KMeansConfig());
+// KMeans with squared Euclidean distances and plain means as centroids, also when built with MIPS_DISTANCE. For quantizer codebooks,
+// which have to minimize the reconstruction error. The initial centroids shouldn't depend on the metric either, e.g., RandomSample
+std::vector<int> EuclideanKMeans(PointSet& P, PointSet& centroids, const KMeansConfig& config = KMeansConfig());
+// Out-of-core variants for datasets that don't fit into RAM. Each KMeans round is one pass over the stream
+PointSet RandomSample(PointStream& points, size_t num_samples, int seed);
+std::vector<int> KMeans(PointStream& P, PointSet& centroids, const KMeansConfig& config = KMeansConfig());
+// Mini-batch k-means (Sculley, Web-scale k-means clustering). Each round assigns a random batch of points and moves every centroid
+// to the mean of all points it absorbed so far, so only config.max_rounds * batch_size points are read instead of a full pass per round.
+// The result comes from one full assignment pass at the end. Empty clusters are removed, like in KMeans.
+// config.on_round is called per batch, with n = batch size, num_reassigned = 0 and the objective of the batch before the update.
+// The thresholds don't apply, the shifts between batches are too noisy for them
+std::vector<int> MiniBatchKMeans(PointSet& P, PointSet& centroids, size_t batch_size, int seed, const KMeansConfig& config = KMeansConfig());
+std::vector<int> MiniBatchKMeans(PointStream& P, PointSet& centroids, size_t batch_size, int seed, const KMeansConfig& config = KMeansConfig());
 double ObjectiveValue(PointSet& points, PointSet& centroids, const std::vector<int>& closest_center);
-std::vector<int> BalancedKMeans(PointSet& points, PointSet& centroids, size_t max_cluster_size);
+std::vector<int> BalancedKMeans(PointSet& points, PointSet& centroids, size_t max_cluster_size, const KMeansConfig& config = KMeansConfig());
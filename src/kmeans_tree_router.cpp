@@ -1,15 +1,52 @@
 #include "kmeans_tree_router.h"
 
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <numeric>
 #include <parlay/parallel.h>
+#include "binary_io.h"
 #include "dist.h"
 #include "kmeans.h"
 
+namespace {
+    constexpr char MAGIC[8] = { 'G', 'P', 'A', 'N', 'N', 'K', 'M', 'T' };
+    constexpr uint32_t FORMAT_VERSION = 2;
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t dim;
+        uint32_t num_shards;
+        uint32_t centroids_in_roots;
+        uint64_t num_nodes;
+        uint64_t num_centroids;
+        uint64_t clusters_fingerprint;
+    };
+    static_assert(sizeof(FileHeader) == 48);
+
+    // FNV-1a over the sizes and point ids of the clusters
+    uint64_t ClustersFingerprint(const Clusters& clusters) {
+        uint64_t h = 14695981039346656037ULL;
+        auto add = [&](const void* data, size_t bytes) {
+            for (size_t i = 0; i < bytes; ++i) {
+                h = (h ^ static_cast<const uint8_t*>(data)[i]) * 1099511628211ULL;
+            }
+        };
+        for (const auto& cluster : clusters) {
+            const uint64_t size = cluster.size();
+            add(&size, sizeof(size));
+            add(cluster.data(), cluster.size() * sizeof(uint32_t));
+        }
+        return h;
+    }
+}
+
 void KMeansTreeRouter::Train(PointSet& points, const Clusters& clusters, KMeansTreeRouterOptions options) {
     num_shards = clusters.size();
-    roots.resize(num_shards);
+    std::vector<TreeNode> roots(num_shards);
     dim = points.d;
+    clusters_fingerprint = ClustersFingerprint(clusters);
 
     std::cout << "Train. num-shards = " << num_shards << " dim = " << dim << " budget = " << options.budget << std::endl;
 
@@ -30,10 +67,12 @@ void KMeansTreeRouter::Train(PointSet& points, const Clusters& clusters, KMeansT
                 // }
             },
             num_shards / num_shards_processed_in_parallel);
+
+    Flatten(roots);
 }
 
 void KMeansTreeRouter::TrainRecursive(PointSet& points, KMeansTreeRouterOptions options, TreeNode& tree_node, int seed) {
-    PointSet centroids = RandomSample(points, std::max(2, std::min<int>(options.num_centroids, options.budget)), seed);
+    PointSet centroids = InitialCentroids(points, std::max(2, std::min<int>(options.num_centroids, options.budget)), seed);
     auto partition = KMeans(points, centroids);
     auto buckets = ConvertPartitionToClusters(partition);
     // std::cout << "num buckets " << buckets.size() << " num centroids " << centroids.n << " num points " << points.n << " options.budget " << options.budget
@@ -77,6 +116,33 @@ void KMeansTreeRouter::TrainRecursive(PointSet& points, KMeansTreeRouterOptions
             1);
 }
 
+void KMeansTreeRouter::Flatten(std::vector<TreeNode>& roots) {
+    nodes.clear();
+    centroids = PointSet();
+    centroids.d = dim;
+    std::vector<std::pair<TreeNode*, uint32_t>> queue;     // BFS order, with the shard of the node
+    for (size_t b = 0; b < roots.size(); ++b) {
+        queue.emplace_back(&roots[b], b);
+    }
+    for (size_t u = 0; u < queue.size(); ++u) {
+        auto [tree_node, shard] = queue[u];
+        if (tree_node->centroids.coordinates.size() != tree_node->centroids.n * dim) {
+            throw std::runtime_error("Tree node has " + std::to_string(tree_node->centroids.coordinates.size()) + " coordinates for " +
+                                     std::to_string(tree_node->centroids.n) + " centroids");
+        }
+        nodes.push_back(FlatNode{ .first_centroid = centroids.n,
+                                  .first_child = queue.size(),
+                                  .num_centroids = static_cast<uint32_t>(tree_node->centroids.n),
+                                  .num_children = static_cast<uint32_t>(tree_node->children.size()),
+                                  .shard = shard });
+        for (TreeNode& child : tree_node->children) {
+            queue.emplace_back(&child, shard);
+        }
+        centroids.coordinates.insert(centroids.coordinates.end(), tree_node->centroids.coordinates.begin(), tree_node->centroids.coordinates.end());
+        centroids.n += tree_node->centroids.n;
+    }
+}
+
 PointSet KMeansTreeRouter::ReorderCentroids(PointSet& centroids, std::vector<std::pair<size_t, size_t>>& permutation) {
     PointSet re;
     re.d = centroids.d;
@@ -93,31 +159,31 @@ PointSet KMeansTreeRouter::ReorderCentroids(PointSet& centroids, std::vector<std
 std::vector<int> KMeansTreeRouter::Query(float* Q, int budget) {
     struct PQEntry {
         float dist = 0.f;
-        int shard_id = -1;
-        TreeNode* node = nullptr;
+        uint64_t node = 0;
         bool operator>(const PQEntry& other) const { return dist > other.dist; }
     };
     std::priority_queue<PQEntry, std::vector<PQEntry>, std::greater<>> pq;
     std::vector<float> min_dist(num_shards, std::numeric_limits<float>::max());
 
-    for (int u = 0; u < int(roots.size()); ++u) {
+    for (int u = 0; u < num_shards; ++u) {
         float dist = std::numeric_limits<float>::lowest();
         if (centroids_in_roots) {
-            dist = distance(roots[u].centroids.GetPoint(0), Q, dim);
+            dist = distance(centroids.GetPoint(nodes[u].first_centroid), Q, dim);
             budget--;
         }
-        pq.push(PQEntry{ dist, u, &roots[u] });
+        pq.push(PQEntry{ dist, uint64_t(u) });
     }
 
     while (!pq.empty() && budget > 0) {
         PQEntry top = pq.top();
         pq.pop();
-        budget -= top.node->centroids.n;
-        for (size_t i = 0; i < top.node->centroids.n; ++i) {
-            float dist = distance(top.node->centroids.GetPoint(i), Q, dim);
-            min_dist[top.shard_id] = std::min(min_dist[top.shard_id], dist);
-            if (i < top.node->children.size()) {
-                pq.push(PQEntry{ dist, top.shard_id, &top.node->children[i] });
+        const FlatNode& node = nodes[top.node];
+        budget -= node.num_centroids;
+        for (uint32_t i = 0; i < node.num_centroids; ++i) {
+            float dist = distance(centroids.GetPoint(node.first_centroid + i), Q, dim);
+            min_dist[node.shard] = std::min(min_dist[node.shard], dist);
+            if (i < node.num_children) {
+                pq.push(PQEntry{ dist, node.first_child + i });
             }
         }
     }
@@ -132,33 +198,33 @@ std::vector<int> KMeansTreeRouter::Query(float* Q, int budget) {
 KMeansTreeRouter::FrequencyQueryData KMeansTreeRouter::FrequencyQuery(float* Q, int budget, int num_voting_neighbors) {
     struct PQEntry {
         float dist = 0.f;
-        int shard_id = -1;
-        TreeNode* node = nullptr;
+        uint64_t node = 0;
         bool operator>(const PQEntry& other) const { return dist > other.dist; }
     };
     std::priority_queue<PQEntry, std::vector<PQEntry>, std::greater<>> pq;
     TopN top_neighbors(num_voting_neighbors);
     std::vector<float> min_dist(num_shards, std::numeric_limits<float>::max());
 
-    for (int u = 0; u < int(roots.size()); ++u) {
+    for (int u = 0; u < num_shards; ++u) {
         float dist = std::numeric_limits<float>::lowest();
         if (centroids_in_roots) {
-            dist = distance(roots[u].centroids.GetPoint(0), Q, dim);
+            dist = distance(centroids.GetPoint(nodes[u].first_centroid), Q, dim);
             budget--;
         }
-        pq.push(PQEntry{ dist, u, &roots[u] });
+        pq.push(PQEntry{ dist, uint64_t(u) });
     }
 
     while (!pq.empty() && budget > 0) {
         PQEntry top = pq.top();
         pq.pop();
-        budget -= top.node->centroids.n;
-        for (size_t i = 0; i < top.node->centroids.n; ++i) {
-            float dist = distance(top.node->centroids.GetPoint(i), Q, dim);
-            min_dist[top.shard_id] = std::min(min_dist[top.shard_id], dist);
-            top_neighbors.Add(std::make_pair(dist, top.shard_id));
-            if (i < top.node->children.size()) {
-                pq.push(PQEntry{ dist, top.shard_id, &top.node->children[i] });
+        const FlatNode& node = nodes[top.node];
+        budget -= node.num_centroids;
+        for (uint32_t i = 0; i < node.num_centroids; ++i) {
+            float dist = distance(centroids.GetPoint(node.first_centroid + i), Q, dim);
+            min_dist[node.shard] = std::min(min_dist[node.shard], dist);
+            top_neighbors.Add(std::make_pair(dist, node.shard));
+            if (i < node.num_children) {
+                pq.push(PQEntry{ dist, node.first_child + i });
             }
         }
     }
@@ -172,30 +238,70 @@ KMeansTreeRouter::FrequencyQueryData KMeansTreeRouter::FrequencyQuery(float* Q,
 }
 
 std::pair<PointSet, std::vector<int>> KMeansTreeRouter::ExtractPoints() {
-    PointSet points;
-    points.d = dim;
     std::vector<int> partition;
+    partition.reserve(centroids.n);
+    for (const FlatNode& node : nodes) {
+        partition.insert(partition.end(), node.num_centroids, node.shard);
+    }
+    return std::make_pair(centroids, std::move(partition));
+}
 
-    int b = 0;
-    for (TreeNode& root : roots) {
-        std::queue<TreeNode*> queue;
-        queue.push(&root);
-        while (!queue.empty()) {
-            TreeNode* u = queue.front();
-            queue.pop();
-            for (TreeNode& c : u->children) {
-                queue.push(&c);
-            }
-            if (u->centroids.coordinates.size() != u->centroids.n * u->centroids.d) {
-                std::cout << u->centroids.coordinates.size() << " " << u->centroids.n << " " << u->centroids.d << std::endl;
-                throw std::runtime_error("C");
-            }
-            points.coordinates.insert(points.coordinates.end(), u->centroids.coordinates.begin(), u->centroids.coordinates.end());
-            points.n += u->centroids.n;
-            partition.insert(partition.end(), u->centroids.n, b);
-        }
-        b++;
+void KMeansTreeRouter::Serialize(const std::string& path) const {
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("Can't open " + path + " for writing");
+    }
+    FileHeader header;
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = FORMAT_VERSION;
+    header.dim = dim;
+    header.num_shards = num_shards;
+    header.centroids_in_roots = centroids_in_roots;
+    header.num_nodes = nodes.size();
+    header.num_centroids = centroids.n;
+    header.clusters_fingerprint = clusters_fingerprint;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(FlatNode));
+    out.write(reinterpret_cast<const char*>(centroids.coordinates.data()), centroids.coordinates.size() * sizeof(float));
+    if (!out) {
+        throw std::runtime_error("Writing " + path + " failed");
+    }
+}
+
+bool KMeansTreeRouter::TrainedOn(const PointSet& points, const Clusters& clusters) const {
+    return dim == points.d && num_shards == int(clusters.size()) && clusters_fingerprint == ClustersFingerprint(clusters);
+}
+
+KMeansTreeRouter KMeansTreeRouter::Deserialize(const std::string& path) {
+    MappedFile file = MapFile(path, /*copy_on_write=*/true);
+    if (file.data.size() < sizeof(FileHeader)) {
+        throw std::runtime_error(path + " is not a k-means tree router file");
+    }
+    FileHeader header;
+    std::memcpy(&header, file.data.data(), sizeof(header));
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+        throw std::runtime_error(path + " is not a k-means tree router file");
+    }
+    if (header.version != FORMAT_VERSION) {
+        throw std::runtime_error(path + " has format version " + std::to_string(header.version) + ". Expected " + std::to_string(FORMAT_VERSION));
+    }
+    const size_t nodes_offset = sizeof(FileHeader);
+    const size_t centroids_offset = nodes_offset + header.num_nodes * sizeof(FlatNode);
+    if (header.num_nodes < header.num_shards || file.data.size() < centroids_offset + header.num_centroids * header.dim * sizeof(float)) {
+        throw std::runtime_error(path + " is truncated");
     }
 
-    return std::make_pair(std::move(points), std::move(partition));
+    KMeansTreeRouter router;
+    router.dim = header.dim;
+    router.num_shards = header.num_shards;
+    router.centroids_in_roots = header.centroids_in_roots != 0;
+    router.clusters_fingerprint = header.clusters_fingerprint;
+    router.nodes.resize(header.num_nodes);
+    std::memcpy(router.nodes.data(), file.data.data() + nodes_offset, header.num_nodes * sizeof(FlatNode));
+    router.centroids.d = header.dim;
+    router.centroids.n = header.num_centroids;
+    // the file is mapped copy-on-write, so handing out a mutable pointer is fine
+    float* coordinates = reinterpret_cast<float*>(const_cast<uint8_t*>(file.data.data()) + centroids_offset);
+    router.centroids.coordinates.Map(std::move(file.mapping), coordinates, header.num_centroids * header.dim);
+    return router;
 }
@@ -48,18 +48,49 @@ public:
 
     std::pair<PointSet, std::vector<int>> ExtractPoints();
 
+    int NumShards() const { return num_shards; }
+
+    // Whether the router was trained on points of this dimension with these clusters, e.g., to check a deserialized one
+    bool TrainedOn(const PointSet& points, const Clusters& clusters) const;
+
+    // Writes the trained tree as one blob:
+    //   header:    magic "GPANNKMT", uint32 version, uint32 dim, uint32 num_shards, uint32 centroids_in_roots, uint64 num_nodes, num_centroids,
+    //              uint64 clusters_fingerprint
+    //   nodes:     FlatNode[num_nodes]
+    //   centroids: float[num_centroids * dim]
+    void Serialize(const std::string& path) const;
+
+    // Copies the (small) node table and maps the centroids, so loading doesn't depend on the size of the tree
+    static KMeansTreeRouter Deserialize(const std::string& path);
+
 private:
     struct TreeNode {
         std::vector<TreeNode> children;
         PointSet centroids;
     };
 
+    // The tree as it is queried and stored. The nodes are in BFS order over all shards, so nodes[b] is the root of shard b
+    // and the children of a node are contiguous: the sub-tree of centroid i < num_children is nodes[first_child + i]
+    struct FlatNode {
+        uint64_t first_centroid;
+        uint64_t first_child;
+        uint32_t num_centroids;
+        uint32_t num_children;
+        uint32_t shard;
+        uint32_t padding = 0;
+    };
+    static_assert(sizeof(FlatNode) == 32);
+
     void TrainRecursive(PointSet& points, KMeansTreeRouterOptions options, TreeNode& tree_node, int seed);
 
+    void Flatten(std::vector<TreeNode>& roots);
+
     PointSet ReorderCentroids(PointSet& centroids, std::vector<std::pair<size_t, size_t>>& permutation);
 
     bool centroids_in_roots = false;
     uint32_t dim = 0;
-    std::vector<TreeNode> roots;
+    std::vector<FlatNode> nodes;
+    PointSet centroids;
     int num_shards = 0;
+    uint64_t clusters_fingerprint = 0;      // hash of the shard sizes and point ids the router was trained on
 };
@@ -7,19 +7,18 @@
 #include <sstream>
 #include "defs.h"
 #include "dist.h"
+#include "distance_matrix.h"
 #include "spinlock.h"
 #include "topn.h"
 
 
 inline std::vector<int> TopKNeighbors(PointSet& P, uint32_t my_id, int k) {
     TopN top_k(k);
-    float* Q = P.GetPoint(my_id);
-    for (uint32_t i = 0; i < P.n; ++i) {
-        if (i == my_id)
-            continue;
-        float new_dist = distance(P.GetPoint(i), Q, P.d);
-        top_k.Add(std::make_pair(new_dist, i));
-    }
+    std::vector<float> buffer;
+    const float* Q = P.GetPointAsFloat(my_id, buffer);
+    // skip my_id by scanning the points before and after it separately
+    ScanPointsIntoTopN(Q, P, 0, my_id, 0, top_k);
+    ScanPointsIntoTopN(Q, P, my_id + 1, P.n - my_id - 1, my_id + 1, top_k);
     auto x = top_k.Take();
     std::vector<int> y;
     for (const auto& a : x)
@@ -36,18 +35,8 @@ inline AdjGraph BuildExactKNNGraph(PointSet& P, int k) {
 struct ApproximateKNNGraphBuilder {
     using Bucket = std::vector<uint32_t>;
 
-    PointSet ExtractPoints(PointSet& points, const Bucket& ids) {
-        PointSet bucket_points;
-        bucket_points.d = points.d;
-        bucket_points.n = ids.size();
-        for (auto id : ids) {
-            float* P = points.GetPoint(id);
-            for (size_t d = 0; d < points.d; ++d) {
-                bucket_points.coordinates.push_back(P[d]);
-            }
-        }
-        return bucket_points;
-    }
+    // keeps the element type of points
+    PointSet ExtractPoints(PointSet& points, const Bucket& ids) { return ExtractPointsInBucket(ids, points); }
 
     std::vector<Bucket> RecursivelySketch(PointSet& points, const Bucket& ids, int depth, int fanout) {
         if (ids.size() <= MAX_CLUSTER_SIZE) {
@@ -67,14 +56,16 @@ struct ApproximateKNNGraphBuilder {
         std::sample(ids.begin(), ids.end(), leaders.begin(), leaders.size(), prng);
 
         PointSet leader_points = ExtractPoints(points, leaders);
+        leader_points.ConvertToFloat(); // the leaders act as centers in the distance matrix engine
         std::vector<Bucket> clusters(leaders.size());
 
         { // less readable than map + zip + flatten, but at least it's as efficient as possible for fanout = 1
             parlay::sequence<std::pair<uint32_t, uint32_t>> flat(ids.size() * fanout);
 
+            std::vector<NNVec> closest_leaders = ClosestCenters(points, ids, leader_points, fanout);
             parlay::parallel_for(0, ids.size(), [&](size_t i) {
                 uint32_t point_id = ids[i];
-                auto cl = ClosestLeaders(points, leader_points, point_id, fanout).Take();
+                const auto& cl = closest_leaders[i];
                 for (int j = 0; j < fanout; ++j) {
                     flat[i * fanout + j] = std::make_pair(cl[j].second, point_id);
                 }
@@ -167,11 +158,12 @@ struct ApproximateKNNGraphBuilder {
 
         std::vector<TopN> neighbors(bucket.size(), TopN(num_neighbors));
 
+        // row i against all later points of the bucket as one block, so that the kernels for the dimension are looked up once per row
+        std::vector<float> dists(bucket.size());
         for (size_t i = 0; i < bucket.size(); ++i) {
-            float* P = bucket_points.GetPoint(i);
+            DistancesBetweenPoints(bucket_points, i, i + 1, bucket.size() - i - 1, dists.data());
             for (size_t j = i + 1; j < bucket.size(); ++j) {
-                float* Q = bucket_points.GetPoint(j);
-                float dist = distance(P, Q, points.d);
+                float dist = dists[j - i - 1];
                 neighbors[i].Add(std::make_pair(dist, bucket[j]));
                 neighbors[j].Add(std::make_pair(dist, bucket[i]));
             }
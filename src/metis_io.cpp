@@ -1,8 +1,171 @@
 #include "metis_io.h"
 
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <sstream>
 
+#include "binary_io.h"
+
+namespace {
+    constexpr char MAGIC[8] = { 'G', 'P', 'A', 'N', 'N', 'P', 'R', 'T' };
+    constexpr uint32_t FORMAT_VERSION = 1;
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t kind;
+        uint64_t num_points;
+        uint64_t num_shards;
+        uint64_t num_lists;
+        uint64_t num_entries;
+    };
+    static_assert(sizeof(FileHeader) == 48);
+
+    void WriteHeader(std::ofstream& out, PartitionFile::Kind kind, size_t num_points, size_t num_shards, size_t num_lists, size_t num_entries) {
+        FileHeader header;
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = FORMAT_VERSION;
+        header.kind = static_cast<uint32_t>(kind);
+        header.num_points = num_points;
+        header.num_shards = num_shards;
+        header.num_lists = num_lists;
+        header.num_entries = num_entries;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+
+    template<typename List>
+    void WriteCSR(const std::string& path, PartitionFile::Kind kind, const std::vector<List>& lists, size_t num_points, size_t num_shards) {
+        std::ofstream out(path, std::ios::binary);
+        if (!out) {
+            throw std::runtime_error("Can't open " + path + " for writing");
+        }
+        std::vector<uint64_t> offsets(lists.size() + 1, 0);
+        for (size_t i = 0; i < lists.size(); ++i) {
+            offsets[i + 1] = offsets[i] + lists[i].size();
+        }
+        WriteHeader(out, kind, num_points, num_shards, lists.size(), offsets.back());
+        out.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+        for (const auto& list : lists) {
+            static_assert(sizeof(list[0]) == sizeof(uint32_t));
+            out.write(reinterpret_cast<const char*>(list.data()), list.size() * sizeof(uint32_t));
+        }
+        if (!out) {
+            throw std::runtime_error("Writing " + path + " failed");
+        }
+    }
+
+    // The binary format partition.cpp used to write: uint32 n followed by int32 shard[n]
+    bool IsOldBinaryPartition(const std::string& path) {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        const size_t file_size = in.tellg();
+        uint32_t n = 0;
+        in.seekg(0);
+        in.read(reinterpret_cast<char*>(&n), sizeof(n));
+        return in && file_size == sizeof(uint32_t) + size_t(n) * sizeof(int32_t);
+    }
+
+    Partition ReadOldBinaryPartition(const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        uint32_t n = 0;
+        in.read(reinterpret_cast<char*>(&n), sizeof(n));
+        Partition partition(n);
+        in.read(reinterpret_cast<char*>(partition.data()), partition.size() * sizeof(int32_t));
+        return partition;
+    }
+} // namespace
+
+PartitionFile::PartitionFile(const std::string& path) {
+    MappedFile file = MapFile(path);
+    if (file.data.size() < sizeof(FileHeader)) {
+        throw std::runtime_error(path + " is not a binary partition file");
+    }
+    mapping = std::move(file.mapping);
+    const size_t file_size = file.data.size();
+
+    const FileHeader& header = *reinterpret_cast<const FileHeader*>(file.data.data());
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+        throw std::runtime_error(path + " is not a binary partition file");
+    }
+    if (header.version != FORMAT_VERSION) {
+        throw std::runtime_error(path + " has format version " + std::to_string(header.version) + ". Expected " + std::to_string(FORMAT_VERSION));
+    }
+    if (header.kind > static_cast<uint32_t>(Kind::Cover)) {
+        throw std::runtime_error(path + " has an unknown kind " + std::to_string(header.kind));
+    }
+    kind = static_cast<Kind>(header.kind);
+    num_points = header.num_points;
+    num_shards = header.num_shards;
+    num_lists = header.num_lists;
+
+    const uint8_t* data = file.data.data() + sizeof(FileHeader);
+    size_t expected_size = sizeof(FileHeader);
+    if (kind == Kind::Partition) {
+        assignment = reinterpret_cast<const int32_t*>(data);
+        expected_size += num_points * sizeof(int32_t);
+    } else {
+        offsets = reinterpret_cast<const uint64_t*>(data);
+        entries = reinterpret_cast<const uint32_t*>(data + (num_lists + 1) * sizeof(uint64_t));
+        expected_size += (num_lists + 1) * sizeof(uint64_t) + header.num_entries * sizeof(uint32_t);
+    }
+    if (file_size < expected_size) {
+        throw std::runtime_error(path + " is truncated");
+    }
+}
+
+bool PartitionFile::IsBinary(const std::string& path) { return FileStartsWith(path, std::string_view(MAGIC, sizeof(MAGIC))); }
+
+Partition ReadPartition(const std::string& path) {
+    Partition partition;
+    if (!PartitionFile::IsBinary(path)) {
+        partition = IsOldBinaryPartition(path) ? ReadOldBinaryPartition(path) : ReadMetisPartition(path);
+    } else {
+        PartitionFile file(path);
+        if (file.kind == PartitionFile::Kind::Partition) {
+            partition.assign(file.Assignment().begin(), file.Assignment().end());
+        } else if (file.kind == PartitionFile::Kind::Clusters) {
+            partition.assign(file.num_points, -1);
+            for (size_t c = 0; c < file.NumLists(); ++c) {
+                for (uint32_t v : file.List(c)) {
+                    if (partition[v] != -1) {
+                        throw std::runtime_error("The clusters in " + path + " overlap, so they can't be read as a partition");
+                    }
+                    partition[v] = c;
+                }
+            }
+        } else {
+            partition.resize(file.num_points);
+            for (size_t v = 0; v < file.NumLists(); ++v) {
+                if (file.List(v).size() != 1) {
+                    throw std::runtime_error("The cover in " + path + " assigns point " + std::to_string(v) + " to " +
+                                             std::to_string(file.List(v).size()) + " shards, so it can't be read as a partition");
+                }
+                partition[v] = file.List(v)[0];
+            }
+        }
+        if (std::find(partition.begin(), partition.end(), -1) != partition.end()) {
+            throw std::runtime_error("Not all points are assigned in " + path);
+        }
+    }
+
+    if (!partition.empty()) {
+        RemapPartitionIDs(partition);
+    }
+    return partition;
+}
+
+void WritePartition(const Partition& partition, const std::string& path) {
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("Can't open " + path + " for writing");
+    }
+    WriteHeader(out, PartitionFile::Kind::Partition, partition.size(), partition.empty() ? 0 : NumPartsInPartition(partition), 0, 0);
+    out.write(reinterpret_cast<const char*>(partition.data()), partition.size() * sizeof(int32_t));
+    if (!out) {
+        throw std::runtime_error("Writing " + path + " failed");
+    }
+}
+
 std::vector<int> ReadMetisPartition(const std::string& path) {
     std::ifstream in(path);
     std::vector<int> partition;
@@ -38,6 +201,22 @@ void WriteMetisGraph(const std::string& path, const AdjGraph& graph) {
 }
 
 Clusters ReadClusters(const std::string& path) {
+    if (PartitionFile::IsBinary(path)) {
+        PartitionFile file(path);
+        if (file.kind == PartitionFile::Kind::Partition) {
+            return ConvertPartitionToClusters(Partition(file.Assignment().begin(), file.Assignment().end()));
+        }
+        Clusters clusters(file.kind == PartitionFile::Kind::Clusters ? file.NumLists() : file.num_shards);
+        for (size_t i = 0; i < file.NumLists(); ++i) {
+            if (file.kind == PartitionFile::Kind::Clusters) {
+                clusters[i].assign(file.List(i).begin(), file.List(i).end());
+            } else {
+                for (uint32_t c : file.List(i)) clusters[c].push_back(i);
+            }
+        }
+        return clusters;
+    }
+
     std::ifstream in(path);
     std::string line;
     Clusters clusters;
@@ -54,11 +233,35 @@ Clusters ReadClusters(const std::string& path) {
 }
 
 void WriteClusters(const Clusters& clusters, const std::string& path) {
-    std::ofstream out(path);
+    size_t num_points = 0;
     for (const auto& c : clusters) {
-        for (const uint32_t id : c) {
-            out << id << " ";
-        }
-        out << "\n";
+        for (const uint32_t id : c) num_points = std::max<size_t>(num_points, id + 1);
+    }
+    WriteCSR(path, PartitionFile::Kind::Clusters, clusters, num_points, clusters.size());
+}
+
+Cover ReadCover(const std::string& path) {
+    if (!PartitionFile::IsBinary(path)) {
+        return ConvertClustersToCover(ReadClusters(path));
+    }
+    PartitionFile file(path);
+    if (file.kind == PartitionFile::Kind::Partition) {
+        return ConvertPartitionToCover(Partition(file.Assignment().begin(), file.Assignment().end()));
+    }
+    if (file.kind == PartitionFile::Kind::Clusters) {
+        return ConvertClustersToCover(ReadClusters(path));
+    }
+    Cover cover(file.NumLists());
+    for (size_t v = 0; v < file.NumLists(); ++v) {
+        cover[v].assign(file.List(v).begin(), file.List(v).end());
+    }
+    return cover;
+}
+
+void WriteCover(const Cover& cover, const std::string& path) {
+    size_t num_shards = 0;
+    for (const auto& shards : cover) {
+        for (const int c : shards) num_shards = std::max<size_t>(num_shards, c + 1);
     }
+    WriteCSR(path, PartitionFile::Kind::Cover, cover, cover.size(), num_shards);
 }
@@ -1,13 +1,60 @@
 #pragma once
 
+#include <memory>
+#include <span>
+
 #include "defs.h"
 
-std::vector<int> ReadMetisPartition(const std::string& path);
+// Binary partition files. One format for partitions, clusters and covers:
+//   header:    magic "GPANNPRT", uint32 version, uint32 kind, uint64 num_points, num_shards, num_lists, num_entries
+//   Partition: int32 shard[num_points]
+//   Clusters:  CSR with uint64 offsets[num_lists + 1] and uint32 entries[num_entries]. List i holds the points of shard i
+//   Cover:     the same CSR, but list i holds the shards of point i
+// All sections are 8 byte aligned, so the arrays can be used straight from a memory mapping.
+class PartitionFile {
+public:
+    enum class Kind : uint32_t { Partition = 0, Clusters = 1, Cover = 2 };
 
-void WriteMetisPartition(const std::vector<int>& partition, const std::string& path);
+    // Maps the file at path. Throws if it isn't a binary partition file
+    explicit PartitionFile(const std::string& path);
+
+    static bool IsBinary(const std::string& path);
+
+    Kind kind;
+    size_t num_points = 0, num_shards = 0;
+
+    // The shard of each point. Only for Kind::Partition
+    std::span<const int32_t> Assignment() const { return { assignment, kind == Kind::Partition ? num_points : 0 }; }
+
+    // The CSR lists. Only for Kind::Clusters and Kind::Cover
+    size_t NumLists() const { return num_lists; }
+    std::span<const uint32_t> List(size_t i) const { return { entries + offsets[i], entries + offsets[i + 1] }; }
+
+private:
+    std::shared_ptr<void> mapping;
+    size_t num_lists = 0;
+    const int32_t* assignment = nullptr;
+    const uint64_t* offsets = nullptr;
+    const uint32_t* entries = nullptr;
+};
+
+// The readers accept binary files of any kind and convert them if necessary (ReadPartition throws if the clusters overlap).
+// They also still read the old text formats.
+Partition ReadPartition(const std::string& path);
+
+void WritePartition(const Partition& partition, const std::string& path);
 
 Clusters ReadClusters(const std::string& path);
 
 void WriteClusters(const Clusters& clusters, const std::string& path);
 
+Cover ReadCover(const std::string& path);
+
+void WriteCover(const Cover& cover, const std::string& path);
+
+// The text format of METIS, one shard per line
+std::vector<int> ReadMetisPartition(const std::string& path);
+
+void WriteMetisPartition(const std::vector<int>& partition, const std::string& path);
+
 void WriteMetisGraph(const std::string& path, const AdjGraph& graph);
@@ -9,14 +9,14 @@
 
 #include <parlay/primitives.h>
 
-Partition RecursiveKMeansPartitioning(PointSet& points, size_t max_cluster_size, int depth = 0, int num_clusters = -1) {
+Partition RecursiveKMeansPartitioning(PointSet& points, size_t max_cluster_size, const KMeansConfig& config, int depth = 0, int num_clusters = -1) {
     if (num_clusters < 0) {
         num_clusters = static_cast<int>(ceil(double(points.n) / max_cluster_size));
     }
     if (num_clusters == 0) {
         return Partition(points.n, 0);
     }
-    PointSet centroids = RandomSample(points, num_clusters, 555);
+    PointSet centroids = InitialCentroids(points, num_clusters, 555, config);
 
     Timer timer;
     timer.Start();
@@ -24,7 +24,7 @@ Partition RecursiveKMeansPartitioning(PointSet& points, size_t max_cluster_size,
     // if (depth == 0) {
     //     partition = BalancedKMeans(points, centroids, max_cluster_size);
     // } else {
-    partition = KMeans(points, centroids);
+    partition = KMeans(points, centroids, config);
     //}
     std::cout << "k-means at depth " << depth << " took " << timer.Stop() << " s" << std::endl;
 
@@ -67,7 +67,7 @@ Partition RecursiveKMeansPartitioning(PointSet& points, size_t max_cluster_size,
             PointSet cluster_point_set = ExtractPointsInBucket(cluster, points);
 
             // Partition recursively
-            Partition sub_partition = RecursiveKMeansPartitioning(cluster_point_set, max_cluster_size, depth + 1);
+            Partition sub_partition = RecursiveKMeansPartitioning(cluster_point_set, max_cluster_size, config, depth + 1);
 
             // Translate partition IDs
             int max_sub_part_id = *std::max_element(sub_partition.begin(), sub_partition.end());
@@ -87,17 +87,17 @@ Partition RecursiveKMeansPartitioning(PointSet& points, size_t max_cluster_size,
     return partition;
 }
 
-Partition RebalancingKMeansPartitioning(PointSet& points, size_t max_cluster_size, int num_clusters = -1) {
+Partition RebalancingKMeansPartitioning(PointSet& points, size_t max_cluster_size, const KMeansConfig& config, int num_clusters = -1) {
     if (num_clusters < 0) {
         num_clusters = static_cast<int>(ceil(double(points.n) / max_cluster_size));
     }
     if (num_clusters == 0) {
         return Partition(points.n, 0);
     }
-    PointSet centroids = RandomSample(points, num_clusters, 555);
+    PointSet centroids = InitialCentroids(points, num_clusters, 555, config);
     Timer timer;
     timer.Start();
-    Partition partition = KMeans(points, centroids);
+    Partition partition = KMeans(points, centroids, config);
     std::cout << "k-means took " << timer.Stop() << " s" << std::endl;
 
     num_clusters = NumPartsInPartition(partition);
@@ -125,7 +125,7 @@ Partition RebalancingKMeansPartitioning(PointSet& points, size_t max_cluster_siz
             int target = -1;
             for (size_t j = 0; j < clusters.size(); ++j) {
                 if (clusters[j].size() < max_cluster_size) {
-                    if (float dist = distance(points.GetPoint(v), centroids.GetPoint(j), points.d); dist < min_dist) {
+                    if (float dist = DistanceToPoint(centroids.GetPoint(j), points, v); dist < min_dist) {
                         min_dist = dist;
                         target = j;
                     }
@@ -140,9 +140,9 @@ Partition RebalancingKMeansPartitioning(PointSet& points, size_t max_cluster_siz
     return partition;
 }
 
-Partition KMeansPartitioning(PointSet& points, int num_clusters, double epsilon) {
+Partition KMeansPartitioning(PointSet& points, int num_clusters, double epsilon, const KMeansConfig& config) {
     size_t max_cluster_size = points.n * (1 + epsilon) / num_clusters;
-    return RecursiveKMeansPartitioning(points, max_cluster_size, 0, num_clusters);
+    return RecursiveKMeansPartitioning(points, max_cluster_size, config, 0, num_clusters);
 }
 
 struct CSR {
@@ -263,101 +263,131 @@ Partition GraphPartitioning(PointSet& points, int num_clusters, double epsilon,
     return PartitionAdjListGraph(knn_graph, num_clusters, epsilon, std::min<int>(64, parlay::num_workers()), strong);
 }
 
-Partition PyramidPartitioning(PointSet& points, int num_clusters, double epsilon, const std::string& routing_index_path = "") {
-    Timer timer;
-    timer.Start();
+namespace {
+    // Uniform access to in-memory and streamed points for PyramidPartitioningImpl
+    template<typename F>
+    void ForEachChunk(PointSet& points, F&& f) {
+        f(points, size_t(0));
+    }
+
+    template<typename F>
+    void ForEachChunk(PointStream& points, F&& f) {
+        points.ForEachChunk(f);
+    }
+
+    PointSet ReadSubset(PointSet& points, const std::vector<uint32_t>& ids) { return ExtractPointsInBucket(ids, points); }
 
-    // Subsample points
-    size_t num_subsample_points = 10000000; // reasonable value. didn't make much difference
-    PointSet subsample_points = RandomSample(points, num_subsample_points, 555);
+    PointSet ReadSubset(PointStream& points, const std::vector<uint32_t>& ids) { return points.ReadSubset(ids); }
 
-    // Aggregate via k-means
-    const size_t num_aggregate_points = 10000; // from the paper
-    PointSet aggregate_points = RandomSample(subsample_points, num_aggregate_points, 555);
-    Partition subsample_partition = KMeans(subsample_points, aggregate_points);
+    template<typename Points>
+    Partition PyramidPartitioningImpl(Points& points, int num_clusters, double epsilon, const KMeansConfig& config, const std::string& routing_index_path) {
+        Timer timer;
+        timer.Start();
 
-    if (!routing_index_path.empty()) {
+        // Subsample points
+        size_t num_subsample_points = 10000000; // reasonable value. didn't make much difference
+        PointSet subsample_points = RandomSample(points, num_subsample_points, 555);
+
+        // Aggregate via k-means
+        const size_t num_aggregate_points = 10000; // from the paper
+        PointSet aggregate_points = InitialCentroids(subsample_points, num_aggregate_points, 555, config);
+        Partition subsample_partition = KMeans(subsample_points, aggregate_points, config);
+
+        if (!routing_index_path.empty()) {
 #ifdef MIPS_DISTANCE
-        using SpaceType = hnswlib::InnerProductSpace;
+            using SpaceType = hnswlib::InnerProductSpace;
 #else
-        using SpaceType = hnswlib::L2Space;
+            using SpaceType = hnswlib::L2Space;
 #endif
-        SpaceType space(points.d);
-        HNSWParameters hnsw_parameters;
-        hnswlib::HierarchicalNSW<float> hnsw(&space, aggregate_points.n, hnsw_parameters.M, hnsw_parameters.ef_construction, 555);
-        parlay::parallel_for(
-                0, aggregate_points.n, [&](size_t i) { hnsw.addPoint(aggregate_points.GetPoint(i), i); }, 512);
-        hnsw.saveIndex(routing_index_path);
-    }
+            SpaceType space(points.d);
+            HNSWParameters hnsw_parameters;
+            hnswlib::HierarchicalNSW<float> hnsw(&space, aggregate_points.n, hnsw_parameters.M, hnsw_parameters.ef_construction, 555);
+            parlay::parallel_for(
+                    0, aggregate_points.n, [&](size_t i) { hnsw.addPoint(aggregate_points.GetPoint(i), i); }, 512);
+            hnsw.saveIndex(routing_index_path);
+        }
 
-    // Build kNN graph
-    ApproximateKNNGraphBuilder graph_builder;
-    AdjGraph knn_graph = graph_builder.BuildApproximateNearestNeighborGraph(aggregate_points, 10);
-    Symmetrize(knn_graph);
-    CSR csr = ConvertAdjGraphToCSR(knn_graph);
-
-    // partition
-    Partition aggregate_partition = PartitionGraphWithKaMinPar(csr, num_clusters, epsilon, std::min<int>(32, parlay::num_workers()), false, true);
-    WriteMetisPartition(aggregate_partition, routing_index_path + ".routing_index_partition");
-
-    // Assign points to the partition of the closest point in the aggregate set
-    size_t max_points_in_cluster = points.n * (1 + epsilon) / num_clusters;
-    std::vector<size_t> num_points_in_cluster(num_clusters, 0);
-    Partition partition(points.n);
-
-    SpinLock unfinished_points_lock;
-    std::vector<uint32_t> unfinished_points;
-
-    size_t num_leaders = 1;
-    auto assign_point = [&](size_t i) {
-        auto closest_leaders_top_k = ClosestLeaders(points, aggregate_points, i, num_leaders);
-        auto closest_leaders = ConvertTopKToNNVec(closest_leaders_top_k);
-        for (const auto& [dist, leader_id] : closest_leaders) {
-            int part = aggregate_partition[leader_id];
-            if (num_points_in_cluster[part] < max_points_in_cluster) {
-                __atomic_fetch_add(&num_points_in_cluster[part], 1, __ATOMIC_RELAXED);
-                partition[i] = part;
-                return;
+        // Build kNN graph
+        ApproximateKNNGraphBuilder graph_builder;
+        AdjGraph knn_graph = graph_builder.BuildApproximateNearestNeighborGraph(aggregate_points, 10);
+        Symmetrize(knn_graph);
+        CSR csr = ConvertAdjGraphToCSR(knn_graph);
+
+        // partition
+        Partition aggregate_partition = PartitionGraphWithKaMinPar(csr, num_clusters, epsilon, std::min<int>(32, parlay::num_workers()), false, true);
+        WritePartition(aggregate_partition, routing_index_path + ".routing_index_partition");
+
+        // Assign points to the partition of the closest point in the aggregate set
+        size_t max_points_in_cluster = points.n * (1 + epsilon) / num_clusters;
+        std::vector<size_t> num_points_in_cluster(num_clusters, 0);
+        Partition partition(points.n);
+
+        SpinLock unfinished_points_lock;
+        std::vector<uint32_t> unfinished_points;
+
+        size_t num_leaders = 1;
+        // assigns point i, which is stored at position local_i of chunk
+        auto assign_point = [&](PointSet& chunk, size_t local_i, size_t i) {
+            auto closest_leaders_top_k = ClosestLeaders(chunk, aggregate_points, local_i, num_leaders);
+            auto closest_leaders = ConvertTopKToNNVec(closest_leaders_top_k);
+            for (const auto& [dist, leader_id] : closest_leaders) {
+                int part = aggregate_partition[leader_id];
+                if (num_points_in_cluster[part] < max_points_in_cluster) {
+                    __atomic_fetch_add(&num_points_in_cluster[part], 1, __ATOMIC_RELAXED);
+                    partition[i] = part;
+                    return;
+                }
             }
-        }
-        // haven't found a candidate here --> go again in another round
-        unfinished_points_lock.lock(); // the efficiency of this could be improved, but so far it doesn't matter much
-        unfinished_points.push_back(i);
-        unfinished_points_lock.unlock();
-    };
-
-    parlay::parallel_for(0, points.n, assign_point);
-    std::cout << "Main Pyramid assignment round finished. " << unfinished_points.size() << " still unassigned" << std::endl;
-
-    size_t num_extra_rounds = 0;
-    std::vector<uint32_t> frontier;
-    while (!unfinished_points.empty()) {
-        // now we have to remove the points in aggregated_points associated with overloaded blocks
-        std::vector<uint32_t> aggr_points_to_keep;
-        Partition new_aggr_partition;
-        for (uint32_t i = 0; i < aggregate_partition.size(); ++i) {
-            if (num_points_in_cluster[aggregate_partition[i]] < max_points_in_cluster) {
-                aggr_points_to_keep.push_back(i);
-                new_aggr_partition.push_back(aggregate_partition[i]);
+            // haven't found a candidate here --> go again in another round
+            unfinished_points_lock.lock(); // the efficiency of this could be improved, but so far it doesn't matter much
+            unfinished_points.push_back(i);
+            unfinished_points_lock.unlock();
+        };
+
+        ForEachChunk(points, [&](PointSet& chunk, size_t first) {
+            parlay::parallel_for(0, chunk.n, [&](size_t i) { assign_point(chunk, i, first + i); });
+        });
+        std::cout << "Main Pyramid assignment round finished. " << unfinished_points.size() << " still unassigned" << std::endl;
+
+        size_t num_extra_rounds = 0;
+        std::vector<uint32_t> frontier;
+        while (!unfinished_points.empty()) {
+            // now we have to remove the points in aggregated_points associated with overloaded blocks
+            std::vector<uint32_t> aggr_points_to_keep;
+            Partition new_aggr_partition;
+            for (uint32_t i = 0; i < aggregate_partition.size(); ++i) {
+                if (num_points_in_cluster[aggregate_partition[i]] < max_points_in_cluster) {
+                    aggr_points_to_keep.push_back(i);
+                    new_aggr_partition.push_back(aggregate_partition[i]);
+                }
             }
+            PointSet reduced_aggregate_points = ExtractPointsInBucket(aggr_points_to_keep, aggregate_points);
+            aggregate_partition = std::move(new_aggr_partition);
+            aggregate_points = std::move(reduced_aggregate_points);
+            frontier.clear();
+            std::swap(unfinished_points, frontier);
+            PointSet frontier_points = ReadSubset(points, frontier);
+            parlay::parallel_for(0, frontier.size(), [&](size_t i) { assign_point(frontier_points, i, frontier[i]); });
+            std::cout << "Extra Pyramid assignment round " << ++num_extra_rounds << " finished. " << unfinished_points.size() << " still unassigned" << std::endl;
         }
-        PointSet reduced_aggregate_points = ExtractPointsInBucket(aggr_points_to_keep, aggregate_points);
-        aggregate_partition = std::move(new_aggr_partition);
-        aggregate_points = std::move(reduced_aggregate_points);
-        frontier.clear();
-        std::swap(unfinished_points, frontier);
-        parlay::parallel_for(0, frontier.size(), [&](size_t i) { assign_point(frontier[i]); });
-        std::cout << "Extra Pyramid assignment round " << ++num_extra_rounds << " finished. " << unfinished_points.size() << " still unassigned" << std::endl;
+
+        std::cout << "Pyramid partitioning took " << timer.Stop() << " seconds" << std::endl;
+
+        return partition;
     }
+} // namespace
 
-    std::cout << "Pyramid partitioning took " << timer.Stop() << " seconds" << std::endl;
+Partition PyramidPartitioning(PointSet& points, int num_clusters, double epsilon, const KMeansConfig& config, const std::string& routing_index_path = "") {
+    return PyramidPartitioningImpl(points, num_clusters, epsilon, config, routing_index_path);
+}
 
-    return partition;
+Partition PyramidPartitioning(PointStream& points, int num_clusters, double epsilon, const KMeansConfig& config, const std::string& routing_index_path = "") {
+    return PyramidPartitioningImpl(points, num_clusters, epsilon, config, routing_index_path);
 }
 
 // want to extract only the leaf-level points here
 // and the mapping of top-level points to leaf-level points
-std::pair<Partition, PointSet> HierarchicalKMeansParlayImpl(PointSet& points, double coarsening_ratio, int depth = 0) {
+std::pair<Partition, PointSet> HierarchicalKMeansParlayImpl(PointSet& points, double coarsening_ratio, const KMeansConfig& config, int depth = 0) {
     int num_level_centroids = points.n * coarsening_ratio;
     if (num_level_centroids < 1) {
         num_level_centroids = 1;
@@ -371,8 +401,8 @@ std::pair<Partition, PointSet> HierarchicalKMeansParlayImpl(PointSet& points, do
 
     Timer timer;
     timer.Start();
-    PointSet level_centroids = RandomSample(points, num_level_centroids, 555);
-    Partition level_partition = KMeans(points, level_centroids);
+    PointSet level_centroids = InitialCentroids(points, num_level_centroids, 555, config);
+    Partition level_partition = KMeans(points, level_centroids, config);
     double t = timer.Stop();
     if (depth < 2) {
         std::cout << "KMeans on " << points.n << " points at depth " << depth << " with " << level_centroids.n << " / " << num_level_centroids
@@ -395,7 +425,7 @@ std::pair<Partition, PointSet> HierarchicalKMeansParlayImpl(PointSet& points, do
             clusters,
             [&](const auto& cluster) {
                 PointSet cluster_points = ExtractPointsInBucket(cluster, points);
-                return HierarchicalKMeansParlayImpl(cluster_points, coarsening_ratio, depth + 1);
+                return HierarchicalKMeansParlayImpl(cluster_points, coarsening_ratio, config, depth + 1);
             },
             depth < 2 ? clusters.size() : 1);
 
@@ -430,7 +460,7 @@ std::pair<Partition, PointSet> HierarchicalKMeansParlayImpl(PointSet& points, do
     return std::make_pair(level_partition, centroids_from_recursion);
 }
 
-std::pair<Partition, PointSet> HierarchicalKMeans(PointSet& points, double coarsening_ratio, int depth = 0) {
+std::pair<Partition, PointSet> HierarchicalKMeans(PointSet& points, double coarsening_ratio, const KMeansConfig& config, int depth = 0) {
     int num_level_centroids = points.n * coarsening_ratio;
     if (num_level_centroids < 1) {
         num_level_centroids = 1;
@@ -444,8 +474,8 @@ std::pair<Partition, PointSet> HierarchicalKMeans(PointSet& points, double coars
 
     Timer timer;
     timer.Start();
-    PointSet level_centroids = RandomSample(points, num_level_centroids, 555);
-    Partition level_partition = KMeans(points, level_centroids);
+    PointSet level_centroids = InitialCentroids(points, num_level_centroids, 555, config);
+    Partition level_partition = KMeans(points, level_centroids, config);
     double t = timer.Stop();
     if (depth < 2) {
         std::cout << "KMeans on " << points.n << " points at depth " << depth << " with " << level_centroids.n << " / " << num_level_centroids
@@ -471,7 +501,7 @@ std::pair<Partition, PointSet> HierarchicalKMeans(PointSet& points, double coars
                 if (clusters[i].empty())
                     throw std::runtime_error("Cluster points empty. KMeans should remove empty cluster IDs");
                 PointSet cluster_points = ExtractPointsInBucket(clusters[i], points);
-                recursion_results[i] = HierarchicalKMeans(cluster_points, coarsening_ratio, depth + 1);
+                recursion_results[i] = HierarchicalKMeans(cluster_points, coarsening_ratio, config, depth + 1);
             },
             depth < 1 ? clusters.size() / 8 : 1);
 
@@ -506,11 +536,12 @@ std::pair<Partition, PointSet> HierarchicalKMeans(PointSet& points, double coars
     return std::make_pair(level_partition, centroids_from_recursion);
 }
 
-Partition OurPyramidPartitioning(PointSet& points, int num_clusters, double epsilon, const std::string& routing_index_path, double coarsening_rate = 0.002) {
+Partition OurPyramidPartitioning(PointSet& points, int num_clusters, double epsilon, const KMeansConfig& config, const std::string& routing_index_path,
+                                 double coarsening_rate = 0.002) {
     std::cout << "Call OurPyramid with coarsening rate " << coarsening_rate << std::endl;
     Timer timer;
     timer.Start();
-    auto [routing_clusters, routing_points] = HierarchicalKMeans(points, coarsening_rate);
+    auto [routing_clusters, routing_points] = HierarchicalKMeans(points, coarsening_rate, config);
     std::cout << "HierKMeans took " << timer.Restart() << std::endl;
 
     std::cout << "routing_clusters.size() = " << routing_clusters.size() << " num routing clusters = " << NumPartsInPartition(routing_clusters)
@@ -540,7 +571,7 @@ Partition OurPyramidPartitioning(PointSet& points, int num_clusters, double epsi
 
     Partition knn_partition = PartitionGraphWithKaMinPar(knn_csr, num_clusters, epsilon, std::min<int>(32, parlay::num_workers()), false, true);
 
-    WriteMetisPartition(knn_partition, routing_index_path + ".knn.routing_index_partition");
+    WritePartition(knn_partition, routing_index_path + ".knn.routing_index_partition");
 
     // Project from coarse partition
     Partition full_knn_partition(points.n);
@@ -0,0 +1,72 @@
+#include "point_stream.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <parlay/parallel.h>
+
+#include "points_io.h"
+
+namespace {
+    constexpr size_t HEADER_BYTES = 2 * sizeof(uint32_t);
+}
+
+PointStream::PointStream(const std::string& path, size_t chunk_bytes) : path(path) {
+    element_type = FileElementType(path);
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Can't open " + path + ": " + std::strerror(errno));
+    }
+    uint32_t header[2];
+    if (pread(fd, header, sizeof(header), 0) != ssize_t(sizeof(header))) {
+        close(fd);
+        throw std::runtime_error("Can't read the header of " + path);
+    }
+    n = header[0];
+    d = header[1];
+    chunk_size = std::max<size_t>(1, chunk_bytes / (d * ElementSize(element_type)));
+    std::cout << "Streaming " << n << " " << d << " in chunks of " << chunk_size << " points" << std::endl;
+}
+
+PointStream::~PointStream() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void PointStream::ReadRange(size_t first, size_t count, uint8_t* out) const {
+    const size_t point_bytes = d * ElementSize(element_type);
+    size_t offset = HEADER_BYTES + first * point_bytes;
+    size_t remaining = count * point_bytes;
+    while (remaining > 0) {
+        ssize_t bytes = pread(fd, out, remaining, offset);
+        if (bytes <= 0) {
+            if (bytes < 0 && errno == EINTR) continue;
+            throw std::runtime_error("Reading points from " + path + " failed: " + (bytes == 0 ? "unexpected end of file" : std::strerror(errno)));
+        }
+        out += bytes;
+        offset += bytes;
+        remaining -= bytes;
+    }
+}
+
+PointSet PointStream::ReadChunk(size_t first) const {
+    PointSet chunk;
+    chunk.n = std::min(chunk_size, n - first);
+    chunk.d = d;
+    chunk.element_type = element_type;
+    chunk.Alloc();
+    uint8_t* out = chunk.IsCompact() ? chunk.compact_coordinates.data() : reinterpret_cast<uint8_t*>(chunk.coordinates.data());
+    ReadRange(first, chunk.n, out);
+    return chunk;
+}
+
+PointSet PointStream::ReadSubset(const std::vector<uint32_t>& ids) const {
+    return ReadPointsSubset(path, ids, element_type);
+}
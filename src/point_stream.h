@@ -0,0 +1,51 @@
+#pragma once
+
+#include <future>
+#include <string>
+
+#include "defs.h"
+
+// Sequential, bounded-memory access to a point file (.fbin / .u8bin / .i8bin) that can be larger than RAM.
+// The points are read in chunks. While the caller works on one chunk, the next one is read in the background,
+// so at most two chunks are in memory at any time. Chunks of .u8bin / .i8bin files keep their 8-bit element type.
+class PointStream {
+public:
+    static constexpr size_t DEFAULT_CHUNK_BYTES = 256UL << 20;
+
+    explicit PointStream(const std::string& path, size_t chunk_bytes = DEFAULT_CHUNK_BYTES);
+    ~PointStream();
+    PointStream(const PointStream&) = delete;
+    PointStream& operator=(const PointStream&) = delete;
+
+    size_t n = 0, d = 0;
+    ElementType element_type = ElementType::Float32;
+    size_t chunk_size = 0;      // in points
+
+    // Calls f(chunk, first) for all chunks in order, where chunk holds the points [first, first + chunk.n)
+    template<typename F>
+    void ForEachChunk(F&& f) {
+        if (n == 0) {
+            return;
+        }
+        std::future<PointSet> next = std::async(std::launch::async, [this] { return ReadChunk(0); });
+        for (size_t first = 0; first < n; first += chunk_size) {
+            PointSet chunk = next.get();
+            if (first + chunk_size < n) {
+                next = std::async(std::launch::async, [this, first] { return ReadChunk(first + chunk_size); });
+            }
+            f(chunk, first);
+        }
+    }
+
+    // The points [first, min(n, first + chunk_size))
+    PointSet ReadChunk(size_t first) const;
+
+    // The points with the given ids, in the order of ids. See ReadPointsSubset
+    PointSet ReadSubset(const std::vector<uint32_t>& ids) const;
+
+private:
+    void ReadRange(size_t first, size_t count, uint8_t* out) const;
+
+    std::string path;
+    int fd = -1;
+};
@@ -1,17 +1,66 @@
 #include "points_io.h"
 
+#include <algorithm>
+#include <cerrno>
 #include <cstdint>
+#include <cstring>
 #include <fstream>
+#include <numeric>
+#include <type_traits>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bulk_reader.h"
 #include "defs.h"
+#include "half_float.h"
 
 #include <parlay/parallel.h>
-
-size_t ComputeChunkSize(size_t a, size_t b) { return (a + b - 1) / b; }
+#include <parlay/primitives.h>
 
 namespace internal {
+    // Coalescing of ReadPointsSubset: ids are read together if the gap between them is at most MAX_GAP_BYTES,
+    // as long as the read stays below MAX_RUN_BYTES
+    constexpr size_t MAX_GAP_BYTES = 256UL << 10;
+    constexpr size_t MAX_RUN_BYTES = 16UL << 20;
+
+    void ReadFully(int fd, uint8_t* out, size_t bytes, size_t offset, const std::string& path) {
+        while (bytes > 0) {
+            ssize_t got = pread(fd, out, bytes, offset);
+            if (got <= 0) {
+                if (got < 0 && errno == EINTR) continue;
+                throw std::runtime_error("Reading points from " + path + " failed: " + (got == 0 ? "unexpected end of file" : std::strerror(errno)));
+            }
+            out += got;
+            offset += got;
+            bytes -= got;
+        }
+    }
+
+    // Throws if storage is not a valid storage type for points of file_type (see ReadPoints)
+    void CheckStorage(ElementType file_type, ElementType storage, const std::string& path) {
+        const bool half_storage = storage == ElementType::Float16 || storage == ElementType::BFloat16;
+        if (storage != ElementType::Float32 && storage != file_type && !half_storage) {
+            throw std::runtime_error("Can't store points of type " + ElementTypeName(file_type) + " from " + path + " as " + ElementTypeName(storage));
+        }
+    }
+
+    // Converts count floats to the 16-bit storage type of points, starting at coordinate begin
+    void StoreAsHalf(PointSet& points, size_t begin, const float* values, size_t count) {
+        if (points.element_type == ElementType::Float16) {
+            Float16* out = reinterpret_cast<Float16*>(points.compact_coordinates.data()) + begin;
+            for (size_t j = 0; j < count; ++j) out[j] = ToFloat16(values[j]);
+        } else {
+            BFloat16* out = reinterpret_cast<BFloat16*>(points.compact_coordinates.data()) + begin;
+            for (size_t j = 0; j < count; ++j) out[j] = ToBFloat16(values[j]);
+        }
+    }
 
-    PointSet ReadPoints(const std::string& path, int64_t size) {
+    // storage is Float32 or one of the 16-bit float types. The latter are converted chunk by chunk, so the float version
+    // of the whole set is never in memory.
+    PointSet ReadPoints(const std::string& path, int64_t size, ElementType storage) {
         uint32_t n, d;
         size_t offset = 0;
         {
@@ -31,37 +80,34 @@ namespace internal {
         PointSet points;
         points.n = n;
         points.d = d;
+        points.element_type = storage;
 
         Timer timer;
         timer.Start();
 
-        points.coordinates.resize(points.n * points.d);
+        points.Alloc();
 
         std::cout << "alloc + touch done. Took " << timer.Restart() << std::endl;
 
-        size_t num_chunks = parlay::num_workers();
-        size_t chunk_size = ComputeChunkSize(points.coordinates.size(), num_chunks);
-        parlay::parallel_for(
-                0, num_chunks,
-                [&](size_t i) {
-                    std::ifstream in(path, std::ios::binary);
-                    size_t begin = i * chunk_size;
-                    size_t end = std::min(points.coordinates.size(), (i + 1) * chunk_size);
-
-                    in.seekg(offset + begin * sizeof(float));
-
-                    in.read(reinterpret_cast<char*>(&points.coordinates[begin]), (end - begin) * sizeof(float));
-                },
-                1);
-
+        // the 16-bit types are converted block by block as the reads complete
+        const size_t num_coordinates = points.n * points.d;
+        BulkRead(path, offset, offset + num_coordinates * sizeof(float), [&](size_t file_offset, const uint8_t* data, size_t bytes) {
+            const size_t begin = (file_offset - offset) / sizeof(float);
+            if (!points.IsCompact()) {
+                std::memcpy(&points.coordinates[begin], data, bytes);
+            } else {
+                StoreAsHalf(points, begin, reinterpret_cast<const float*>(data), bytes / sizeof(float));
+            }
+        });
 
         std::cout << "Read took " << timer.Stop() << std::endl;
 
         return points;
     }
 
+    // With keep_element_type the coordinates are stored as they are in the file instead of being expanded to float
     template<typename CoordinateType>
-    PointSet ReadBytes(const std::string& path) {
+    PointSet ReadBytes(const std::string& path, bool keep_element_type) {
         uint32_t n, d;
         size_t offset = 0;
         {
@@ -77,33 +123,29 @@ namespace internal {
         PointSet points;
         points.n = n;
         points.d = d;
+        if (keep_element_type) {
+            points.element_type = std::is_signed_v<CoordinateType> ? ElementType::Int8 : ElementType::UInt8;
+        }
 
         Timer timer;
         timer.Start();
 
-        points.coordinates.resize(points.n * points.d);
+        points.Alloc();
 
         std::cout << "alloc + touch done. Took " << timer.Restart() << std::endl;
 
-        size_t num_chunks = parlay::num_workers();
-        size_t chunk_size = ComputeChunkSize(points.coordinates.size(), num_chunks);
-        parlay::parallel_for(
-                0, num_chunks,
-                [&](size_t i) {
-                    std::ifstream in(path, std::ios::binary);
-                    size_t begin = i * chunk_size;
-                    size_t end = std::min(points.coordinates.size(), (i + 1) * chunk_size);
-
-                    in.seekg(offset + begin * sizeof(CoordinateType));
-
-                    std::vector<CoordinateType> buffer(end - begin);
-                    in.read(reinterpret_cast<char*>(&buffer[0]), (end - begin) * sizeof(CoordinateType));
-                    for (size_t i = 0; i < buffer.size(); ++i) {
-                        points.coordinates[begin++] = static_cast<float>(buffer[i]);
-                    }
-                },
-                1);
-
+        const size_t num_coordinates = points.n * points.d;
+        BulkRead(path, offset, offset + num_coordinates * sizeof(CoordinateType), [&](size_t file_offset, const uint8_t* data, size_t bytes) {
+            const size_t begin = (file_offset - offset) / sizeof(CoordinateType);
+            if (keep_element_type) {
+                std::memcpy(&points.compact_coordinates[begin], data, bytes);
+                return;
+            }
+            const CoordinateType* values = reinterpret_cast<const CoordinateType*>(data);
+            for (size_t j = 0; j < bytes / sizeof(CoordinateType); ++j) {
+                points.coordinates[begin + j] = static_cast<float>(values[j]);
+            }
+        });
 
         std::cout << "Read took " << timer.Stop() << std::endl;
 
@@ -111,24 +153,221 @@ namespace internal {
     }
 } // namespace internal
 
-PointSet ReadPoints(const std::string& path, int64_t size) {
+PointSet MapPoints(const std::string& path, int64_t size, MappingOptions options) {
+    const ElementType file_type = FileElementType(path);
+    Timer timer;
+    timer.Start();
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Can't open " + path + ": " + std::strerror(errno));
+    }
+    uint32_t header[2];
+    struct stat file_stat;
+    if (pread(fd, header, sizeof(header), 0) != ssize_t(sizeof(header)) || fstat(fd, &file_stat) != 0) {
+        close(fd);
+        throw std::runtime_error("Can't read the header of " + path);
+    }
+    const size_t file_size = file_stat.st_size;
+
+    PointSet points;
+    points.n = size != -1 ? size_t(size) : header[0];
+    points.d = header[1];
+    points.element_type = file_type;
+    std::cout << points.n << " " << points.d << std::endl;
+    const size_t num_coordinates = points.n * points.d;
+    if (sizeof(header) + num_coordinates * ElementSize(file_type) > file_size) {
+        close(fd);
+        throw std::runtime_error("Point file " + path + " is too small for " + std::to_string(points.n) + " points");
+    }
+
+    // PROT_WRITE + MAP_PRIVATE makes writes copy-on-write. MAP_NORESERVE, since we don't expect to write the whole file
+    const int flags = MAP_PRIVATE | MAP_NORESERVE | (options.populate ? MAP_POPULATE : 0);
+    void* base = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    close(fd);      // the mapping keeps the file open
+    if (base == MAP_FAILED) {
+        throw std::runtime_error("Can't map " + path + ": " + std::strerror(errno));
+    }
+
+    int advice = MADV_NORMAL;
+    switch (options.advice) {
+        case MappingOptions::Advice::Sequential: advice = MADV_SEQUENTIAL; break;
+        case MappingOptions::Advice::Random: advice = MADV_RANDOM; break;
+        case MappingOptions::Advice::WillNeed: advice = MADV_WILLNEED; break;
+        default: break;
+    }
+    if (advice != MADV_NORMAL && madvise(base, file_size, advice) != 0) {
+        std::cerr << "madvise on " << path << " failed: " << std::strerror(errno) << std::endl;
+    }
+
+    std::shared_ptr<void> mapping(base, [file_size](void* p) { munmap(p, file_size); });
+    uint8_t* data = static_cast<uint8_t*>(base) + sizeof(header);
+    if (file_type == ElementType::Float32) {
+        points.coordinates.Map(std::move(mapping), reinterpret_cast<float*>(data), num_coordinates);
+    } else {
+        points.compact_coordinates.Map(std::move(mapping), data, num_coordinates);
+    }
+    std::cout << "Mapping took " << timer.Stop() << std::endl;
+    return points;
+}
+
+ElementType FileElementType(const std::string& path) {
     if (path.ends_with(".fbin")) {
-        return internal::ReadPoints(path, size);
+        return ElementType::Float32;
     } else if (path.ends_with(".u8bin")) {
-        return internal::ReadBytes<uint8_t>(path);
+        return ElementType::UInt8;
     } else if (path.ends_with(".i8bin")) {
-        return internal::ReadBytes<int8_t>(path);
+        return ElementType::Int8;
     } else {
         throw std::runtime_error("Invalid file ending for the pointset path. Valid options are [.fbin, .u8bin, .i8bin]");
     }
 }
 
+PointSet ReadPoints(const std::string& path, int64_t size, ElementType storage) {
+    const ElementType file_type = FileElementType(path);
+    internal::CheckStorage(file_type, storage, path);
+    const bool half_storage = storage == ElementType::Float16 || storage == ElementType::BFloat16;
+    if (half_storage && file_type != ElementType::Float32) {
+        // 8-bit values are exact in both 16-bit types, but take twice the memory of the native storage
+        PointSet points = ReadPoints(path, size, ElementType::Float32);
+        points.ConvertFromFloat(storage);
+        return points;
+    }
+    const bool keep_element_type = storage != ElementType::Float32;
+    switch (file_type) {
+        case ElementType::UInt8: return internal::ReadBytes<uint8_t>(path, keep_element_type);
+        case ElementType::Int8: return internal::ReadBytes<int8_t>(path, keep_element_type);
+        default: return internal::ReadPoints(path, size, storage);
+    }
+}
+
+PointSet ReadPointsSubset(const std::string& path, const std::vector<uint32_t>& ids, ElementType storage) {
+    const ElementType file_type = FileElementType(path);
+    internal::CheckStorage(file_type, storage, path);
+    Timer timer;
+    timer.Start();
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Can't open " + path + ": " + std::strerror(errno));
+    }
+    uint32_t header[2];
+    if (pread(fd, header, sizeof(header), 0) != ssize_t(sizeof(header))) {
+        close(fd);
+        throw std::runtime_error("Can't read the header of " + path);
+    }
+
+    // read in the element type of the file, and convert at the end
+    PointSet subset;
+    subset.n = ids.size();
+    subset.d = header[1];
+    subset.element_type = file_type;
+    subset.Alloc();
+    const size_t point_bytes = subset.d * ElementSize(file_type);
+    uint8_t* out = subset.IsCompact() ? subset.compact_coordinates.data() : reinterpret_cast<uint8_t*>(subset.coordinates.data());
+
+    // positions in ids, sorted by id
+    auto order = parlay::tabulate(ids.size(), [](size_t i) { return uint32_t(i); });
+    parlay::sort_inplace(order, [&](uint32_t l, uint32_t r) { return ids[l] < ids[r]; });
+    if (!ids.empty() && ids[order.back()] >= header[0]) {
+        close(fd);
+        throw std::runtime_error("Point " + std::to_string(ids[order.back()]) + " is out of range for " + path + " with " + std::to_string(header[0]) + " points");
+    }
+
+    // runs [run_starts[r], run_starts[r + 1]) of positions in order
+    std::vector<size_t> run_starts;
+    for (size_t i = 0; i < order.size(); ++i) {
+        if (i == 0 || size_t(ids[order[i]] - ids[order[i - 1]]) * point_bytes > internal::MAX_GAP_BYTES + point_bytes ||
+            size_t(ids[order[i]] - ids[order[run_starts.back()]] + 1) * point_bytes > internal::MAX_RUN_BYTES) {
+            run_starts.push_back(i);
+        }
+    }
+    run_starts.push_back(order.size());
+    const size_t num_runs = run_starts.size() - 1;
+
+    size_t total_bytes = 0;
+    try {
+        parlay::parallel_for(0, num_runs, [&](size_t r) {
+            const uint32_t first = ids[order[run_starts[r]]];
+            const uint32_t last = ids[order[run_starts[r + 1] - 1]];
+            const size_t bytes = size_t(last - first + 1) * point_bytes;
+            std::vector<uint8_t> buffer(bytes);
+            internal::ReadFully(fd, buffer.data(), bytes, sizeof(header) + size_t(first) * point_bytes, path);
+            for (size_t i = run_starts[r]; i < run_starts[r + 1]; ++i) {
+                std::memcpy(out + size_t(order[i]) * point_bytes, buffer.data() + size_t(ids[order[i]] - first) * point_bytes, point_bytes);
+            }
+            __atomic_fetch_add(&total_bytes, bytes, __ATOMIC_RELAXED);
+        }, 1);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    std::cout << "Read " << ids.size() << " points in " << num_runs << " reads of " << double(total_bytes) / (1UL << 20) << " MB in total. Took "
+              << timer.Stop() << std::endl;
+
+    if (storage != file_type) {
+        subset.ConvertToFloat();
+        if (storage != ElementType::Float32) {
+            subset.ConvertFromFloat(storage);
+        }
+    }
+    return subset;
+}
+
+ElementType ParseStorageType(const std::string& name, const std::string& path) {
+    if (name == "float32") {
+        return ElementType::Float32;
+    } else if (name == "fp16") {
+        return ElementType::Float16;
+    } else if (name == "bf16") {
+        return ElementType::BFloat16;
+    } else if (name == "native" || name == "mmap" || name == "mmap-populate") {
+        return FileElementType(path);
+    } else {
+        throw std::runtime_error("Unknown point storage " + name + ". Valid options are [float32, fp16, bf16, native, mmap, mmap-populate]");
+    }
+}
+
+PointSet ReadPointsWithStorage(const std::string& path, const std::string& storage_name) {
+    if (storage_name == "mmap" || storage_name == "mmap-populate") {
+        return MapPoints(path, -1, MappingOptions{ .populate = storage_name == "mmap-populate" });
+    }
+    return ReadPoints(path, -1, ParseStorageType(storage_name, path));
+}
+
+std::string TakeStorageFlag(std::vector<std::string>& args, const std::string& default_value) {
+    const std::string prefix = "--storage=";
+    std::string value = default_value;
+    for (auto it = args.begin(); it != args.end();) {
+        if (it->starts_with(prefix)) {
+            value = it->substr(prefix.size());
+            it = args.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return value;
+}
+
 void WritePoints(PointSet& points, const std::string& path) {
     std::ofstream out(path, std::ios::binary);
     uint32_t n = points.n, d = points.d;
     std::cout << n << " " << d << std::endl;
     out.write(reinterpret_cast<const char*>(&n), sizeof(uint32_t));
     out.write(reinterpret_cast<const char*>(&d), sizeof(uint32_t));
+    if (points.element_type == ElementType::Float16 || points.element_type == ElementType::BFloat16) {
+        // there is no file format for the 16-bit types, so they are written as .fbin
+        std::vector<float> buffer(points.d);
+        for (size_t i = 0; i < points.n; ++i) {
+            points.CopyPointAsFloat(i, buffer.data());
+            out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size() * sizeof(float));
+        }
+        return;
+    }
+    if (points.IsCompact()) {
+        // the caller has to pick the file ending that matches points.element_type
+        out.write(reinterpret_cast<const char*>(points.compact_coordinates.data()), points.compact_coordinates.size());
+        return;
+    }
     out.write(reinterpret_cast<const char*>(&points.coordinates[0]), points.coordinates.size() * sizeof(float));
 }
 
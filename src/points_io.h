@@ -2,7 +2,41 @@
 
 #include "defs.h"
 
-PointSet ReadPoints(const std::string& path, int64_t size = -1);
+// storage selects the element type the points are kept in. Float32 converts any file to float. The 8-bit types keep
+// .u8bin / .i8bin files in their original form, which is 4x smaller (see ElementType). The 16-bit float types
+// can be used for any file, the coordinates are rounded to nearest even while reading.
+PointSet ReadPoints(const std::string& path, int64_t size = -1, ElementType storage = ElementType::Float32);
+
+// How MapPoints maps a point file
+struct MappingOptions {
+    // Fault in the whole file right away (MAP_POPULATE) instead of page by page on first access
+    bool populate = false;
+    // The access pattern passed to madvise
+    enum class Advice { Normal, Sequential, Random, WillNeed } advice = Advice::Normal;
+};
+
+// Maps the point file at path into memory instead of reading it. The PointSet points straight into the file in its own element type,
+// so this takes no time and memory up front, and processes on the same host share the pages through the page cache.
+// The mapping is private, i.e., modifying the points never changes the file.
+PointSet MapPoints(const std::string& path, int64_t size = -1, MappingOptions options = {});
+
+// The element type of a point file, determined from its file ending
+ElementType FileElementType(const std::string& path);
+
+// The storage options of the command line tools: float32, fp16, bf16, native (the element type of the file at path)
+// or mmap / mmap-populate (MapPoints, so the element type of the file as well)
+ElementType ParseStorageType(const std::string& name, const std::string& path);
+
+// The points with the given ids (in the order of ids, duplicates allowed), without reading the whole file. The ids are sorted and
+// nearby ones are coalesced into large reads, which run in parallel. Gaps of up to a few hundred KB are read and thrown away,
+// which is cheaper than a separate request. storage works as for ReadPoints
+PointSet ReadPointsSubset(const std::string& path, const std::vector<uint32_t>& ids, ElementType storage = ElementType::Float32);
+
+// ReadPoints, or MapPoints for the mmap storage options
+PointSet ReadPointsWithStorage(const std::string& path, const std::string& storage_name);
+
+// Removes a --storage=<option> flag from the command line arguments and returns the option, or default_value if there is none
+std::string TakeStorageFlag(std::vector<std::string>& args, const std::string& default_value);
 
 void WritePoints(PointSet& points, const std::string& path);
 
@@ -2,42 +2,25 @@
 
 #include "defs.h"
 #include "dist.h"
+#include "distance_matrix.h"
 #include "topn.h"
 #include <sstream>
 #include <iostream>
 #include <parlay/parallel.h>
 
+std::vector<NNVec> ComputeGroundTruth(PointSet& points, PointSet& queries, int k) {
+    return ExactNearestNeighbors(points, queries, k);
+}
+
 std::vector<float> ComputeDistanceToKthNeighbor(PointSet& points, PointSet& queries, int k) {
+    std::vector<NNVec> ground_truth = ComputeGroundTruth(points, queries, k);
     std::vector<float> d(queries.n);
-    parlay::parallel_for(0, queries.n, [&](size_t i) {
-        TopN top_k(k);
-        float* Q = queries.GetPoint(i);
-        for (uint32_t j = 0; j < points.n; ++j) {
-            float* P = points.GetPoint(j);
-            float dist = distance(P, Q, points.d);
-            top_k.Add(std::make_pair(dist, j));
-        }
-        d[i] = top_k.Top().first;
-    }, 1);
+    for (size_t i = 0; i < queries.n; ++i) {
+        d[i] = ground_truth[i].back().first;
+    }
     return d;
 }
 
-std::vector<NNVec> ComputeGroundTruth(PointSet& points, PointSet& queries, int k) {
-    std::vector<NNVec> res(queries.n);
-    parlay::parallel_for(0, queries.n, [&](size_t i) {
-        TopN top_k(k);
-        float* Q = queries.GetPoint(i);
-        for (uint32_t j = 0; j < points.n; ++j) {
-            float* P = points.GetPoint(j);
-            float dist = distance(P, Q, points.d);
-            top_k.Add(std::make_pair(dist, j));
-        }
-        res[i] = top_k.Take();
-        std::sort(res[i].begin(), res[i].end());    // should be = std::reverse
-    }, 1);
-    return res;
-}
-
 void OracleRecall(const std::vector<NNVec>& ground_truth, const std::vector<int>& partition, int num_neighbors) {
     int num_shards = NumPartsInPartition(partition);
     std::vector<size_t> hits(num_shards, 0);
@@ -101,7 +84,7 @@ std::vector<float> ConvertGroundTruthToDistanceToKthNeighbor(std::vector<NNVec>&
         for (int j = 0; j < k; ++j) {
             uint32_t point_id = neighs[j].second;
             float dist = neighs[j].first;
-            float true_dist = distance(points.GetPoint(point_id), Q, points.d);
+            float true_dist = DistanceToPoint(Q, points, point_id);
             if (std::abs(dist - true_dist) > 1e-8) {
                 local_distance_mismatches++;
             }
@@ -118,7 +118,10 @@ void MaxRoutingRecall(const std::vector<RoutingConfig>& routes, const std::vecto
 // TODO pick Pareto configs for variable index size.
 // Pareto configs with index size = 5M; variable ef_search
 
-void PrintCombinationsOfRoutesAndSearches(const std::vector<RoutingConfig>& routes, const std::vector<ShardSearch>& shard_searches,
+namespace {
+// for_each_search hands out the shard searches one at a time, so that they don't all have to be in memory
+void PrintCombinationsOfRoutesAndSearchesImpl(const std::vector<RoutingConfig>& routes,
+    const std::function<void(const std::function<void(const ShardSearch&)>&)>& for_each_search,
     const std::string& output_file, int num_neighbors, int num_queries, int num_shards, int num_requested_shards, const std::string& part_method) {
 
     // std::ofstream out(output_file);
@@ -137,8 +140,8 @@ void PrintCombinationsOfRoutesAndSearches(const std::vector<RoutingConfig>& rout
 
     std::vector<Desc> outputs;
 
-    for (const auto& route : routes) {
-        for (const auto& search : shard_searches) {
+    for_each_search([&](const ShardSearch& search) {
+        for (const auto& route : routes) {
             std::function<void(EmitResult)> format_output = [&](const EmitResult& r) -> void {
                 double recall = static_cast<double>(r.total_hits) / static_cast<double>(num_neighbors * num_queries);
 
@@ -164,7 +167,7 @@ void PrintCombinationsOfRoutesAndSearches(const std::vector<RoutingConfig>& rout
                         double QPS_per_host = QPS / num_hosts;
 
                         std::stringstream str;
-                        str << part_method << ",HNSW," << route.routing_algorithm << "," << route.index_trainer << ","
+                        str << part_method << "," << search.shard_query << "," << route.routing_algorithm << "," << route.index_trainer << ","
                             << search.ef_search << "," << route.hnsw_num_voting_neighbors
                             << "," << route.routing_time / num_queries
                             << "," << r.n_probes << "," << recall << "," << QPS << "," << QPS_per_host
@@ -188,7 +191,7 @@ void PrintCombinationsOfRoutesAndSearches(const std::vector<RoutingConfig>& rout
                 AttributeRecallAndQueryTimeVariableNumProbes(route, search, num_queries, num_shards, num_neighbors, format_output);
             }
         }
-    }
+    });
 
     std::vector<Desc> pareto;
 
@@ -224,3 +227,18 @@ void PrintCombinationsOfRoutesAndSearches(const std::vector<RoutingConfig>& rout
         // std::cout << c.format_string;
     }
 }
+} // namespace
+
+void PrintCombinationsOfRoutesAndSearches(const std::vector<RoutingConfig>& routes, const std::vector<ShardSearch>& shard_searches,
+    const std::string& output_file, int num_neighbors, int num_queries, int num_shards, int num_requested_shards, const std::string& part_method) {
+    PrintCombinationsOfRoutesAndSearchesImpl(routes, [&](const std::function<void(const ShardSearch&)>& f) {
+        for (const auto& search : shard_searches) f(search);
+    }, output_file, num_neighbors, num_queries, num_shards, num_requested_shards, part_method);
+}
+
+void PrintCombinationsOfRoutesAndSearches(const std::vector<RoutingConfig>& routes, const std::string& searches_file,
+    const std::string& output_file, int num_neighbors, int num_queries, int num_shards, int num_requested_shards, const std::string& part_method) {
+    PrintCombinationsOfRoutesAndSearchesImpl(routes, [&](const std::function<void(const ShardSearch&)>& f) {
+        ForEachShardSearch(searches_file, f);
+    }, output_file, num_neighbors, num_queries, num_shards, num_requested_shards, part_method);
+}
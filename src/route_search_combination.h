@@ -22,3 +22,7 @@ void MaxRoutingRecall(const std::vector<RoutingConfig>& routes, const std::vecto
 
 void PrintCombinationsOfRoutesAndSearches(const std::vector<RoutingConfig>& routes, const std::vector<ShardSearch>& shard_searches, const std::string& output_file,
                                           int num_neighbors, int num_queries, int num_shards, int num_requested_shards, const std::string& part_method);
+
+// Streams the searches from searches_file, so that only one of them is in memory at a time
+void PrintCombinationsOfRoutesAndSearches(const std::vector<RoutingConfig>& routes, const std::string& searches_file, const std::string& output_file,
+                                          int num_neighbors, int num_queries, int num_shards, int num_requested_shards, const std::string& part_method);
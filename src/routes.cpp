@@ -182,10 +182,32 @@ std::vector<RoutingConfig> IterateRoutingConfigs(PointSet& points, PointSet& que
         routing_timer.Start();
         // compute routing points and run tree-search routing
         {
+            // the tree only depends on the partition and the options, so it is trained once and loaded in later runs.
+            // A saved tree that was trained on another partition or dataset is retrained
+            const std::string tree_file = routing_index_file + ".kmeans_tree." + std::to_string(routing_index_options.num_centroids) + "." +
+                                          std::to_string(routing_index_options.min_cluster_size) + "." + std::to_string(routing_index_options.budget);
             KMeansTreeRouter router;
-
-            router.Train(points, clusters, routing_index_options);
-            std::cout << "Training the router took " << routing_timer.Stop() << std::endl;
+            bool loaded = false;
+            if (!routing_index_file.empty() && std::filesystem::exists(tree_file)) {
+                try {
+                    router = KMeansTreeRouter::Deserialize(tree_file);
+                    loaded = router.NumShards() == num_shards && router.TrainedOn(points, clusters);
+                    if (!loaded) {
+                        std::cout << tree_file << " was trained on other points or clusters. Retrain it" << std::endl;
+                    }
+                } catch (const std::runtime_error& e) {
+                    std::cout << "Can't load " << tree_file << ": " << e.what() << ". Retrain it" << std::endl;
+                }
+            }
+            if (loaded) {
+                std::cout << "Loading the router from " << tree_file << " took " << routing_timer.Stop() << std::endl;
+            } else {
+                router.Train(points, clusters, routing_index_options);
+                std::cout << "Training the router took " << routing_timer.Stop() << std::endl;
+                if (!routing_index_file.empty()) {
+                    router.Serialize(tree_file);
+                }
+            }
 
             // Standard tree-search routing
             {
@@ -290,7 +312,7 @@ std::vector<RoutingConfig> IterateRoutingConfigs(PointSet& points, PointSet& que
             std::abort();
         }
         std::cout << "Run Pyramid routing" << std::endl;
-        std::vector<int> routing_index_partition = ReadMetisPartition(pyramid_index_file + ".routing_index_partition");
+        std::vector<int> routing_index_partition = ReadPartition(pyramid_index_file + ".routing_index_partition");
         HNSWRouter hnsw_router(pyramid_index_file, points.d, routing_index_partition);
         RoutingConfig blueprint;
         blueprint.index_trainer = "Pyramid";
@@ -303,7 +325,7 @@ std::vector<RoutingConfig> IterateRoutingConfigs(PointSet& points, PointSet& que
             std::abort();
         }
         std::cout << "Run OurPyramid++ routing" << std::endl;
-        std::vector<int> routing_index_partition = ReadMetisPartition(our_pyramid_index_file + ".knn.routing_index_partition");
+        std::vector<int> routing_index_partition = ReadPartition(our_pyramid_index_file + ".knn.routing_index_partition");
         HNSWRouter hnsw_router(our_pyramid_index_file, points.d, routing_index_partition);
         RoutingConfig blueprint;
         blueprint.index_trainer = "OurPyramid+KNN";
@@ -352,7 +374,73 @@ RoutingConfig RoutingConfig::Deserialize(std::ifstream& in) {
 }
 
 
+namespace {
+    constexpr std::string_view ROUTES_MAGIC = "GPANNRTE";
+    constexpr uint32_t ROUTES_FORMAT_VERSION = 1;
+}
+
+void RoutingConfig::Serialize(BinaryWriter& out) const {
+    out.PutString(routing_algorithm);
+    out.PutString(index_trainer);
+    out.PutVarint(hnsw_num_voting_neighbors);
+    out.PutVarint(hnsw_ef_search);
+    out.Put(routing_time);
+    out.PutVarint(routing_distance_calcs);
+    out.Put<uint8_t>(try_increasing_num_shards);
+    out.PutZigZag(routing_index_options.budget);
+    out.PutVarint(routing_index_options.num_centroids);
+    out.PutVarint(routing_index_options.min_cluster_size);
+    out.PutVarint(buckets_to_probe.size());
+    for (const auto& visit_order : buckets_to_probe) {
+        out.PutVarint(visit_order.size());
+    }
+    for (const auto& visit_order : buckets_to_probe) {
+        int prev = 0;
+        for (const int b : visit_order) {
+            out.PutZigZag(b - prev);
+            prev = b;
+        }
+    }
+}
+
+RoutingConfig RoutingConfig::Deserialize(BinaryReader& in) {
+    RoutingConfig r;
+    r.routing_algorithm = in.GetString();
+    r.index_trainer = in.GetString();
+    r.hnsw_num_voting_neighbors = in.GetVarint();
+    r.hnsw_ef_search = in.GetVarint();
+    r.routing_time = in.Get<double>();
+    r.routing_distance_calcs = in.GetVarint();
+    r.try_increasing_num_shards = in.Get<uint8_t>() != 0;
+    r.routing_index_options.budget = in.GetZigZag();
+    r.routing_index_options.num_centroids = in.GetVarint();
+    r.routing_index_options.min_cluster_size = in.GetVarint();
+    r.buckets_to_probe.resize(in.GetVarint());
+    for (auto& visit_order : r.buckets_to_probe) {
+        visit_order.resize(in.GetVarint());
+    }
+    for (auto& visit_order : r.buckets_to_probe) {
+        int prev = 0;
+        for (int& b : visit_order) {
+            b = prev + in.GetZigZag();
+            prev = b;
+        }
+    }
+    return r;
+}
+
 void SerializeRoutes(const std::vector<RoutingConfig>& routes, const std::string& output_file) {
+    BinaryWriter out;
+    out.PutArray(ROUTES_MAGIC.data(), ROUTES_MAGIC.size());
+    out.Put(ROUTES_FORMAT_VERSION);
+    out.PutVarint(routes.size());
+    for (const RoutingConfig& r : routes) {
+        r.Serialize(out);
+    }
+    out.WriteTo(output_file);
+}
+
+void ExportRoutesAsText(const std::vector<RoutingConfig>& routes, const std::string& output_file) {
     std::ofstream out(output_file);
     out << routes.size() << std::endl;
     for (const RoutingConfig& r : routes) {
@@ -362,6 +450,21 @@ void SerializeRoutes(const std::vector<RoutingConfig>& routes, const std::string
 }
 
 std::vector<RoutingConfig> DeserializeRoutes(const std::string& input_file) {
+    if (FileStartsWith(input_file, ROUTES_MAGIC)) {
+        MappedFile file = MapFile(input_file);
+        BinaryReader in(file.data);
+        std::string magic(ROUTES_MAGIC.size(), ' ');
+        in.GetArray(magic.data(), magic.size());
+        if (const uint32_t version = in.Get<uint32_t>(); version != ROUTES_FORMAT_VERSION) {
+            throw std::runtime_error(input_file + " has format version " + std::to_string(version) + ". Expected " + std::to_string(ROUTES_FORMAT_VERSION));
+        }
+        std::vector<RoutingConfig> routes(in.GetVarint());
+        for (RoutingConfig& r : routes) {
+            r = RoutingConfig::Deserialize(in);
+        }
+        return routes;
+    }
+
     std::ifstream in(input_file);
     size_t num_routes;
     std::string header;
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "binary_io.h"
 #include "kmeans_tree_router.h"
 #include "hnsw_router.h"
 
@@ -17,6 +18,11 @@ struct RoutingConfig {
     std::string Serialize() const;
 
     static RoutingConfig Deserialize(std::ifstream& in);
+
+    // The probe orders are stored column-wise: first the lengths, then the zigzag varint coded differences between consecutive shards
+    void Serialize(BinaryWriter& out) const;
+
+    static RoutingConfig Deserialize(BinaryReader& in);
 };
 
 double MaxFirstShardRoutingRecall(const std::vector<std::vector<int>>& buckets_to_probe, const std::vector<NNVec>& ground_truth, int num_neighbors,
@@ -28,8 +34,13 @@ void IterateHNSWRouterConfigsInScheduler(HNSWRouter& hnsw_router, PointSet& quer
 void IterateHNSWRouterConfigs(HNSWRouter& hnsw_router, PointSet& queries, std::vector<RoutingConfig>& routes, const RoutingConfig& blueprint,
                               const std::vector<NNVec>& ground_truth, int num_neighbors, const Cover& cover);
 
+// Binary format
 void SerializeRoutes(const std::vector<RoutingConfig>& routes, const std::string& output_file);
 
+// The old text format, for looking at the routes or processing them with other tools
+void ExportRoutesAsText(const std::vector<RoutingConfig>& routes, const std::string& output_file);
+
+// Reads both formats
 std::vector<RoutingConfig> DeserializeRoutes(const std::string& input_file);
 
 std::vector<RoutingConfig> IterateRoutingConfigs(PointSet& points, PointSet& queries, const Clusters& clusters, int num_shards,
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <parlay/parallel.h>
+
+#include "defs.h"
+#include "dist.h"
+#include "distance_kernels.h"
+
+// 8-bit scalar quantization (SQ8) with a per-dimension range: x_j ~ min[j] + scale[j] * code_j.
+// The encoded points are a UInt8 PointSet, and the distances to them are computed with the uint8 kernels:
+// q . x ~ q . min + (q * scale) . code, plus the precomputed squared norm of the reconstruction for L2.
+// Only meant to pick candidates that are then re-ranked with exact distances.
+struct ScalarQuantizer {
+    std::vector<float> min, scale;
+
+    void Train(PointSet& points) {
+        const size_t d = points.d;
+        // per-chunk ranges, merged afterwards
+        const size_t num_chunks = std::max<size_t>(1, std::min<size_t>(parlay::num_workers(), points.n));
+        const size_t chunk_size = (points.n + num_chunks - 1) / num_chunks;
+        std::vector<std::vector<float>> chunk_min(num_chunks, std::vector<float>(d, std::numeric_limits<float>::max()));
+        std::vector<std::vector<float>> chunk_max(num_chunks, std::vector<float>(d, std::numeric_limits<float>::lowest()));
+        parlay::parallel_for(0, num_chunks, [&](size_t c) {
+            std::vector<float> buffer;
+            for (size_t i = c * chunk_size; i < std::min(points.n, (c + 1) * chunk_size); ++i) {
+                const float* p = points.GetPointAsFloat(i, buffer);
+                for (size_t j = 0; j < d; ++j) {
+                    chunk_min[c][j] = std::min(chunk_min[c][j], p[j]);
+                    chunk_max[c][j] = std::max(chunk_max[c][j], p[j]);
+                }
+            }
+        }, 1);
+        min.assign(d, std::numeric_limits<float>::max());
+        std::vector<float> max(d, std::numeric_limits<float>::lowest());
+        for (size_t c = 0; c < num_chunks; ++c) {
+            for (size_t j = 0; j < d; ++j) {
+                min[j] = std::min(min[j], chunk_min[c][j]);
+                max[j] = std::max(max[j], chunk_max[c][j]);
+            }
+        }
+        scale.resize(d);
+        for (size_t j = 0; j < d; ++j) {
+            scale[j] = max[j] > min[j] ? (max[j] - min[j]) / 255.0f : 1.0f;
+        }
+    }
+
+    // Encodes all points. norms[i] = squared norm of the reconstruction of point i (only needed for L2)
+    PointSet Encode(PointSet& points, std::vector<float>& norms) const {
+        PointSet codes;
+        codes.n = points.n;
+        codes.d = points.d;
+        codes.element_type = ElementType::UInt8;
+        codes.Alloc();
+        norms.assign(points.n, 0.f);
+        parlay::parallel_for(0, points.n, [&](size_t i) {
+            std::vector<float> buffer;
+            const float* p = points.GetPointAsFloat(i, buffer);
+            uint8_t* code = &codes.compact_coordinates[i * codes.d];
+            float norm = 0.f;
+            for (size_t j = 0; j < points.d; ++j) {
+                const float c = std::clamp(std::round((p[j] - min[j]) / scale[j]), 0.0f, 255.0f);
+                code[j] = static_cast<uint8_t>(c);
+                const float reconstructed = min[j] + scale[j] * c;
+                norm += reconstructed * reconstructed;
+            }
+            norms[i] = norm;
+        });
+        return codes;
+    }
+
+    struct Query {
+        std::vector<float> weighted;    // Q * scale
+        float offset = 0.f;             // Q . min
+        float norm = 0.f;               // ||Q||^2
+    };
+
+    Query PrepareQuery(const float* Q) const {
+        Query query;
+        query.weighted.resize(min.size());
+        for (size_t j = 0; j < min.size(); ++j) {
+            query.weighted[j] = Q[j] * scale[j];
+            query.offset += Q[j] * min[j];
+            query.norm += Q[j] * Q[j];
+        }
+        return query;
+    }
+
+    // Approximate distance of the query to the encoded point i of codes
+    static float Distance(const Query& query, const PointSet& codes, const std::vector<float>& norms, size_t i) {
+        const float ip = query.offset + ActiveDistanceKernels().u8.inner_product(query.weighted.data(), codes.GetCompactPoint(i), codes.d);
+#ifdef MIPS_DISTANCE
+        return 1.0f - ip;
+#else
+        return query.norm - 2.0f * ip + norms[i];
+#endif
+    }
+};
@@ -0,0 +1,66 @@
+#include "shard_export.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+#include <parlay/parallel.h>
+
+#include "metis_io.h"
+#include "point_stream.h"
+
+void ExportShards(const std::string& input_file, const Clusters& clusters, const std::string& output_prefix) {
+    Timer timer;
+    timer.Start();
+    PointStream points(input_file);
+    const std::string ending = input_file.substr(input_file.rfind('.'));
+    const size_t point_bytes = points.d * ElementSize(points.element_type);
+
+    Clusters sorted_clusters = clusters;
+    parlay::parallel_for(0, sorted_clusters.size(), [&](size_t b) { std::sort(sorted_clusters[b].begin(), sorted_clusters[b].end()); }, 1);
+    for (size_t b = 0; b < sorted_clusters.size(); ++b) {
+        if (!sorted_clusters[b].empty() && sorted_clusters[b].back() >= points.n) {
+            throw std::runtime_error("Cluster " + std::to_string(b) + " contains point " + std::to_string(sorted_clusters[b].back()) + " but " +
+                                     input_file + " only has " + std::to_string(points.n) + " points");
+        }
+    }
+
+    std::vector<std::unique_ptr<std::ofstream>> outs(sorted_clusters.size());
+    for (size_t b = 0; b < sorted_clusters.size(); ++b) {
+        const std::string path = output_prefix + ".shard" + std::to_string(b) + ending;
+        outs[b] = std::make_unique<std::ofstream>(path, std::ios::binary);
+        if (!*outs[b]) {
+            throw std::runtime_error("Can't open " + path + " for writing");
+        }
+        const uint32_t header[2] = { static_cast<uint32_t>(sorted_clusters[b].size()), static_cast<uint32_t>(points.d) };
+        outs[b]->write(reinterpret_cast<const char*>(header), sizeof(header));
+    }
+
+    // position of the next point of each cluster
+    std::vector<size_t> cursors(sorted_clusters.size(), 0);
+    points.ForEachChunk([&](PointSet& chunk, size_t first) {
+        const uint8_t* data = chunk.IsCompact() ? chunk.compact_coordinates.data() : reinterpret_cast<const uint8_t*>(chunk.coordinates.data());
+        parlay::parallel_for(0, sorted_clusters.size(), [&](size_t b) {
+            const auto& cluster = sorted_clusters[b];
+            size_t& cursor = cursors[b];
+            std::vector<uint8_t> buffer;
+            for (; cursor < cluster.size() && cluster[cursor] < first + chunk.n; ++cursor) {
+                const uint8_t* point = data + (cluster[cursor] - first) * point_bytes;
+                buffer.insert(buffer.end(), point, point + point_bytes);
+            }
+            outs[b]->write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+        }, 1);
+    });
+
+    for (size_t b = 0; b < outs.size(); ++b) {
+        outs[b]->close();
+        if (!*outs[b]) {
+            throw std::runtime_error("Writing shard " + std::to_string(b) + " to " + output_prefix + " failed");
+        }
+    }
+    WriteClusters(sorted_clusters, output_prefix + ".shard_ids");
+    std::cout << "Exported " << sorted_clusters.size() << " shards to " << output_prefix << ".shard<b>" << ending << ". Took " << timer.Stop() << " s"
+              << std::endl;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <string>
+
+#include "defs.h"
+
+// Writes the points of each cluster to a point file of its own, so that a shard host can read or map exactly its points.
+// Shard b goes to output_prefix + ".shard<b>" + the ending of input_file, in the element type of the input.
+// The points of a shard are in ascending order of their global ids. The global ids are written as clusters to
+// output_prefix + ".shard_ids" (see WriteClusters), so list b maps the positions in shard file b to global ids.
+// A point that is in several clusters is written to all of them. The input is read in one sequential pass,
+// in chunks of a PointStream, and the shard files are appended to in parallel.
+void ExportShards(const std::string& input_file, const Clusters& clusters, const std::string& output_prefix);
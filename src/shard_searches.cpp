@@ -1,24 +1,127 @@
 #include "shard_searches.h"
 
+#include <cstring>
+#include <filesystem>
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include "defs.h"
+#include "dist.h"
+#include "scalar_quantization.h"
+#include "topn.h"
 #include "../external/hnswlib/hnswlib/hnswlib.h"
 #include <parlay/parallel.h>
 #include <parlay/sequence.h>
 
-std::vector<ShardSearch> RunInShardSearches(PointSet& points, PointSet& queries, HNSWParameters hnsw_parameters, int num_neighbors,
-                                            const Clusters& clusters, int num_shards, const std::vector<float>& distance_to_kth_neighbor) {
+// Brute-force scans of the SQ8 encoded shard. The top rerank_factor * num_neighbors candidates are re-ranked with exact distances.
+// searches[i] receives the results for sq_rerank_factors[i], in neighbors[0] and time_query_in_shard[0]
+void RunSQ8ShardSearches(PointSet& points, PointSet& queries, int num_neighbors, const std::vector<uint32_t>& cluster,
+                         const std::vector<float>& distance_to_kth_neighbor, const std::vector<int>& sq_rerank_factors, ShardSearch* searches) {
+    Timer build_timer;
+    build_timer.Start();
+    PointSet shard_points = ExtractPointsInBucket(cluster, points);
+    ScalarQuantizer quantizer;
+    quantizer.Train(shard_points);
+    std::vector<float> norms;
+    PointSet codes = quantizer.Encode(shard_points, norms);
+    std::cout << "SQ8 encoding took " << build_timer.Stop() << std::endl;
+
+    for (size_t f = 0; f < sq_rerank_factors.size(); ++f) {
+        const size_t num_candidates = size_t(num_neighbors) * sq_rerank_factors[f];
+        std::vector<NNVec> results(queries.n);
+        Timer total;
+        total.Start();
+        parlay::parallel_for(0, queries.n, [&](size_t q) {
+            float* Q = queries.GetPoint(q);
+            const ScalarQuantizer::Query query = quantizer.PrepareQuery(Q);
+            TopN candidates(num_candidates);
+            for (size_t i = 0; i < codes.n; ++i) {
+                candidates.Add(std::make_pair(ScalarQuantizer::Distance(query, codes, norms, i), uint32_t(i)));
+            }
+            TopN top_k(num_neighbors);
+            for (const auto& [_, i] : candidates.Take()) {
+                top_k.Add(std::make_pair(DistanceToPoint(Q, shard_points, i), i));
+            }
+            results[q] = top_k.Take();
+        }, 10);
+        const double elapsed = total.Stop();
+
+        size_t total_hits = 0;
+        parlay::parallel_for(0, queries.n, [&](size_t q) {
+            searches[f].time_query_in_shard[0][q] = elapsed / queries.n;
+            auto& nn = searches[f].neighbors[0][q];
+            size_t hits = 0;
+            for (const auto& [dist, i] : results[q]) {
+                if (dist <= distance_to_kth_neighbor[q]) {
+                    hits++;
+                    nn.push_back(cluster[i]);
+                }
+            }
+            __atomic_fetch_add(&total_hits, hits, __ATOMIC_RELAXED);
+        });
+        std::cout << "SQ8 shard search with rerank factor " << sq_rerank_factors[f] << " total hits " << total_hits << " time " << elapsed << std::endl;
+    }
+}
+
+// FNV-1a over everything that determines the results of RunInShardSearches, so that a ShardSearchLog of another run isn't resumed.
+// The clusters and the queries are hashed completely, the points only by their shape and a sample, which is enough to tell datasets apart
+uint64_t ShardSearchInputFingerprint(PointSet& points, PointSet& queries, const HNSWParameters& hnsw_parameters, int num_neighbors,
+                                     const Clusters& clusters) {
+    uint64_t h = 14695981039346656037ULL;
+    auto add = [&](const void* data, size_t bytes) {
+        for (size_t i = 0; i < bytes; ++i) {
+            h = (h ^ static_cast<const uint8_t*>(data)[i]) * 1099511628211ULL;
+        }
+    };
+    auto add_value = [&](uint64_t x) { add(&x, sizeof(x)); };
+    add_value(hnsw_parameters.M);
+    add_value(hnsw_parameters.ef_construction);
+    add_value(num_neighbors);
+    add_value(clusters.size());
+    for (const auto& cluster : clusters) {
+        add_value(cluster.size());
+        add(cluster.data(), cluster.size() * sizeof(uint32_t));
+    }
+    std::vector<float> buffer;
+    add_value(queries.n);
+    add_value(queries.d);
+    for (size_t q = 0; q < queries.n; ++q) {
+        add(queries.GetPointAsFloat(q, buffer), queries.d * sizeof(float));
+    }
+    constexpr size_t NUM_SAMPLED_POINTS = 1024;
+    add_value(points.n);
+    add_value(points.d);
+    const size_t stride = std::max<size_t>(1, points.n / NUM_SAMPLED_POINTS);
+    for (size_t i = 0; i < points.n; i += stride) {
+        add(points.GetPointAsFloat(i, buffer), points.d * sizeof(float));
+    }
+    return h;
+}
+
+void RunInShardSearches(PointSet& points, PointSet& queries, HNSWParameters hnsw_parameters, int num_neighbors, const Clusters& clusters, int num_shards,
+                        const std::vector<float>& distance_to_kth_neighbor, const std::string& output_file,
+                        const std::vector<int>& sq_rerank_factors) {
     std::vector<size_t> ef_search_param_values = { 50, 80, 100, 150, 200, 250, 300, 400, 500 };
 
-    Timer init_timer;
-    init_timer.Start();
-    std::vector<ShardSearch> shard_searches(ef_search_param_values.size());
-    for (size_t i = 0; i < ef_search_param_values.size(); ++i) { shard_searches[i].Init(ef_search_param_values[i], num_shards, queries.n); }
-    std::cout << "Init search output took " << init_timer.Stop() << std::endl;
+    std::vector<ShardSearch> shard_searches(ef_search_param_values.size() + sq_rerank_factors.size());
+    for (size_t i = 0; i < ef_search_param_values.size(); ++i) { shard_searches[i].ef_search = ef_search_param_values[i]; }
+    for (size_t i = 0; i < sq_rerank_factors.size(); ++i) {
+        ShardSearch& search = shard_searches[ef_search_param_values.size() + i];
+        search.ef_search = sq_rerank_factors[i];
+        search.shard_query = "SQ8";
+    }
+    ShardSearchLog log(output_file, shard_searches, num_shards, queries.n,
+                       ShardSearchInputFingerprint(points, queries, hnsw_parameters, num_neighbors, clusters));
 
     for (int b = 0; b < num_shards; ++b) {
+        if (log.HasShard(b)) {
+            std::cout << "Shard " << b << " is already in " << output_file << ". Skip it" << std::endl;
+            continue;
+        }
+        // only the results of this shard are kept in memory, in slot 0
+        for (ShardSearch& search : shard_searches) {
+            search.Init(search.ef_search, 1, queries.n);
+        }
         auto cluster = clusters[b];
 
         std::cout << "Start building HNSW for shard " << b << " of size " << cluster.size() << std::endl;
@@ -40,8 +143,13 @@ std::vector<ShardSearch> RunInShardSearches(PointSet& points, PointSet& queries,
 
         // do some insertion sequentially
         const size_t seq_insertion = std::min(1UL << 11, cluster.size());
-        for (size_t i = 0; i < seq_insertion; ++i) { hnsw.addPoint(points.GetPoint(cluster[i]), i); }
-        parlay::parallel_for(seq_insertion, cluster.size(), [&](size_t i) { hnsw.addPoint(points.GetPoint(cluster[i]), i); }, 512);
+        // HNSW stores its own float copy of each point, so compact points are converted on insertion
+        std::vector<float> buffer;
+        for (size_t i = 0; i < seq_insertion; ++i) { hnsw.addPoint(points.GetPointAsFloat(cluster[i], buffer), i); }
+        parlay::parallel_for(seq_insertion, cluster.size(), [&](size_t i) {
+            std::vector<float> point_buffer;
+            hnsw.addPoint(points.GetPointAsFloat(cluster[i], point_buffer), i);
+        }, 512);
 
         std::cout << "HNSW build took " << build_timer.Stop() << std::endl;
 
@@ -72,10 +180,10 @@ std::vector<ShardSearch> RunInShardSearches(PointSet& points, PointSet& queries,
                     // a not so nice hack, but there is no other way to measure parallel runtime, if we don't
                     // want to repeat the query for each probe config (which we don't because it would take forever.
                     // this is the parameter tuning code after all.)
-                    shard_searches[ef_search_param_id].time_query_in_shard[b][q] = elapsed / queries.n;
+                    shard_searches[ef_search_param_id].time_query_in_shard[0][q] = elapsed / queries.n;
 
                     // now transfer the neighbors
-                    auto& nn = shard_searches[ef_search_param_id].neighbors[b][q];
+                    auto& nn = shard_searches[ef_search_param_id].neighbors[0][q];
                     auto& pq = results[q];
                     size_t hits = 0;
                     while (!pq.empty()) {
@@ -98,9 +206,13 @@ std::vector<ShardSearch> RunInShardSearches(PointSet& points, PointSet& queries,
 
             std::cout << "Finished searches in bucket " << b << std::endl;
         });
-    }
 
-    return shard_searches;
+        if (!sq_rerank_factors.empty()) {
+            RunSQ8ShardSearches(points, queries, num_neighbors, cluster, distance_to_kth_neighbor, sq_rerank_factors,
+                                shard_searches.data() + ef_search_param_values.size());
+        }
+        log.Append(b, shard_searches);
+    }
 }
 
 
@@ -109,7 +221,11 @@ std::string ShardSearch::Serialize() const {
     std::stringstream out;
     size_t num_shards = neighbors.size();
     size_t num_queries = neighbors[0].size();
-    out << ef_search << " " << num_shards << " " << num_queries << "\n";
+    out << ef_search << " " << num_shards << " " << num_queries;
+    if (shard_query != "HNSW") {
+        out << " " << shard_query;  // left out for HNSW, so that files in the old format stay readable
+    }
+    out << "\n";
     for (size_t b = 0; b < num_shards; ++b) {
         for (size_t q = 0; q < num_queries; ++q) {
             for (const uint32_t neighbor : neighbors[b][q]) {
@@ -132,6 +248,9 @@ ShardSearch ShardSearch::Deserialize(std::ifstream& in) {
     std::getline(in, line);
     std::istringstream iss(line);
     iss >> s.ef_search >> num_shards >> num_queries;
+    if (std::string shard_query; iss >> shard_query) {
+        s.shard_query = shard_query;
+    }
     s.neighbors.assign(num_shards, std::vector<std::vector<uint32_t>>(num_queries));
     for (int b = 0; b < num_shards; ++b) {
         for (int q = 0; q < num_queries; ++q) {
@@ -156,7 +275,179 @@ ShardSearch ShardSearch::Deserialize(std::ifstream& in) {
     return s;
 }
 
+namespace {
+    constexpr std::string_view SEARCHES_MAGIC = "GPANNSRC";
+    constexpr uint32_t SEARCHES_FORMAT_VERSION = 1;
+
+    // ShardSearchLog files: a header with the searches and the fingerprint of the inputs, then one record per shard, which has a section per search.
+    //   record:  uint64 record_bytes, uint32 shard, sections
+    //   section: uint64 offsets[num_queries + 1], uint32 neighbors[offsets[num_queries]], float times[num_queries]
+    // A record that is cut off at the end of the file was being written during a crash, and is ignored
+    constexpr std::string_view LOG_MAGIC = "GPANNSLG";
+    constexpr uint32_t LOG_FORMAT_VERSION = 2;
+
+    void CheckVersion(BinaryReader& in, std::string_view magic, uint32_t expected_version, const std::string& path) {
+        std::string file_magic(magic.size(), ' ');
+        in.GetArray(file_magic.data(), file_magic.size());
+        if (const uint32_t version = in.Get<uint32_t>(); version != expected_version) {
+            throw std::runtime_error(path + " has format version " + std::to_string(version) + ". Expected " + std::to_string(expected_version));
+        }
+    }
+
+    void WriteLogHeader(BinaryWriter& out, const std::vector<ShardSearch>& blueprints, size_t num_shards, size_t num_queries, uint64_t fingerprint) {
+        out.PutArray(LOG_MAGIC.data(), LOG_MAGIC.size());
+        out.Put(LOG_FORMAT_VERSION);
+        out.PutVarint(blueprints.size());
+        for (const ShardSearch& search : blueprints) {
+            out.PutString(search.shard_query);
+            out.PutVarint(search.ef_search);
+        }
+        out.PutVarint(num_shards);
+        out.PutVarint(num_queries);
+        out.Put(fingerprint);
+    }
+
+    struct LogRecord {
+        uint32_t shard;
+        size_t first_section;   // file position
+    };
+
+    // The complete records starting at file position pos. end receives the position after the last complete record
+    std::vector<LogRecord> ScanLogRecords(std::span<const uint8_t> data, size_t pos, size_t& end) {
+        std::vector<LogRecord> records;
+        while (pos + sizeof(uint64_t) + sizeof(uint32_t) <= data.size()) {
+            uint64_t record_bytes;
+            std::memcpy(&record_bytes, data.data() + pos, sizeof(record_bytes));
+            if (record_bytes > data.size() - pos - sizeof(uint64_t)) {
+                break;
+            }
+            uint32_t shard;
+            std::memcpy(&shard, data.data() + pos + sizeof(uint64_t), sizeof(shard));
+            records.push_back(LogRecord{ .shard = shard, .first_section = pos + sizeof(uint64_t) + sizeof(uint32_t) });
+            pos += sizeof(uint64_t) + record_bytes;
+        }
+        end = pos;
+        return records;
+    }
+
+    // Reads the section of search s in record into search.neighbors[record.shard] and search.time_query_in_shard[record.shard]
+    void ReadLogSection(std::span<const uint8_t> data, const LogRecord& record, size_t s, size_t num_queries, ShardSearch& search) {
+        size_t pos = record.first_section;
+        for (size_t i = 0; i < s; ++i) {
+            // skip the section with the total number of neighbors, i.e., the last offset
+            BinaryReader in(data.subspan(pos + num_queries * sizeof(uint64_t)));
+            const uint64_t num_entries = in.Get<uint64_t>();
+            pos += (num_queries + 1) * sizeof(uint64_t) + num_entries * sizeof(uint32_t) + num_queries * sizeof(float);
+        }
+        BinaryReader in(data.subspan(pos));
+        std::vector<uint64_t> offsets(num_queries + 1);
+        in.GetArray(offsets.data(), offsets.size());
+        for (size_t q = 0; q < num_queries; ++q) {
+            auto& nn = search.neighbors[record.shard][q];
+            nn.resize(offsets[q + 1] - offsets[q]);
+            in.GetArray(nn.data(), nn.size());
+        }
+        std::vector<float> times(num_queries);
+        in.GetArray(times.data(), times.size());
+        search.time_query_in_shard[record.shard].assign(times.begin(), times.end());
+    }
+
+    void ForEachShardSearchInLog(const std::string& input_file, const std::function<void(const ShardSearch&)>& f) {
+        MappedFile file = MapFile(input_file);
+        BinaryReader in(file.data);
+        CheckVersion(in, LOG_MAGIC, LOG_FORMAT_VERSION, input_file);
+        std::vector<ShardSearch> blueprints(in.GetVarint());
+        for (ShardSearch& search : blueprints) {
+            search.shard_query = in.GetString();
+            search.ef_search = in.GetVarint();
+        }
+        const size_t num_shards = in.GetVarint();
+        const size_t num_queries = in.GetVarint();
+        in.Get<uint64_t>();     // the fingerprint only matters for resuming
+        size_t end;
+        const std::vector<LogRecord> records = ScanLogRecords(file.data, in.Position(), end);
+        if (records.size() < num_shards) {
+            std::cerr << input_file << " only has the results of " << records.size() << " / " << num_shards << " shards" << std::endl;
+        }
+        for (size_t s = 0; s < blueprints.size(); ++s) {
+            ShardSearch search;
+            search.Init(blueprints[s].ef_search, num_shards, num_queries);
+            search.shard_query = blueprints[s].shard_query;
+            for (const LogRecord& record : records) {
+                if (record.shard >= num_shards) {
+                    throw std::runtime_error(input_file + " has a record for shard " + std::to_string(record.shard) + " but only " +
+                                             std::to_string(num_shards) + " shards");
+                }
+                ReadLogSection(file.data, record, s, num_queries, search);
+            }
+            f(search);
+        }
+    }
+}
+
+void ShardSearch::Serialize(BinaryWriter& out) const {
+    const size_t num_shards = neighbors.size();
+    const size_t num_queries = num_shards > 0 ? neighbors[0].size() : 0;
+    out.PutString(shard_query);
+    out.PutVarint(ef_search);
+    out.PutVarint(num_shards);
+    out.PutVarint(num_queries);
+    std::vector<uint64_t> offsets(1, 0);
+    offsets.reserve(num_shards * num_queries + 1);
+    for (const auto& shard_neighbors : neighbors) {
+        for (const auto& query_neighbors : shard_neighbors) {
+            offsets.push_back(offsets.back() + query_neighbors.size());
+        }
+    }
+    out.PutArray(offsets.data(), offsets.size());
+    for (const auto& shard_neighbors : neighbors) {
+        for (const auto& query_neighbors : shard_neighbors) {
+            out.PutArray(query_neighbors.data(), query_neighbors.size());
+        }
+    }
+    std::vector<float> times(num_queries);
+    for (const auto& tq : time_query_in_shard) {
+        std::copy(tq.begin(), tq.end(), times.begin());
+        out.PutArray(times.data(), times.size());
+    }
+}
+
+ShardSearch ShardSearch::Deserialize(BinaryReader& in) {
+    ShardSearch s;
+    s.shard_query = in.GetString();
+    s.ef_search = in.GetVarint();
+    const size_t num_shards = in.GetVarint();
+    const size_t num_queries = in.GetVarint();
+    std::vector<uint64_t> offsets(num_shards * num_queries + 1);
+    in.GetArray(offsets.data(), offsets.size());
+    s.neighbors.assign(num_shards, std::vector<std::vector<uint32_t>>(num_queries));
+    for (size_t b = 0, i = 0; b < num_shards; ++b) {
+        for (size_t q = 0; q < num_queries; ++q, ++i) {
+            s.neighbors[b][q].resize(offsets[i + 1] - offsets[i]);
+            in.GetArray(s.neighbors[b][q].data(), s.neighbors[b][q].size());
+        }
+    }
+    std::vector<float> times(num_queries);
+    s.time_query_in_shard.assign(num_shards, std::vector<double>());
+    for (auto& tq : s.time_query_in_shard) {
+        in.GetArray(times.data(), times.size());
+        tq.assign(times.begin(), times.end());
+    }
+    return s;
+}
+
 void SerializeShardSearches(const std::vector<ShardSearch>& shard_searches, const std::string& output_file) {
+    BinaryWriter out;
+    out.PutArray(SEARCHES_MAGIC.data(), SEARCHES_MAGIC.size());
+    out.Put(SEARCHES_FORMAT_VERSION);
+    out.PutVarint(shard_searches.size());
+    for (const ShardSearch& search : shard_searches) {
+        search.Serialize(out);
+    }
+    out.WriteTo(output_file);
+}
+
+void ExportShardSearchesAsText(const std::vector<ShardSearch>& shard_searches, const std::string& output_file) {
     std::ofstream out(output_file);
     out << shard_searches.size() << std::endl;
     for (const ShardSearch& search : shard_searches) {
@@ -166,6 +457,12 @@ void SerializeShardSearches(const std::vector<ShardSearch>& shard_searches, cons
 }
 
 std::vector<ShardSearch> DeserializeShardSearches(const std::string& input_file) {
+    if (FileStartsWith(input_file, SEARCHES_MAGIC) || FileStartsWith(input_file, LOG_MAGIC)) {
+        std::vector<ShardSearch> shard_searches;
+        ForEachShardSearch(input_file, [&](const ShardSearch& search) { shard_searches.push_back(search); });
+        return shard_searches;
+    }
+
     std::ifstream in(input_file);
     size_t num_searches;
     std::string header;
@@ -182,6 +479,84 @@ std::vector<ShardSearch> DeserializeShardSearches(const std::string& input_file)
     return shard_searches;
 }
 
+void ForEachShardSearch(const std::string& input_file, const std::function<void(const ShardSearch&)>& f) {
+    if (FileStartsWith(input_file, LOG_MAGIC)) {
+        ForEachShardSearchInLog(input_file, f);
+    } else if (FileStartsWith(input_file, SEARCHES_MAGIC)) {
+        MappedFile file = MapFile(input_file);
+        BinaryReader in(file.data);
+        CheckVersion(in, SEARCHES_MAGIC, SEARCHES_FORMAT_VERSION, input_file);
+        const size_t num_searches = in.GetVarint();
+        for (size_t i = 0; i < num_searches; ++i) {
+            f(ShardSearch::Deserialize(in));
+        }
+    } else {
+        for (const ShardSearch& search : DeserializeShardSearches(input_file)) {
+            f(search);
+        }
+    }
+}
+
+ShardSearchLog::ShardSearchLog(const std::string& path, const std::vector<ShardSearch>& blueprints, size_t num_shards, size_t num_queries,
+                               uint64_t fingerprint)
+    : num_searches(blueprints.size()), num_queries(num_queries), has_shard(num_shards, false) {
+    BinaryWriter header;
+    WriteLogHeader(header, blueprints, num_shards, num_queries, fingerprint);
+    size_t valid_bytes = 0;
+    if (FileStartsWith(path, header.Bytes())) {
+        MappedFile file = MapFile(path);
+        size_t num_done = 0;
+        for (const LogRecord& record : ScanLogRecords(file.data, header.Bytes().size(), valid_bytes)) {
+            if (record.shard < num_shards && !has_shard[record.shard]) {
+                has_shard[record.shard] = true;
+                num_done++;
+            }
+        }
+        std::cout << "Resume the shard searches in " << path << ". " << num_done << " / " << num_shards << " shards are done" << std::endl;
+    }
+
+    if (valid_bytes > 0) {
+        std::filesystem::resize_file(path, valid_bytes);   // drop a record that was cut off
+        out.open(path, std::ios::binary | std::ios::app);
+    } else {
+        out.open(path, std::ios::binary | std::ios::trunc);
+        out.write(header.Bytes().data(), header.Bytes().size());
+        out.flush();
+    }
+    if (!out) {
+        throw std::runtime_error("Can't open " + path + " for writing");
+    }
+}
+
+void ShardSearchLog::Append(int b, const std::vector<ShardSearch>& shard_results) {
+    if (shard_results.size() != num_searches) {
+        throw std::runtime_error("ShardSearchLog::Append expects results for all " + std::to_string(num_searches) + " searches");
+    }
+    BinaryWriter record;
+    record.Put<uint32_t>(b);
+    for (const ShardSearch& search : shard_results) {
+        std::vector<uint64_t> offsets(1, 0);
+        for (size_t q = 0; q < num_queries; ++q) {
+            offsets.push_back(offsets.back() + search.neighbors[0][q].size());
+        }
+        record.PutArray(offsets.data(), offsets.size());
+        for (size_t q = 0; q < num_queries; ++q) {
+            record.PutArray(search.neighbors[0][q].data(), search.neighbors[0][q].size());
+        }
+        std::vector<float> times(search.time_query_in_shard[0].begin(), search.time_query_in_shard[0].end());
+        record.PutArray(times.data(), times.size());
+    }
+    // the size goes first, so that a record cut off by a crash can be recognized
+    const uint64_t record_bytes = record.Bytes().size();
+    out.write(reinterpret_cast<const char*>(&record_bytes), sizeof(record_bytes));
+    out.write(record.Bytes().data(), record.Bytes().size());
+    out.flush();
+    if (!out) {
+        throw std::runtime_error("Appending the results of shard " + std::to_string(b) + " to the shard search log failed");
+    }
+    has_shard[b] = true;
+}
+
 ShardSearch DeserializeOldFormat(std::ifstream& in) {
     ShardSearch s;
     int num_shards, num_queries;
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <fstream>
+#include <functional>
+
+#include "binary_io.h"
 #include "defs.h"
 
 struct ShardSearch {
@@ -12,6 +16,8 @@ struct ShardSearch {
         neighbors.assign(num_shards, std::vector<std::vector<uint32_t>>(num_queries));
     }
 
+    // HNSW or SQ8. For SQ8, ef_search holds the re-rank factor
+    std::string shard_query = "HNSW";
     size_t ef_search = 0;
     // std::vector<std::vector<int>> query_hits_in_shard;
     // num shards X num queries X num top-k neighbors found
@@ -22,13 +28,53 @@ struct ShardSearch {
     std::string Serialize() const;
 
     static ShardSearch Deserialize(std::ifstream& in);
+
+    // The neighbors are stored as CSR over all (shard, query) pairs, the times as float matrix
+    void Serialize(BinaryWriter& out) const;
+
+    static ShardSearch Deserialize(BinaryReader& in);
 };
 
+// Binary format
 void SerializeShardSearches(const std::vector<ShardSearch>& shard_searches, const std::string& output_file);
 
+// The text format, for looking at the searches or processing them with other tools
+void ExportShardSearchesAsText(const std::vector<ShardSearch>& shard_searches, const std::string& output_file);
+
+// Reads the binary and the text format, as well as ShardSearchLog files
 std::vector<ShardSearch> DeserializeShardSearches(const std::string& input_file);
 
+// Calls f for the searches in input_file one after another, so that only one of them is in memory at a time.
+// Text files are read as a whole
+void ForEachShardSearch(const std::string& input_file, const std::function<void(const ShardSearch&)>& f);
+
+// Collects the results of the shard searches on disk, one record per shard that is appended as soon as the searches in the shard are done.
+// A crash only loses the shard in progress: if the file already exists with the same searches and the same fingerprint of the inputs,
+// its complete shards are kept, and the run can skip them. Otherwise the file is overwritten.
+class ShardSearchLog {
+public:
+    // blueprints holds the shard_query and ef_search of each search. fingerprint identifies the inputs the results depend on
+    // (see ShardSearchInputFingerprint)
+    ShardSearchLog(const std::string& path, const std::vector<ShardSearch>& blueprints, size_t num_shards, size_t num_queries, uint64_t fingerprint);
+
+    bool HasShard(int b) const { return has_shard[b]; }
+
+    // shard_results[i] holds the results of the i-th search in shard b, in neighbors[0] and time_query_in_shard[0]
+    void Append(int b, const std::vector<ShardSearch>& shard_results);
+
+private:
+    std::ofstream out;
+    size_t num_searches, num_queries;
+    std::vector<bool> has_shard;
+};
+
 std::vector<ShardSearch> DeserializeShardSearchesOldFormat(const std::string& input_file);
 
-std::vector<ShardSearch> RunInShardSearches(PointSet& points, PointSet& queries, HNSWParameters hnsw_parameters, int num_neighbors,
-                                            const Clusters& clusters, int num_shards, const std::vector<float>& distance_to_kth_neighbor);
+// A hash of the clusters, the queries, a sample of the points and the parameters of RunInShardSearches
+uint64_t ShardSearchInputFingerprint(PointSet& points, PointSet& queries, const HNSWParameters& hnsw_parameters, int num_neighbors,
+                                     const Clusters& clusters);
+
+// Writes the results to a ShardSearchLog at output_file. Shards that are already in the log are skipped
+void RunInShardSearches(PointSet& points, PointSet& queries, HNSWParameters hnsw_parameters, int num_neighbors, const Clusters& clusters, int num_shards,
+                        const std::vector<float>& distance_to_kth_neighbor, const std::string& output_file,
+                        const std::vector<int>& sq_rerank_factors = {});
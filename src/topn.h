@@ -29,4 +29,7 @@ struct TopN {
     }
 
     const value_type& Top() const { return pq.top(); }
+
+    // once full, Top().first is the distance a new element has to beat
+    bool Full() const { return pq.size() >= n; }
 };